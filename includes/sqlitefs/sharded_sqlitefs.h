@@ -0,0 +1,73 @@
+#pragma once
+
+#include <mutex>
+#include <sqlitefs/sqlitefs.h>
+
+
+// spreads the tree over several database files so writes to different shards don't wait for each other.
+// Every top level entry lives in the shard picked by a hash of its name, the root itself exists in all of them.
+// Each shard is a separate SQLiteFS with its own connection, lock and transactions.
+// mv/cp between shards fall back to copying and aren't atomic. Node ids are unique only inside a shard
+class ShardedSQLiteFS {
+public:
+    using Data        = SQLiteFS::Data;
+    using DataInput   = SQLiteFS::DataInput;
+    using DataOutput  = SQLiteFS::DataOutput;
+    using ConvertFunc = SQLiteFS::ConvertFunc;
+    using Options     = SQLiteFS::Options;
+
+    // the order of paths defines the layout, always open the same files in the same order
+    ShardedSQLiteFS(const std::vector<std::string>& paths, std::string_view key = "", const Options& options = {});
+    virtual ~ShardedSQLiteFS();
+
+    std::size_t     shards() const noexcept;
+    SQLiteFS&       shard(std::size_t index);
+    const SQLiteFS& shard(std::size_t index) const;
+    // shard the path belongs to, relative paths are resolved from pwd. The root belongs to the first shard
+    std::size_t shardOf(const std::string& path) const;
+
+    void vacuum();
+    bool flush();
+
+    // messages of the last errors of all shards. Resets them
+    std::string error() const;
+    // the first error code found in the shards
+    SQLiteFSError errorCode() const noexcept;
+
+    bool                      mkdir(const std::string& name);
+    bool                      cd(const std::string& name);
+    bool                      rm(const std::string& name);
+    std::string               pwd() const;
+    std::vector<SQLiteFSNode> ls(const std::string& path = ".") const;
+    bool                      write(const std::string& name, DataInput data, const std::string& alg = "raw");
+    DataOutput                read(const std::string& name) const;
+    bool                      update(const std::string& name, DataInput data, const std::string& alg = "raw");
+    bool                      mv(const std::string& from, const std::string& to);
+    bool                      cp(const std::string& from, const std::string& to);
+
+    SQLiteFSResult<SQLiteFSNode> stat(const std::string& path) const;
+    bool                         exists(const std::string& path) const;
+    SQLiteFSResult<DataOutput>   tryRead(const std::string& name) const;
+    std::optional<SQLiteFSUsage> du(const std::string& path = ".") const;
+
+    std::vector<SQLiteFSVersion> versions(const std::string& name) const;
+    SQLiteFSResult<DataOutput>   readVersion(const std::string& name, std::uint32_t version) const;
+    // the root is recompressed shard by shard, every shard gets the whole budget
+    std::size_t recompress(const std::string& path, const std::string& alg, std::int64_t budget = 0);
+
+    void registerSaveFunc(const std::string& name, const ConvertFunc& func);
+    void registerLoadFunc(const std::string& name, const ConvertFunc& func);
+
+private:
+    // path split into names from the root, "." and ".." are resolved
+    std::vector<std::string> resolve(const std::string& path) const;
+    std::size_t              shardOf(const std::vector<std::string>& names) const;
+    // pwd follows a moved folder and falls back to the root when its folder is removed
+    void followCwd(const std::vector<std::string>& from, std::optional<std::vector<std::string>> to);
+    bool copy(SQLiteFS& from_fs, const std::string& from, SQLiteFS& to_fs, const std::string& to) const;
+
+private:
+    std::vector<std::unique_ptr<SQLiteFS>> m_shards;
+    std::vector<std::string>               m_cwd;
+    mutable std::mutex                     m_cwd_mutex;
+};
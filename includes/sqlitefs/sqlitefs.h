@@ -1,9 +1,14 @@
 #pragma once
 
+#include <algorithm>
+#include <chrono>
 #include <functional>
 #include <memory>
+#include <memory_resource>
+#include <optional>
 #include <span>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -26,35 +31,398 @@ struct SQLiteFSNode final {
     auto operator<=>(const SQLiteFSNode&) const noexcept = default;
 };
 
+enum class SQLiteFSError : std::uint8_t {
+    NONE,
+    NOT_FOUND,
+    NOT_A_FILE,
+    ALREADY_EXISTS,
+    INVALID_TARGET, // e.g. a folder moved inside itself
+    READ_ONLY,
+    BUSY,
+    SIZE_MISMATCH,
+    CORRUPTED, // stored data doesn't match its checksum
+    IO,
+    SQL,
+    INTERNAL,
+};
+
+// static description of the code, nothing is allocated
+const char* describe(SQLiteFSError error) noexcept;
+
+// value or error code, a small stand-in for std::expected
+template<typename T>
+class SQLiteFSResult final {
+public:
+    SQLiteFSResult(T value) : m_value(std::move(value)) {} // NOLINT
+    SQLiteFSResult(SQLiteFSError error)                      // NOLINT
+      : m_error(error == SQLiteFSError::NONE ? SQLiteFSError::INTERNAL : error) {}
+
+    bool          has_value() const noexcept { return m_value.has_value(); }
+    explicit      operator bool() const noexcept { return has_value(); }
+    SQLiteFSError error() const noexcept { return m_error; }
+
+    const T& value() const& { return m_value.value(); }
+    T&       value() & { return m_value.value(); }
+    T&&      value() && { return std::move(m_value).value(); }
+    const T& operator*() const& { return *m_value; }
+    T&       operator*() & { return *m_value; }
+    const T* operator->() const { return &*m_value; }
+    T*       operator->() { return &*m_value; }
+
+    template<typename U>
+    T value_or(U&& fallback) const& {
+        return m_value.value_or(std::forward<U>(fallback));
+    }
+
+private:
+    std::optional<T> m_value;
+    SQLiteFSError    m_error = SQLiteFSError::NONE;
+};
+
+// connection tuning. Default values keep the SQLite defaults
+struct SQLiteFSOptions final {
+    enum class JournalMode : std::uint8_t { DEFAULT, DELETE, TRUNCATE, PERSIST, MEMORY, WAL, OFF };
+    enum class Synchronous : std::uint8_t { DEFAULT, OFF, NORMAL, FULL, EXTRA };
+    enum class TempStore : std::uint8_t { DEFAULT, FILE, MEMORY };
+    enum class AutoVacuum : std::uint8_t { DEFAULT, NONE, FULL, INCREMENTAL };
+    enum class Verify : std::uint8_t { NEVER, SAMPLED, ALWAYS };
+
+    // keep an ancestor/descendant table so pwd, subtree checks and subtree deletes are plain index lookups.
+    // Once built it stays in the database and triggers keep it up to date
+    bool ancestor_index = false;
+
+    JournalMode                 journal_mode = JournalMode::DEFAULT;
+    Synchronous                 synchronous  = Synchronous::DEFAULT;
+    TempStore                   temp_store   = TempStore::DEFAULT;
+    std::optional<std::int64_t> mmap_size;  // bytes
+    std::optional<std::int64_t> cache_size; // pages, or KiB if negative
+    std::optional<std::int32_t> page_size;  // bytes. Applied before keying, so it works for new encrypted files
+    std::int32_t                busy_timeout_ms = 0;
+    bool                        read_only       = false;
+    bool                        immutable       = false; // read only and nobody changes the file while it's open
+
+    // switching an existing database to another mode takes effect after the next vacuum()
+    AutoVacuum auto_vacuum = AutoVacuum::DEFAULT;
+
+    // with INCREMENTAL auto vacuum, free up to reclaim_pages every reclaim_interval in background. 0 - disabled
+    std::chrono::milliseconds reclaim_interval{0};
+    std::uint32_t             reclaim_pages = 256; // NOLINT
+
+    // load the whole database into memory and work with the copy. Changes are written back by flush(),
+    // every flush_interval (0 - disabled) and on destruction
+    bool                      in_memory = false;
+    std::chrono::milliseconds flush_interval{0};
+
+    // log every change into a journal read by changesSince(). Once created the journal stays in the database
+    // and is always written. journal_keep > 0 keeps only that many last entries
+    bool         change_journal = false;
+    std::int64_t journal_keep   = 0;
+
+    // files bigger than this after compression are kept out of the database as separate files
+    // in the "<path>.blobs" folder and read through mmap. 0 - disabled.
+    // With a key they are encrypted (ChaCha20) with a key derived from it and decrypted on read,
+    // plain sidecars written before the key was set are encrypted on open
+    std::int64_t sidecar_threshold = 0;
+
+    // keep a CRC32C of every file as it's stored (after compression). Files written before are hashed when
+    // the checksums are created, after that they stay in the database and are always written
+    bool checksums = false;
+    // checks the stored data on read. SAMPLED checks every verify_sample-th read
+    Verify        verify        = Verify::NEVER;
+    std::uint32_t verify_sample = 16; // NOLINT
+
+    // update() splits files into chunks of about this size (a power of two). Smaller chunks make small
+    // edits cheaper and the chunk list longer
+    std::uint32_t update_chunk_size = 16384; // NOLINT
+    // update() keeps that many previous versions of a file, 0 - none. A version costs only the chunks
+    // it doesn't share with the newer ones. The history is removed together with the file
+    std::uint32_t keep_versions = 0;
+
+    // rewrites files under recompress_path that aren't stored with recompress_alg in background, up to
+    // recompress_bytes of raw data every recompress_interval (0 - disabled). See SQLiteFS::recompress.
+    // The worker starts when the save func of recompress_alg is registered and skips a tick unless no other
+    // operation took the fs lock for recompress_idle
+    std::string               recompress_alg;
+    std::string               recompress_path = "/";
+    std::chrono::milliseconds recompress_interval{0};
+    std::int64_t              recompress_bytes = 1 << 20; // NOLINT
+    std::chrono::milliseconds recompress_idle{100};      // NOLINT
+
+    // sums up what SQLite spends on every statement text, see SQLiteFS::queryStats. Statements running longer
+    // than slow_query_threshold (0 - disabled) go to the slow query callback and to Tracy in profiler builds
+    bool                      query_stats = false;
+    std::chrono::microseconds slow_query_threshold{0};
+
+    // counts how long every kind of operation waits for the fs lock and holds it, see SQLiteFS::lockStats
+    bool lock_stats = false;
+};
+
+struct SQLiteFSSpace final {
+    std::int64_t page_size      = 0;
+    std::int64_t page_count     = 0;
+    std::int64_t freelist_count = 0;
+
+    auto operator<=>(const SQLiteFSSpace&) const noexcept = default;
+};
+
+struct SQLiteFSCheck final {
+    std::int64_t             files     = 0; // files checked
+    std::int64_t             unchecked = 0; // files without a checksum
+    std::vector<std::string> corrupted;     // paths of files that don't match their checksum or have no data
+};
+
+struct SQLiteFSUsage final {
+    std::int64_t files    = 0;
+    std::int64_t size     = 0;
+    std::int64_t size_raw = 0;
+
+    auto operator<=>(const SQLiteFSUsage&) const noexcept = default;
+};
+
+struct SQLiteFSChange final {
+    enum class Op : std::uint8_t { MKDIR, WRITE, RM, MV, CP, UPDATE };
+
+    std::int64_t  seq = 0;
+    Op            op  = Op::MKDIR;
+    std::uint32_t id  = 0;
+    std::string   path;     // after the change, for RM before it
+    std::int64_t  size = 0; // size_raw of the file or the whole subtree
+
+    auto operator<=>(const SQLiteFSChange&) const noexcept = default;
+};
+
+// previous data of a file kept by update(), see Options::keep_versions
+struct SQLiteFSVersion final {
+    std::uint32_t version  = 0; // grows with every update, the oldest kept one isn't always 1
+    std::int64_t  size     = 0;
+    std::int64_t  size_raw = 0;
+    std::string   compression;
+    std::int64_t  time = 0; // unix time it was replaced
+
+    auto operator<=>(const SQLiteFSVersion&) const noexcept = default;
+};
+
+// what the statements with the same text cost, see Options::query_stats. The slow query callback gets a single run
+struct SQLiteFSQueryStats final {
+    std::string              sql; // as prepared, parameters aren't expanded
+    std::int64_t             calls = 0;
+    std::chrono::nanoseconds time{0};
+    std::chrono::nanoseconds max_time{0};
+    std::int64_t             vm_steps        = 0;
+    std::int64_t             full_scan_steps = 0; // steps of full table scans, a missing index shows up here
+    std::int64_t             sorts           = 0;
+    std::int64_t             auto_index_rows = 0; // rows put into automatic indexes
+    // approximate: SQLite counts page cache use per connection, not per statement. These are the pages read
+    // since the previous statement finished, so they are only right when one statement runs at a time. With
+    // statements left open (find callbacks, LsCursor, ReadView) or shared readers they go to whoever finishes
+    std::int64_t cache_hits   = 0;
+    std::int64_t cache_misses = 0;
+};
+
+// fs lock use of one kind of operation, see Options::lock_stats
+struct SQLiteFSLockStats final {
+    std::string              op;
+    std::int64_t             acquisitions = 0;
+    std::int64_t             contended    = 0; // acquisitions that had to wait
+    std::chrono::nanoseconds wait{0};
+    std::chrono::nanoseconds max_wait{0};
+    std::chrono::nanoseconds hold{0};
+    std::chrono::nanoseconds max_hold{0};
+};
+
+// struct-of-arrays folder listing. All names share one buffer and codec names are stored once
+struct SQLiteFSListing final {
+    static constexpr std::uint16_t NO_CODEC = 0xFFFF;
+
+    std::vector<std::uint32_t>            ids;
+    std::vector<std::uint32_t>            parent_ids;
+    std::vector<std::int64_t>             sizes;
+    std::vector<std::int64_t>             sizes_raw;
+    std::vector<SQLiteFSNode::Attributes> attributes;
+    std::vector<std::uint16_t>            codec_ids;    // index in codecs or NO_CODEC
+    std::vector<std::uint32_t>            name_offsets; // size() + 1 offsets in names
+    std::string                           names;
+    std::vector<std::string>              codecs;
+
+    std::size_t      size() const noexcept { return ids.size(); }
+    bool             empty() const noexcept { return ids.empty(); }
+    std::string_view name(std::size_t i) const noexcept;
+    std::string_view compression(std::size_t i) const noexcept;
+    SQLiteFSNode     node(std::size_t i) const;
+
+    // returns entry indices ordered by less(i, j), the listing itself isn't moved
+    template<typename Less>
+    std::vector<std::uint32_t> sorted(Less less) const {
+        std::vector<std::uint32_t> order(size());
+        for (std::uint32_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), less);
+        return order;
+    }
+};
+
 struct SQLiteFS {
     using Data            = char;
     using DataInput       = std::span<const Data>;
     using DataOutput      = std::vector<Data>;
     using ConvertFunc     = std::function<DataOutput(DataInput)>;
     using ConvertFuncsMap = std::unordered_map<std::string, ConvertFunc>;
+    using Options         = SQLiteFSOptions;
+
+    // the same with caller supplied memory, e.g. a per frame std::pmr::monotonic_buffer_resource
+    using PmrDataOutput      = std::pmr::vector<Data>;
+    using PmrConvertFunc     = std::function<PmrDataOutput(DataInput, std::pmr::memory_resource*)>;
+    using PmrConvertFuncsMap = std::unordered_map<std::string, PmrConvertFunc>;
+
+    // empty/unset fields don't filter. name is a GLOB pattern, sizes are compared with size_raw
+    struct FindFilter {
+        std::string                             name;
+        std::optional<SQLiteFSNode::Attributes> attributes;
+        std::optional<std::int64_t>             min_size;
+        std::optional<std::int64_t>             max_size;
+        std::string                             compression;
+        std::optional<std::uint32_t>            max_depth;
+    };
+
+    // return false to stop the walk. Called under the fs lock, so don't call SQLiteFS from it
+    using FindCallback = std::function<bool(const SQLiteFSNode&)>;
+    // gets a statement slower than Options::slow_query_threshold. Called under the fs lock as well, but the stats
+    // aren't locked, so queryStats() works from it
+    using SlowQueryCallback = std::function<void(const SQLiteFSQueryStats&)>;
+    // gets a failure of a background worker, they don't change error(). Called on the worker thread
+    using WorkerErrorCallback = std::function<void(SQLiteFSError, const std::string&)>;
+
+    // streams a folder in name order page by page. The fs lock is held only while a page is fetched
+    class LsCursor {
+    public:
+        LsCursor(const SQLiteFS& fs, std::string path, std::size_t page_size = 1024); // NOLINT
+
+        // returns nullptr at the end. The pointer is valid until the next call
+        const SQLiteFSNode* next();
+
+    private:
+        const SQLiteFS*           m_fs;
+        std::string               m_path;
+        std::string               m_after;
+        std::size_t               m_page_size;
+        std::vector<SQLiteFSNode> m_page;
+        std::size_t               m_pos  = 0;
+        bool                      m_done = false;
+    };
+
+    class ReadView;
 
-    SQLiteFS(std::string path, std::string_view key = "");
+    SQLiteFS(std::string path, std::string_view key = "", const Options& options = {});
     virtual ~SQLiteFS();
 
     const std::string& path() const noexcept;
     void               vacuum();
-    std::string        error() const;
+
+    // message of the last error, built only here. Resets the error
+    std::string error() const;
+    // code of the last error without building the message or locking
+    SQLiteFSError errorCode() const noexcept;
+
+    // checks all stored files against their checksums, the fs is locked until it's done. Every thread
+    // (0 - one per core) reads through its own connection, in memory mode the check runs on one thread
+    SQLiteFSCheck fsck(unsigned threads = 0) const;
+
+    // free up to max_pages pages from the freelist, needs INCREMENTAL auto vacuum. Returns freed pages
+    std::size_t   reclaim(std::size_t max_pages);
+    SQLiteFSSpace space() const;
+
+    // online copy to dest_path, the fs lock is released between steps. An empty key makes a plain database.
+    // Sidecars are copied to "<dest_path>.blobs", re-encrypted if the key differs
+    bool backup(const std::string& dest_path, std::string_view key = "", int pages_per_step = 256); // NOLINT
+    // whole database as a plain (decrypted) image, ready for sqlite3_deserialize or to be saved as a file.
+    // Files kept in sidecars (Options::sidecar_threshold) are put into the image, it doesn't need the folder
+    DataOutput snapshot() const;
+    // in memory mode writes all changes back to the file in one transaction
+    bool flush();
+    // brings a replica file up to date for readers opening it with read_only. With the change journal only nodes
+    // changed since the last call are copied, a new replica or one that fell behind a pruned journal gets a backup
+    bool replicate(const std::string& replica_path, std::string_view key = "");
 
     bool                      mkdir(const std::string& name);
     bool                      cd(const std::string& name);
     bool                      rm(const std::string& name);
     std::string               pwd() const;
     std::vector<SQLiteFSNode> ls(const std::string& path = ".") const;
+    SQLiteFSListing           list(const std::string& path = ".") const;
+    std::vector<SQLiteFSNode> ls(const std::string& path, const std::string& after_name, std::size_t limit) const;
+    std::size_t               find(const std::string&  path,
+                                   const FindFilter&   filter,
+                                   const FindCallback& callback) const;
     bool                      write(const std::string& name, DataInput data, const std::string& alg = "raw");
     DataOutput                read(const std::string& name) const;
+    PmrDataOutput             read(const std::string& name, std::pmr::memory_resource* resource) const;
+    bool                      write(const std::string&         name,
+                                    DataInput                  data,
+                                    const std::string&         alg,
+                                    std::pmr::memory_resource* resource);
+    ReadView                  readView(const std::string& name) const;
+    // creates or rewrites a file. The data is split into content defined chunks and only chunks that aren't
+    // stored yet are written, so a small edit of a big file costs about the size of the edit. The file keeps
+    // the chunks until it's removed, reads put them together
+    bool                      update(const std::string& name, DataInput data, const std::string& alg = "raw");
     bool                      mv(const std::string& from, const std::string& to);
     bool                      cp(const std::string& from, const std::string& to);
 
+    // node metadata only, data isn't touched. statMany resolves all paths under one lock and reuses
+    // lookups of shared folders
+    SQLiteFSResult<SQLiteFSNode>              stat(const std::string& path) const;
+    bool                                      exists(const std::string& path) const;
+    std::vector<SQLiteFSResult<SQLiteFSNode>> statMany(std::span<const std::string> paths) const;
+
+    // versions kept by update() from the oldest, the current data isn't one of them
+    std::vector<SQLiteFSVersion> versions(const std::string& name) const;
+    SQLiteFSResult<DataOutput>   readVersion(const std::string& name, std::uint32_t version) const;
+
+    // stores files of the subtree with another codec in id order. Every file is decoded and encoded without the
+    // lock and replaced in its own transaction. Stops after budget bytes of rewritten raw data (0 - no limit), at
+    // least one file is done. Files that fail are passed and don't take the budget. update()d files keep their
+    // codec. Returns how many files were rewritten
+    std::size_t recompress(const std::string& path, const std::string& alg, std::int64_t budget = 0);
+
+    // journal entries after seq in order, see Options::change_journal. Pass the last seen seq to get the next ones
+    std::vector<SQLiteFSChange> changesSince(std::int64_t seq, std::size_t limit = 1024) const; // NOLINT
+    // removes entries up to seq including it, returns how many were removed
+    std::size_t pruneChanges(std::int64_t seq);
+
+    // the same as read, but an empty file can't be confused with an error
+    SQLiteFSResult<DataOutput> tryRead(const std::string& name) const;
+
+    // files count and sizes of the whole subtree, kept up to date by write/rm/mv/cp
+    std::optional<SQLiteFSUsage> du(const std::string& path = ".") const;
+
     void registerSaveFunc(const std::string& name, const ConvertFunc& func);
     void registerLoadFunc(const std::string& name, const ConvertFunc& func);
 
+    // used by the memory_resource overloads of read/write. Without them the plain funcs are called
+    // and the result is copied into the resource
+    void registerSaveFunc(const std::string& name, const PmrConvertFunc& func);
+    void registerLoadFunc(const std::string& name, const PmrConvertFunc& func);
+
     DataOutput callSaveFunc(const std::string& name, DataInput data);
     DataOutput callLoadFunc(const std::string& name, DataInput data);
+    // names of the codecs with both funcs registered, sorted
+    std::vector<std::string> codecs() const;
+
+    // per statement totals since the start or the last reset, the most expensive first. Empty without
+    // Options::query_stats
+    std::vector<SQLiteFSQueryStats> queryStats() const;
+    void                            resetQueryStats();
+    void                            setSlowQueryCallback(SlowQueryCallback callback);
+
+    // operations that took the fs lock since the start or the last reset, the longest total wait first.
+    // Empty without Options::lock_stats
+    std::vector<SQLiteFSLockStats> lockStats() const;
+    void                           resetLockStats();
+
+    // failures of the background workers (recompress, reclaim, flush) since the start
+    std::int64_t workerErrors() const noexcept;
+    void         setWorkerErrorCallback(WorkerErrorCallback callback);
 
 protected:
     // if you want to expand interface
@@ -64,3 +432,22 @@ private:
     struct Impl;
     std::unique_ptr<Impl> m_impl;
 };
+
+// file content without copies: "raw" files point straight into SQLite's buffer or the mapped sidecar file,
+// others and encrypted sidecars hold the decoded data. A view of an inline raw file keeps the fs locked until it's destroyed,
+// so keep it short lived and don't call SQLiteFS while holding it
+class SQLiteFS::ReadView {
+public:
+    ReadView();
+    ~ReadView();
+    ReadView(ReadView&& other) noexcept;
+    ReadView& operator=(ReadView&& other) noexcept;
+
+    DataInput data() const noexcept;
+    explicit operator bool() const noexcept { return m_state != nullptr; }
+
+private:
+    friend struct SQLiteFS::Impl;
+    struct State;
+    std::unique_ptr<State> m_state;
+};
@@ -0,0 +1,191 @@
+#include "chunker.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include "utils.h"
+
+
+namespace
+{
+constexpr std::uint64_t splitmix64(std::uint64_t& state) noexcept {
+    std::uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z               = (z ^ (z >> 30U)) * 0xBF58476D1CE4E5B9ULL;
+    z               = (z ^ (z >> 27U)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31U);
+}
+
+// random values for every byte. Fixed, chunks of stored files depend on them
+constexpr auto GEAR = [] {
+    std::array<std::uint64_t, 256> table{}; // NOLINT
+    std::uint64_t                  state = 0;
+    for (auto& value : table) {
+        value = splitmix64(state);
+    }
+    return table;
+}();
+
+constexpr std::uint64_t fmix64(std::uint64_t value) noexcept {
+    value ^= value >> 33U;
+    value *= 0xFF51AFD7ED558CCDULL;
+    value ^= value >> 33U;
+    value *= 0xC4CEB9FE1A85EC53ULL;
+    value ^= value >> 33U;
+    return value;
+}
+
+constexpr std::array<std::uint32_t, 64> SHA256_K{
+  0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+  0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+  0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+  0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+  0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+  0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+  0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+  0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2}; // NOLINT
+
+void sha256Block(std::array<std::uint32_t, 8>& state, const unsigned char* block) noexcept {
+    std::array<std::uint32_t, 64> w{}; // NOLINT
+    for (std::size_t i = 0; i < 16; ++i) { // NOLINT
+        w[i] = (std::uint32_t{block[i * 4]} << 24U) | (std::uint32_t{block[i * 4 + 1]} << 16U) |
+               (std::uint32_t{block[i * 4 + 2]} << 8U) | std::uint32_t{block[i * 4 + 3]}; // NOLINT
+    }
+    for (std::size_t i = 16; i < 64; ++i) { // NOLINT
+        auto s0 = std::rotr(w[i - 15], 7) ^ std::rotr(w[i - 15], 18) ^ (w[i - 15] >> 3U);  // NOLINT
+        auto s1 = std::rotr(w[i - 2], 17) ^ std::rotr(w[i - 2], 19) ^ (w[i - 2] >> 10U);   // NOLINT
+        w[i]    = w[i - 16] + s0 + w[i - 7] + s1;                                          // NOLINT
+    }
+
+    auto [a, b, c, d, e, f, g, h] = state;
+    for (std::size_t i = 0; i < 64; ++i) { // NOLINT
+        auto t1 = h + (std::rotr(e, 6) ^ std::rotr(e, 11) ^ std::rotr(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] +
+                  w[i];                                                                                   // NOLINT
+        auto t2 = (std::rotr(a, 2) ^ std::rotr(a, 13) ^ std::rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c)); // NOLINT
+        h       = g;
+        g       = f;
+        f       = e;
+        e       = d + t1;
+        d       = c;
+        c       = b;
+        b       = a;
+        a       = t1 + t2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g; // NOLINT
+    state[7] += h; // NOLINT
+}
+
+} // namespace
+
+
+std::vector<DataChunk> splitChunks(std::span<const char> data, std::size_t average_size) {
+    SQLITEFS_SCOPED_PROFILER;
+
+    average_size = std::bit_floor(std::max<std::size_t>(average_size, 64)); // NOLINT
+
+    const auto min_size = average_size / 4;
+    const auto max_size = average_size * 4;
+    const auto bits     = std::countr_zero(average_size);
+    // the top bits depend on the last 64 bytes, the low ones only on the last few
+    const auto mask = ((std::uint64_t{1} << bits) - 1) << (64 - bits); // NOLINT
+
+    std::vector<DataChunk> result;
+    result.reserve(data.size() / average_size + 1);
+
+    const auto* bytes = reinterpret_cast<const unsigned char*>(data.data());
+    std::size_t start = 0;
+    while (start < data.size()) {
+        const auto    end  = std::min(data.size(), start + max_size);
+        auto          cut  = end;
+        std::uint64_t hash = 0;
+
+        // nothing is cut before min_size, so it isn't hashed either
+        for (auto i = std::min(end, start + min_size); i < end; ++i) {
+            hash = (hash << 1U) + GEAR[bytes[i]];
+            if ((hash & mask) == 0) {
+                cut = i + 1;
+                break;
+            }
+        }
+
+        const auto piece = data.subspan(start, cut - start);
+        result.push_back({.offset = start, .size = piece.size(), .hash = hash64(piece), .digest = sha256(piece)});
+        start = cut;
+    }
+
+    if (result.empty()) {
+        result.push_back({.hash = hash64({}), .digest = sha256({})});
+    }
+    return result;
+}
+
+std::uint64_t hash64(std::span<const char> data) noexcept {
+    constexpr std::uint64_t K1 = 0x87C37B91114253D5ULL;
+    constexpr std::uint64_t K2 = 0x4CF5AD432745937FULL;
+
+    std::uint64_t hash = 0x9E3779B97F4A7C15ULL ^ (data.size() * K1);
+    std::size_t   i    = 0;
+    for (; i + sizeof(std::uint64_t) <= data.size(); i += sizeof(std::uint64_t)) {
+        std::uint64_t word = 0;
+        std::memcpy(&word, data.data() + i, sizeof(word));
+        hash ^= std::rotl(word * K1, 31) * K2; // NOLINT
+        hash  = std::rotl(hash, 27) * 5 + 0x52DCE729; // NOLINT
+    }
+
+    if (i < data.size()) {
+        std::uint64_t tail = 0;
+        std::memcpy(&tail, data.data() + i, data.size() - i);
+        hash ^= std::rotl(tail * K1, 31) * K2; // NOLINT
+    }
+    return fmix64(hash);
+}
+
+ChunkDigest sha256(std::span<const char> data) noexcept {
+    constexpr std::size_t BLOCK = 64;
+
+    std::array<std::uint32_t, 8> state{0x6A09E667,
+                                       0xBB67AE85,
+                                       0x3C6EF372,
+                                       0xA54FF53A,
+                                       0x510E527F,
+                                       0x9B05688C,
+                                       0x1F83D9AB,
+                                       0x5BE0CD19}; // NOLINT
+
+    const auto* bytes = reinterpret_cast<const unsigned char*>(data.data());
+    std::size_t i     = 0;
+    for (; i + BLOCK <= data.size(); i += BLOCK) {
+        sha256Block(state, bytes + i);
+    }
+
+    // the tail, 0x80 and the length in bits take one or two more blocks
+    std::array<unsigned char, BLOCK * 2> tail{};
+    const auto                           rest = data.size() - i;
+    if (rest > 0) {
+        std::memcpy(tail.data(), bytes + i, rest);
+    }
+    tail[rest] = 0x80; // NOLINT
+
+    const std::size_t blocks = rest + 1 + sizeof(std::uint64_t) > BLOCK ? 2 : 1;
+    const auto        bits   = static_cast<std::uint64_t>(data.size()) * 8;
+    for (std::size_t b = 0; b < sizeof(bits); ++b) {
+        tail[blocks * BLOCK - 1 - b] = static_cast<unsigned char>(bits >> (b * 8)); // NOLINT
+    }
+    for (std::size_t b = 0; b < blocks; ++b) {
+        sha256Block(state, tail.data() + b * BLOCK);
+    }
+
+    ChunkDigest digest{};
+    for (std::size_t w = 0; w < state.size(); ++w) {
+        for (std::size_t b = 0; b < 4; ++b) {
+            digest[w * 4 + b] = static_cast<std::uint8_t>(state[w] >> (24 - b * 8)); // NOLINT
+        }
+    }
+    return digest;
+}
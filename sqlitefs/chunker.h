@@ -0,0 +1,27 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+
+// SHA-256, a chunk is reused only when it matches too
+using ChunkDigest = std::array<std::uint8_t, 32>;
+
+struct DataChunk final {
+    std::size_t   offset = 0;
+    std::size_t   size   = 0;
+    std::uint64_t hash   = 0; // hash64 of the content
+    ChunkDigest   digest{};
+};
+
+// content defined chunking with a rolling gear hash. Boundaries depend only on the bytes around them,
+// so an insert or a removal changes the chunks it touches and the rest stays the same.
+// average_size is rounded down to a power of two, chunks are from a quarter to four times of it.
+// Empty data gives one empty chunk
+std::vector<DataChunk> splitChunks(std::span<const char> data, std::size_t average_size);
+
+// 64 bit hash to find chunk candidates fast. Not cryptographic
+std::uint64_t hash64(std::span<const char> data) noexcept;
+ChunkDigest   sha256(std::span<const char> data) noexcept;
@@ -0,0 +1,110 @@
+#include "cipher.h"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <random>
+#include <string>
+#include "chunker.h"
+#include "utils.h"
+
+
+namespace
+{
+constexpr std::size_t HMAC_BLOCK = 64; // of SHA-256
+
+std::uint32_t load32(const std::uint8_t* bytes) noexcept {
+    return std::uint32_t{bytes[0]} | (std::uint32_t{bytes[1]} << 8U) | (std::uint32_t{bytes[2]} << 16U) |
+           (std::uint32_t{bytes[3]} << 24U); // NOLINT
+}
+
+void quarterRound(std::array<std::uint32_t, 16>& x, std::size_t a, std::size_t b, std::size_t c, std::size_t d) noexcept {
+    x[a] += x[b];
+    x[d] = std::rotl(x[d] ^ x[a], 16); // NOLINT
+    x[c] += x[d];
+    x[b] = std::rotl(x[b] ^ x[c], 12); // NOLINT
+    x[a] += x[b];
+    x[d] = std::rotl(x[d] ^ x[a], 8); // NOLINT
+    x[c] += x[d];
+    x[b] = std::rotl(x[b] ^ x[c], 7); // NOLINT
+}
+
+void chachaBlock(const std::array<std::uint32_t, 16>& state, std::array<std::uint8_t, CIPHER_BLOCK>& out) noexcept {
+    auto x = state;
+    for (int round = 0; round < 10; ++round) { // NOLINT
+        quarterRound(x, 0, 4, 8, 12);  // NOLINT
+        quarterRound(x, 1, 5, 9, 13);  // NOLINT
+        quarterRound(x, 2, 6, 10, 14); // NOLINT
+        quarterRound(x, 3, 7, 11, 15); // NOLINT
+        quarterRound(x, 0, 5, 10, 15); // NOLINT
+        quarterRound(x, 1, 6, 11, 12); // NOLINT
+        quarterRound(x, 2, 7, 8, 13);  // NOLINT
+        quarterRound(x, 3, 4, 9, 14);  // NOLINT
+    }
+    for (std::size_t i = 0; i < x.size(); ++i) {
+        const auto word = x[i] + state[i];
+        for (std::size_t b = 0; b < 4; ++b) {
+            out[i * 4 + b] = static_cast<std::uint8_t>(word >> (b * 8)); // NOLINT
+        }
+    }
+}
+} // namespace
+
+CipherKey deriveKey(std::string_view secret, std::string_view label) noexcept {
+    SecureString key(HMAC_BLOCK, '\0');
+    if (secret.size() > HMAC_BLOCK) {
+        auto digest = sha256(secret);
+        std::memcpy(key.data(), digest.data(), digest.size());
+    } else {
+        std::memcpy(key.data(), secret.data(), secret.size());
+    }
+
+    SecureString inner(key);
+    SecureString outer(key);
+    for (std::size_t i = 0; i < HMAC_BLOCK; ++i) {
+        inner[i] = static_cast<char>(inner[i] ^ 0x36); // NOLINT
+        outer[i] = static_cast<char>(outer[i] ^ 0x5C); // NOLINT
+    }
+    inner.append(label);
+    auto digest = sha256(inner);
+    outer.append(reinterpret_cast<const char*>(digest.data()), digest.size());
+    return sha256(outer);
+}
+
+CipherNonce randomNonce() {
+    std::random_device device;
+    CipherNonce        nonce{};
+    for (std::size_t i = 0; i < nonce.size(); i += sizeof(std::uint32_t)) {
+        const auto value = static_cast<std::uint32_t>(device());
+        std::memcpy(nonce.data() + i, &value, sizeof(value));
+    }
+    return nonce;
+}
+
+void chacha20(const CipherKey&      key,
+              const CipherNonce&    nonce,
+              std::uint32_t         counter,
+              std::span<const char> data,
+              char*                 out) noexcept {
+    SQLITEFS_SCOPED_PROFILER;
+
+    // "expand 32-byte k"
+    std::array<std::uint32_t, 16> state{0x61707865, 0x3320646E, 0x79622D32, 0x6B206574}; // NOLINT
+    for (std::size_t i = 0; i < key.size() / 4; ++i) {
+        state[4 + i] = load32(key.data() + i * 4); // NOLINT
+    }
+    state[12] = counter; // NOLINT
+    for (std::size_t i = 0; i < nonce.size() / 4; ++i) {
+        state[13 + i] = load32(nonce.data() + i * 4); // NOLINT
+    }
+
+    std::array<std::uint8_t, CIPHER_BLOCK> stream{};
+    for (std::size_t i = 0; i < data.size(); i += CIPHER_BLOCK) {
+        chachaBlock(state, stream);
+        ++state[12]; // NOLINT
+
+        const auto size = std::min(CIPHER_BLOCK, data.size() - i);
+        for (std::size_t b = 0; b < size; ++b) {
+            out[i + b] = static_cast<char>(data[i + b] ^ static_cast<char>(stream[b]));
+        }
+    }
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+
+// ChaCha20 (RFC 8439) for the sidecar files, the SQLite cipher covers only the pages of the database
+using CipherKey   = std::array<std::uint8_t, 32>;
+using CipherNonce = std::array<std::uint8_t, 12>;
+
+// one key stream is at most 2^32 blocks
+constexpr std::size_t   CIPHER_BLOCK    = 64;
+constexpr std::uint64_t CIPHER_MAX_SIZE = std::uint64_t{CIPHER_BLOCK} << 32U;
+
+// HMAC-SHA256 of the label with the secret, so every use of the database key gets its own key
+CipherKey   deriveKey(std::string_view secret, std::string_view label) noexcept;
+// a key must never encrypt two different files with the same nonce
+CipherNonce randomNonce();
+
+// xors data with the key stream starting at the block counter, the same call decrypts.
+// out can be data itself
+void chacha20(const CipherKey&      key,
+              const CipherNonce&    nonce,
+              std::uint32_t         counter,
+              std::span<const char> data,
+              char*                 out) noexcept;
@@ -0,0 +1,162 @@
+#include "crc32c.h"
+#include <array>
+#include <cstring>
+#include "utils.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SQLITEFS_CRC32C_SSE42
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define SQLITEFS_CRC32C_ARM
+#include <arm_acle.h>
+#endif
+
+
+namespace
+{
+constexpr std::uint32_t CASTAGNOLI = 0x82F63B78U; // reversed polynomial
+
+constexpr auto TABLE = [] {
+    std::array<std::uint32_t, 256> table{}; // NOLINT
+    for (std::uint32_t i = 0; i < table.size(); ++i) {
+        auto crc = i;
+        for (int bit = 0; bit < 8; ++bit) { // NOLINT
+            crc = (crc >> 1U) ^ (CASTAGNOLI & (0U - (crc & 1U)));
+        }
+        table[i] = crc;
+    }
+    return table;
+}();
+
+std::uint32_t software(const unsigned char* data, std::size_t size, std::uint32_t crc) noexcept {
+    for (; size > 0; --size) {
+        crc = TABLE[(crc ^ *data++) & 0xFFU] ^ (crc >> 8U); // NOLINT
+    }
+    return crc;
+}
+
+#if defined(SQLITEFS_CRC32C_SSE42)
+
+bool hasHardware() noexcept {
+#ifdef _MSC_VER
+    std::array<int, 4> info{};
+    __cpuid(info.data(), 1);
+    return (info[2] & (1 << 20)) != 0; // NOLINT
+#else
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#ifndef _MSC_VER
+__attribute__((target("sse4.2")))
+#endif
+std::uint32_t hardware(const unsigned char* data, std::size_t size, std::uint32_t crc) noexcept {
+    std::uint64_t value = crc;
+    for (; size >= sizeof(std::uint64_t); size -= sizeof(std::uint64_t), data += sizeof(std::uint64_t)) {
+        std::uint64_t word = 0;
+        std::memcpy(&word, data, sizeof(word));
+        value = _mm_crc32_u64(value, word);
+    }
+
+    crc = static_cast<std::uint32_t>(value);
+    for (; size > 0; --size) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+
+#elif defined(SQLITEFS_CRC32C_ARM)
+
+bool hasHardware() noexcept {
+    return true;
+}
+
+std::uint32_t hardware(const unsigned char* data, std::size_t size, std::uint32_t crc) noexcept {
+    for (; size >= sizeof(std::uint64_t); size -= sizeof(std::uint64_t), data += sizeof(std::uint64_t)) {
+        std::uint64_t word = 0;
+        std::memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+
+    for (; size > 0; --size) {
+        crc = __crc32cb(crc, *data++);
+    }
+    return crc;
+}
+
+#endif
+
+// GF(2) matrix helpers for crc32cCombine, the same way zlib does it
+std::uint32_t multiply(const std::array<std::uint32_t, 32>& matrix, std::uint32_t vector) noexcept {
+    std::uint32_t sum = 0;
+    for (std::size_t i = 0; vector != 0; vector >>= 1U, ++i) {
+        if ((vector & 1U) != 0) {
+            sum ^= matrix[i];
+        }
+    }
+    return sum;
+}
+
+std::array<std::uint32_t, 32> square(const std::array<std::uint32_t, 32>& matrix) noexcept {
+    std::array<std::uint32_t, 32> result{};
+    for (std::size_t i = 0; i < result.size(); ++i) {
+        result[i] = multiply(matrix, matrix[i]);
+    }
+    return result;
+}
+
+} // namespace
+
+
+std::uint32_t crc32c(std::span<const char> data, std::uint32_t crc) noexcept {
+    SQLITEFS_SCOPED_PROFILER;
+
+    const auto* bytes = reinterpret_cast<const unsigned char*>(data.data());
+
+#if defined(SQLITEFS_CRC32C_SSE42) || defined(SQLITEFS_CRC32C_ARM)
+    static const bool hardware_crc = hasHardware();
+    if (hardware_crc) {
+        return ~hardware(bytes, data.size(), ~crc);
+    }
+#endif
+    return ~software(bytes, data.size(), ~crc);
+}
+
+std::uint32_t crc32cCombine(std::uint32_t crc_a, std::uint32_t crc_b, std::size_t size_b) noexcept {
+    if (size_b == 0) {
+        return crc_a;
+    }
+
+    // operator for one zero bit, then squared to get 2, 4, 8... zero bits
+    std::array<std::uint32_t, 32> odd{};
+    odd[0] = CASTAGNOLI;
+    for (std::size_t i = 1; i < odd.size(); ++i) {
+        odd[i] = 1U << (i - 1);
+    }
+
+    auto even = square(odd); // 2 bits
+    odd       = square(even); // 4 bits
+
+    // applies size_b zero bytes to crc_a
+    do {
+        even = square(odd);
+        if ((size_b & 1U) != 0) {
+            crc_a = multiply(even, crc_a);
+        }
+        size_b >>= 1U;
+        if (size_b == 0) {
+            break;
+        }
+
+        odd = square(even);
+        if ((size_b & 1U) != 0) {
+            crc_a = multiply(odd, crc_a);
+        }
+        size_b >>= 1U;
+    } while (size_b != 0);
+
+    return crc_a ^ crc_b;
+}
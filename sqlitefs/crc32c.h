@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+
+
+// CRC-32C (Castagnoli). Uses SSE4.2 or ARMv8 CRC instructions when the CPU has them, a table otherwise.
+// Pass the previous result as crc to continue a checksum
+std::uint32_t crc32c(std::span<const char> data, std::uint32_t crc = 0) noexcept;
+
+// checksum of a + b from the checksums of both parts, without the data
+std::uint32_t crc32cCombine(std::uint32_t crc_a, std::uint32_t crc_b, std::size_t size_b) noexcept;
@@ -0,0 +1,132 @@
+#include "mapped_file.h"
+#include <utility>
+#include "utils.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+MappedFile::MappedFile(const std::filesystem::path& path) {
+    SQLITEFS_SCOPED_PROFILER;
+
+#ifdef _WIN32
+    HANDLE file = CreateFileW(path.c_str(),
+                              GENERIC_READ,
+                              FILE_SHARE_READ | FILE_SHARE_DELETE,
+                              nullptr,
+                              OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL,
+                              nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return;
+    }
+
+    LARGE_INTEGER size{};
+    if (!GetFileSizeEx(file, &size)) {
+        CloseHandle(file);
+        return;
+    }
+
+    if (size.QuadPart == 0) {
+        CloseHandle(file);
+        m_valid = true;
+        return;
+    }
+
+    m_mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (!m_mapping) {
+        return;
+    }
+
+    m_data = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!m_data) {
+        CloseHandle(m_mapping);
+        m_mapping = nullptr;
+        return;
+    }
+    m_size  = static_cast<std::size_t>(size.QuadPart);
+    m_valid = true;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat st {};
+    if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        return;
+    }
+
+    if (st.st_size == 0) {
+        ::close(fd);
+        m_valid = true;
+        return;
+    }
+
+    // the mapping keeps the file alive, the descriptor isn't needed anymore
+    void* data = ::mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        return;
+    }
+
+    m_data  = static_cast<const char*>(data);
+    m_size  = static_cast<std::size_t>(st.st_size);
+    m_valid = true;
+#endif
+}
+
+MappedFile::~MappedFile() { reset(); }
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+  : m_data(std::exchange(other.m_data, nullptr))
+  , m_size(std::exchange(other.m_size, 0))
+  , m_valid(std::exchange(other.m_valid, false))
+#ifdef _WIN32
+  , m_mapping(std::exchange(other.m_mapping, nullptr))
+#endif
+{
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+    if (this != &other) {
+        reset();
+        m_data  = std::exchange(other.m_data, nullptr);
+        m_size  = std::exchange(other.m_size, 0);
+        m_valid = std::exchange(other.m_valid, false);
+#ifdef _WIN32
+        m_mapping = std::exchange(other.m_mapping, nullptr);
+#endif
+    }
+    return *this;
+}
+
+void MappedFile::reset() noexcept {
+#ifdef _WIN32
+    if (m_data) {
+        UnmapViewOfFile(m_data);
+    }
+    if (m_mapping) {
+        CloseHandle(m_mapping);
+    }
+    m_mapping = nullptr;
+#else
+    if (m_data) {
+        ::munmap(const_cast<char*>(m_data), m_size);
+    }
+#endif
+    m_data  = nullptr;
+    m_size  = 0;
+    m_valid = false;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <filesystem>
+#include <span>
+
+
+// read only memory mapping of a whole file
+class MappedFile final {
+public:
+    MappedFile() = default;
+    explicit MappedFile(const std::filesystem::path& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&)            = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+
+    // false if the file can't be opened or mapped. An empty file is valid and has no data
+    bool                  valid() const noexcept { return m_valid; }
+    std::span<const char> data() const noexcept { return {m_data, m_size}; }
+
+private:
+    void reset() noexcept;
+
+private:
+    const char* m_data  = nullptr;
+    std::size_t m_size  = 0;
+    bool        m_valid = false;
+#ifdef _WIN32
+    void* m_mapping = nullptr;
+#endif
+};
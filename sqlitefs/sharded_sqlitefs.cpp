@@ -0,0 +1,431 @@
+#include <sqlitefs/sharded_sqlitefs.h>
+#include <cassert>
+#include "utils.h"
+
+
+namespace {
+
+std::string join(const std::vector<std::string>& names) {
+    if (names.empty()) {
+        return "/";
+    }
+
+    std::string path;
+    for (const auto& name : names) {
+        path += '/';
+        path += name;
+    }
+    return path;
+}
+
+// FNV-1a. The layout is stored on disk, so the hash must not depend on the standard library
+std::uint32_t hash(std::string_view name) noexcept {
+    std::uint32_t value = 2166136261U; // NOLINT
+    for (auto c : name) {
+        value ^= static_cast<unsigned char>(c);
+        value *= 16777619U; // NOLINT
+    }
+    return value;
+}
+
+} // namespace
+
+
+ShardedSQLiteFS::ShardedSQLiteFS(const std::vector<std::string>& paths,
+                                 std::string_view                key,
+                                 const Options&                  options) {
+    assert(!paths.empty() && "At least one shard is required");
+
+    m_shards.reserve(paths.size());
+    for (const auto& path : paths) {
+        m_shards.emplace_back(std::make_unique<SQLiteFS>(path, key, options));
+    }
+}
+
+ShardedSQLiteFS::~ShardedSQLiteFS() = default;
+
+std::size_t ShardedSQLiteFS::shards() const noexcept {
+    return m_shards.size();
+}
+
+SQLiteFS& ShardedSQLiteFS::shard(std::size_t index) {
+    return *m_shards.at(index);
+}
+
+const SQLiteFS& ShardedSQLiteFS::shard(std::size_t index) const {
+    return *m_shards.at(index);
+}
+
+std::size_t ShardedSQLiteFS::shardOf(const std::string& path) const {
+    return shardOf(resolve(path));
+}
+
+void ShardedSQLiteFS::vacuum() {
+    SQLITEFS_SCOPED_PROFILER;
+
+    for (auto& fs : m_shards) {
+        fs->vacuum();
+    }
+}
+
+bool ShardedSQLiteFS::flush() {
+    SQLITEFS_SCOPED_PROFILER;
+
+    bool success = true;
+    for (auto& fs : m_shards) {
+        success &= fs->flush();
+    }
+    return success;
+}
+
+std::string ShardedSQLiteFS::error() const {
+    std::string message;
+    for (const auto& fs : m_shards) {
+        if (auto error = fs->error(); !error.empty()) {
+            if (!message.empty()) {
+                message += '\n';
+            }
+            message += error;
+        }
+    }
+    return message;
+}
+
+SQLiteFSError ShardedSQLiteFS::errorCode() const noexcept {
+    for (const auto& fs : m_shards) {
+        if (auto code = fs->errorCode(); code != SQLiteFSError::NONE) {
+            return code;
+        }
+    }
+    return SQLiteFSError::NONE;
+}
+
+bool ShardedSQLiteFS::mkdir(const std::string& name) {
+    SQLITEFS_SCOPED_PROFILER;
+
+    auto names = resolve(name);
+    if (names.empty()) {
+        return false;
+    }
+    return m_shards[shardOf(names)]->mkdir(join(names));
+}
+
+bool ShardedSQLiteFS::cd(const std::string& name) {
+    SQLITEFS_SCOPED_PROFILER;
+
+    auto names = resolve(name);
+    if (!names.empty()) {
+        auto node = m_shards[shardOf(names)]->stat(join(names));
+        if (!node || (node->attributes & SQLiteFSNode::Attributes::FILE)) {
+            return false;
+        }
+    }
+
+    std::lock_guard lock(m_cwd_mutex);
+    m_cwd = std::move(names);
+    return true;
+}
+
+bool ShardedSQLiteFS::rm(const std::string& name) {
+    SQLITEFS_SCOPED_PROFILER;
+
+    auto names = resolve(name);
+    if (names.empty()) {
+        return false;
+    }
+    if (!m_shards[shardOf(names)]->rm(join(names))) {
+        return false;
+    }
+
+    followCwd(names, std::nullopt);
+    return true;
+}
+
+std::string ShardedSQLiteFS::pwd() const {
+    std::lock_guard lock(m_cwd_mutex);
+    return join(m_cwd);
+}
+
+std::vector<SQLiteFSNode> ShardedSQLiteFS::ls(const std::string& path) const {
+    SQLITEFS_SCOPED_PROFILER;
+
+    auto names = resolve(path);
+    if (!names.empty()) {
+        return m_shards[shardOf(names)]->ls(join(names));
+    }
+
+    std::vector<SQLiteFSNode> content;
+    for (const auto& fs : m_shards) {
+        auto part = fs->ls("/");
+        content.insert(content.end(), std::make_move_iterator(part.begin()), std::make_move_iterator(part.end()));
+    }
+    std::ranges::sort(content, {}, &SQLiteFSNode::name);
+    return content;
+}
+
+bool ShardedSQLiteFS::write(const std::string& name, DataInput data, const std::string& alg) {
+    SQLITEFS_SCOPED_PROFILER;
+
+    auto names = resolve(name);
+    if (names.empty()) {
+        return false;
+    }
+    return m_shards[shardOf(names)]->write(join(names), data, alg);
+}
+
+bool ShardedSQLiteFS::update(const std::string& name, DataInput data, const std::string& alg) {
+    SQLITEFS_SCOPED_PROFILER;
+
+    auto names = resolve(name);
+    if (names.empty()) {
+        return false;
+    }
+    return m_shards[shardOf(names)]->update(join(names), data, alg);
+}
+
+ShardedSQLiteFS::DataOutput ShardedSQLiteFS::read(const std::string& name) const {
+    SQLITEFS_SCOPED_PROFILER;
+
+    auto names = resolve(name);
+    if (names.empty()) {
+        return {};
+    }
+    return m_shards[shardOf(names)]->read(join(names));
+}
+
+bool ShardedSQLiteFS::mv(const std::string& from, const std::string& to) {
+    SQLITEFS_SCOPED_PROFILER;
+
+    auto source = resolve(from);
+    auto target = resolve(to);
+    if (source.empty()) {
+        return false;
+    }
+
+    if (to.ends_with('/')) {
+        target.push_back(source.back());
+    }
+
+    if (target.empty()) {
+        return false;
+    }
+
+    auto& from_fs     = *m_shards[shardOf(source)];
+    auto& to_fs       = *m_shards[shardOf(target)];
+    auto  source_path = join(source);
+    auto  target_path = join(target);
+    if (&from_fs == &to_fs) {
+        if (!from_fs.mv(source_path, target_path)) {
+            return false;
+        }
+    } else {
+        if (to_fs.exists(target_path)) {
+            return false;
+        }
+
+        if (!copy(from_fs, source_path, to_fs, target_path)) {
+            to_fs.rm(target_path); // a half copied tree is worse than none
+            return false;
+        }
+
+        if (!from_fs.rm(source_path)) {
+            return false;
+        }
+    }
+
+    followCwd(source, std::move(target));
+    return true;
+}
+
+bool ShardedSQLiteFS::cp(const std::string& from, const std::string& to) {
+    SQLITEFS_SCOPED_PROFILER;
+
+    auto source = resolve(from);
+    auto target = resolve(to);
+    if (source.empty()) {
+        return false;
+    }
+
+    if (to.ends_with('/')) {
+        target.push_back(source.back());
+    }
+
+    if (target.empty()) {
+        return false;
+    }
+
+    auto& from_fs     = *m_shards[shardOf(source)];
+    auto& to_fs       = *m_shards[shardOf(target)];
+    auto  source_path = join(source);
+    auto  target_path = join(target);
+    auto  node        = from_fs.stat(source_path);
+    if (!node) {
+        return false;
+    }
+
+    // SQLiteFS::cp takes only files, folders are copied node by node on one shard as well as across them
+    if (&from_fs == &to_fs && (node->attributes & SQLiteFSNode::Attributes::FILE)) {
+        return from_fs.cp(source_path, target_path);
+    }
+
+    // a folder copied inside itself would never end
+    const bool inside = target.size() > source.size() && std::equal(source.begin(), source.end(), target.begin());
+    if (inside || to_fs.exists(target_path)) {
+        return false;
+    }
+
+    if (!copy(from_fs, source_path, to_fs, target_path)) {
+        to_fs.rm(target_path); // a half copied tree is worse than none
+        return false;
+    }
+    return true;
+}
+
+SQLiteFSResult<SQLiteFSNode> ShardedSQLiteFS::stat(const std::string& path) const {
+    auto names = resolve(path);
+    return m_shards[shardOf(names)]->stat(join(names));
+}
+
+bool ShardedSQLiteFS::exists(const std::string& path) const {
+    auto names = resolve(path);
+    return m_shards[shardOf(names)]->exists(join(names));
+}
+
+SQLiteFSResult<ShardedSQLiteFS::DataOutput> ShardedSQLiteFS::tryRead(const std::string& name) const {
+    SQLITEFS_SCOPED_PROFILER;
+
+    auto names = resolve(name);
+    if (names.empty()) {
+        return SQLiteFSError::NOT_A_FILE;
+    }
+    return m_shards[shardOf(names)]->tryRead(join(names));
+}
+
+std::optional<SQLiteFSUsage> ShardedSQLiteFS::du(const std::string& path) const {
+    SQLITEFS_SCOPED_PROFILER;
+
+    auto names = resolve(path);
+    if (!names.empty()) {
+        return m_shards[shardOf(names)]->du(join(names));
+    }
+
+    SQLiteFSUsage total;
+    for (const auto& fs : m_shards) {
+        auto usage = fs->du("/");
+        if (!usage) {
+            return std::nullopt;
+        }
+        total.files    += usage->files;
+        total.size     += usage->size;
+        total.size_raw += usage->size_raw;
+    }
+    return total;
+}
+
+std::vector<SQLiteFSVersion> ShardedSQLiteFS::versions(const std::string& name) const {
+    auto names = resolve(name);
+    return m_shards[shardOf(names)]->versions(join(names));
+}
+
+SQLiteFSResult<ShardedSQLiteFS::DataOutput> ShardedSQLiteFS::readVersion(const std::string& name,
+                                                                         std::uint32_t      version) const {
+    SQLITEFS_SCOPED_PROFILER;
+
+    auto names = resolve(name);
+    return m_shards[shardOf(names)]->readVersion(join(names), version);
+}
+
+std::size_t ShardedSQLiteFS::recompress(const std::string& path, const std::string& alg, std::int64_t budget) {
+    SQLITEFS_SCOPED_PROFILER;
+
+    auto names = resolve(path);
+    if (!names.empty()) {
+        return m_shards[shardOf(names)]->recompress(join(names), alg, budget);
+    }
+
+    std::size_t done = 0;
+    for (auto& fs : m_shards) {
+        done += fs->recompress("/", alg, budget);
+    }
+    return done;
+}
+
+void ShardedSQLiteFS::registerSaveFunc(const std::string& name, const ConvertFunc& func) {
+    for (auto& fs : m_shards) {
+        fs->registerSaveFunc(name, func);
+    }
+}
+
+void ShardedSQLiteFS::registerLoadFunc(const std::string& name, const ConvertFunc& func) {
+    for (auto& fs : m_shards) {
+        fs->registerLoadFunc(name, func);
+    }
+}
+
+std::vector<std::string> ShardedSQLiteFS::resolve(const std::string& path) const {
+    std::vector<std::string> names;
+    if (!path.starts_with('/')) {
+        std::lock_guard lock(m_cwd_mutex);
+        names = m_cwd;
+    }
+
+    for (auto& name : split(path, '/')) {
+        if (name == ".") {
+            continue;
+        }
+
+        if (name == "..") {
+            if (!names.empty()) {
+                names.pop_back();
+            }
+            continue;
+        }
+
+        names.emplace_back(std::move(name));
+    }
+    return names;
+}
+
+std::size_t ShardedSQLiteFS::shardOf(const std::vector<std::string>& names) const {
+    return names.empty() ? 0 : hash(names.front()) % m_shards.size();
+}
+
+void ShardedSQLiteFS::followCwd(const std::vector<std::string>& from, std::optional<std::vector<std::string>> to) {
+    std::lock_guard lock(m_cwd_mutex);
+    if (m_cwd.size() < from.size() || !std::equal(from.begin(), from.end(), m_cwd.begin())) {
+        return;
+    }
+
+    if (!to) {
+        m_cwd.clear();
+        return;
+    }
+
+    to->insert(to->end(), m_cwd.begin() + static_cast<std::ptrdiff_t>(from.size()), m_cwd.end());
+    m_cwd = std::move(*to);
+}
+
+bool ShardedSQLiteFS::copy(SQLiteFS& from_fs, const std::string& from, SQLiteFS& to_fs, const std::string& to) const {
+    SQLITEFS_SCOPED_PROFILER;
+
+    auto source = from_fs.stat(from);
+    if (!source) {
+        return false;
+    }
+
+    if (source->attributes & SQLiteFSNode::Attributes::FILE) {
+        auto data = from_fs.tryRead(from);
+        return data && to_fs.write(to, *data, source->compression);
+    }
+
+    if (!to_fs.mkdir(to)) {
+        return false;
+    }
+
+    for (const auto& child : from_fs.ls(from)) {
+        if (!copy(from_fs, from + "/" + child.name, to_fs, to + "/" + child.name)) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -25,9 +25,16 @@
 #endif // MZ_ENABLE
 
 
-SQLiteFS::SQLiteFS(std::string path, std::string_view key) : m_impl(std::make_unique<Impl>(std::move(path), key)) {
+SQLiteFS::SQLiteFS(std::string path, std::string_view key, const Options& options)
+  : m_impl(std::make_unique<Impl>(std::move(path), key, options)) {
     SQLiteFS::registerSaveFunc("raw", [](DataInput data) { return DataOutput{data.begin(), data.end()}; });
     SQLiteFS::registerLoadFunc("raw", [](DataInput data) { return DataOutput{data.begin(), data.end()}; });
+    SQLiteFS::registerSaveFunc("raw", [](DataInput data, std::pmr::memory_resource* resource) {
+        return PmrDataOutput{data.begin(), data.end(), resource};
+    });
+    SQLiteFS::registerLoadFunc("raw", [](DataInput data, std::pmr::memory_resource* resource) {
+        return PmrDataOutput{data.begin(), data.end(), resource};
+    });
 
 #ifdef HAVE_BZIP
     SQLiteFS::registerSaveFunc("bzip", [](DataInput data) { return minizipCompress(data, mz_stream_bzip_create); });
@@ -56,7 +63,28 @@ std::string SQLiteFS::pwd() const {
 }
 
 std::vector<SQLiteFSNode> SQLiteFS::ls(const std::string& path) const {
-    return m_impl->ls(path);
+    auto listing = m_impl->list(path);
+
+    std::vector<SQLiteFSNode> content;
+    content.reserve(listing.size());
+    for (std::size_t i = 0; i < listing.size(); ++i) {
+        content.emplace_back(listing.node(i));
+    }
+    return content;
+}
+
+SQLiteFSListing SQLiteFS::list(const std::string& path) const {
+    return m_impl->list(path);
+}
+
+std::vector<SQLiteFSNode> SQLiteFS::ls(const std::string& path,
+                                       const std::string& after_name,
+                                       std::size_t        limit) const {
+    return m_impl->ls(path, after_name, limit);
+}
+
+std::size_t SQLiteFS::find(const std::string& path, const FindFilter& filter, const FindCallback& callback) const {
+    return m_impl->find(path, filter, callback);
 }
 
 bool SQLiteFS::mkdir(const std::string& name) {
@@ -79,6 +107,65 @@ SQLiteFS::DataOutput SQLiteFS::read(const std::string& name) const {
     return m_impl->read(name);
 }
 
+SQLiteFSResult<SQLiteFSNode> SQLiteFS::stat(const std::string& path) const {
+    return m_impl->stat(path);
+}
+
+bool SQLiteFS::exists(const std::string& path) const {
+    return m_impl->stat(path).has_value();
+}
+
+std::vector<SQLiteFSResult<SQLiteFSNode>> SQLiteFS::statMany(std::span<const std::string> paths) const {
+    return m_impl->statMany(paths);
+}
+
+std::vector<SQLiteFSChange> SQLiteFS::changesSince(std::int64_t seq, std::size_t limit) const {
+    return m_impl->changesSince(seq, limit);
+}
+
+std::size_t SQLiteFS::pruneChanges(std::int64_t seq) {
+    return m_impl->pruneChanges(seq);
+}
+
+bool SQLiteFS::replicate(const std::string& replica_path, std::string_view key) {
+    return m_impl->replicate(replica_path, key);
+}
+
+SQLiteFSResult<SQLiteFS::DataOutput> SQLiteFS::tryRead(const std::string& name) const {
+    return m_impl->tryRead(name);
+}
+
+SQLiteFS::PmrDataOutput SQLiteFS::read(const std::string& name, std::pmr::memory_resource* resource) const {
+    return m_impl->read(name, resource);
+}
+
+bool SQLiteFS::write(const std::string&         name,
+                     DataInput                  data,
+                     const std::string&         alg,
+                     std::pmr::memory_resource* resource) {
+    return m_impl->write(name, data, alg, resource);
+}
+
+SQLiteFS::ReadView SQLiteFS::readView(const std::string& name) const {
+    return m_impl->readView(name);
+}
+
+bool SQLiteFS::update(const std::string& name, DataInput data, const std::string& alg) {
+    return m_impl->update(name, data, alg);
+}
+
+std::vector<SQLiteFSVersion> SQLiteFS::versions(const std::string& name) const {
+    return m_impl->versions(name);
+}
+
+SQLiteFSResult<SQLiteFS::DataOutput> SQLiteFS::readVersion(const std::string& name, std::uint32_t version) const {
+    return m_impl->readVersion(name, version);
+}
+
+std::size_t SQLiteFS::recompress(const std::string& path, const std::string& alg, std::int64_t budget) {
+    return m_impl->recompress(path, alg, budget);
+}
+
 bool SQLiteFS::mv(const std::string& from, const std::string& to) {
     return m_impl->mv(from, to);
 }
@@ -87,6 +174,10 @@ bool SQLiteFS::cp(const std::string& from, const std::string& to) {
     return m_impl->cp(from, to);
 }
 
+std::optional<SQLiteFSUsage> SQLiteFS::du(const std::string& path) const {
+    return m_impl->du(path);
+}
+
 const std::string& SQLiteFS::path() const noexcept {
     return m_impl->path();
 }
@@ -95,10 +186,38 @@ void SQLiteFS::vacuum() {
     m_impl->vacuum();
 }
 
+SQLiteFSCheck SQLiteFS::fsck(unsigned threads) const {
+    return m_impl->fsck(threads);
+}
+
+std::size_t SQLiteFS::reclaim(std::size_t max_pages) {
+    return m_impl->reclaim(max_pages);
+}
+
+SQLiteFSSpace SQLiteFS::space() const {
+    return m_impl->space();
+}
+
+bool SQLiteFS::backup(const std::string& dest_path, std::string_view key, int pages_per_step) {
+    return m_impl->backup(dest_path, key, pages_per_step);
+}
+
+SQLiteFS::DataOutput SQLiteFS::snapshot() const {
+    return m_impl->snapshot();
+}
+
+bool SQLiteFS::flush() {
+    return m_impl->flush();
+}
+
 std::string SQLiteFS::error() const {
     return m_impl->error();
 }
 
+SQLiteFSError SQLiteFS::errorCode() const noexcept {
+    return m_impl->errorCode();
+}
+
 void SQLiteFS::registerSaveFunc(const std::string& name, const ConvertFunc& func) {
     m_impl->registerSaveFunc(name, func);
 }
@@ -107,6 +226,14 @@ void SQLiteFS::registerLoadFunc(const std::string& name, const ConvertFunc& func
     m_impl->registerLoadFunc(name, func);
 }
 
+void SQLiteFS::registerSaveFunc(const std::string& name, const PmrConvertFunc& func) {
+    m_impl->registerSaveFunc(name, func);
+}
+
+void SQLiteFS::registerLoadFunc(const std::string& name, const PmrConvertFunc& func) {
+    m_impl->registerLoadFunc(name, func);
+}
+
 SQLiteFS::DataOutput SQLiteFS::callSaveFunc(const std::string& name, DataInput data) {
     return m_impl->callSaveFunc(name, data);
 }
@@ -115,8 +242,112 @@ SQLiteFS::DataOutput SQLiteFS::callLoadFunc(const std::string& name, DataInput d
     return m_impl->callLoadFunc(name, data);
 }
 
+std::vector<std::string> SQLiteFS::codecs() const {
+    return m_impl->codecs();
+}
+
+std::vector<SQLiteFSQueryStats> SQLiteFS::queryStats() const {
+    return m_impl->queryStats();
+}
+
+void SQLiteFS::resetQueryStats() {
+    m_impl->resetQueryStats();
+}
+
+void SQLiteFS::setSlowQueryCallback(SlowQueryCallback callback) {
+    m_impl->setSlowQueryCallback(std::move(callback));
+}
+
+std::vector<SQLiteFSLockStats> SQLiteFS::lockStats() const {
+    return m_impl->lockStats();
+}
+
+void SQLiteFS::resetLockStats() {
+    m_impl->resetLockStats();
+}
+
+std::int64_t SQLiteFS::workerErrors() const noexcept {
+    return m_impl->workerErrors();
+}
+
+void SQLiteFS::setWorkerErrorCallback(WorkerErrorCallback callback) {
+    m_impl->setWorkerErrorCallback(std::move(callback));
+}
+
 void SQLiteFS::rawCall(const std::function<void(SQLite::Database*)>& callback) {
     m_impl->rawCall(callback);
 }
 
 SQLiteFS::~SQLiteFS() {} // NOLINT
+
+
+const char* describe(SQLiteFSError error) noexcept {
+    switch (error) {
+    case SQLiteFSError::NONE: return "";
+    case SQLiteFSError::NOT_FOUND: return "Can't find node";
+    case SQLiteFSError::NOT_A_FILE: return "The node is not a file";
+    case SQLiteFSError::ALREADY_EXISTS: return "The node already exists";
+    case SQLiteFSError::INVALID_TARGET: return "The target cannot be inside the source";
+    case SQLiteFSError::READ_ONLY: return "The database is read only";
+    case SQLiteFSError::BUSY: return "The database is busy";
+    case SQLiteFSError::SIZE_MISMATCH: return "File size doesn't match";
+    case SQLiteFSError::CORRUPTED: return "File data doesn't match its checksum";
+    case SQLiteFSError::IO: return "IO error";
+    case SQLiteFSError::SQL: return "SQL error";
+    case SQLiteFSError::INTERNAL: return "Internal error";
+    }
+    return "Unknown error";
+}
+
+
+std::string_view SQLiteFSListing::name(std::size_t i) const noexcept {
+    return std::string_view{names}.substr(name_offsets[i], name_offsets[i + 1] - name_offsets[i]);
+}
+
+std::string_view SQLiteFSListing::compression(std::size_t i) const noexcept {
+    return codec_ids[i] == NO_CODEC ? std::string_view{} : std::string_view{codecs[codec_ids[i]]};
+}
+
+SQLiteFSNode SQLiteFSListing::node(std::size_t i) const {
+    return SQLiteFSNode{
+      .id          = ids[i],
+      .parent_id   = parent_ids[i],
+      .name        = std::string{name(i)},
+      .size        = sizes[i],
+      .size_raw    = sizes_raw[i],
+      .compression = std::string{compression(i)},
+      .attributes  = attributes[i],
+    };
+}
+
+
+SQLiteFS::LsCursor::LsCursor(const SQLiteFS& fs, std::string path, std::size_t page_size)
+  : m_fs(&fs), m_path(std::move(path)), m_page_size(page_size == 0 ? 1 : page_size) {}
+
+const SQLiteFSNode* SQLiteFS::LsCursor::next() {
+    if (m_pos == m_page.size()) {
+        if (m_done) {
+            return nullptr;
+        }
+
+        m_page = m_fs->ls(m_path, m_after, m_page_size);
+        m_pos  = 0;
+        m_done = m_page.size() < m_page_size;
+
+        if (m_page.empty()) {
+            return nullptr;
+        }
+        m_after = m_page.back().name;
+    }
+    return &m_page[m_pos++];
+}
+
+
+SQLiteFS::ReadView::ReadView()                                     = default;
+SQLiteFS::ReadView::~ReadView()                                    = default;
+SQLiteFS::ReadView::ReadView(ReadView&& other) noexcept            = default;
+SQLiteFS::ReadView& SQLiteFS::ReadView::operator=(ReadView&& other) noexcept = default;
+
+SQLiteFS::DataInput SQLiteFS::ReadView::data() const noexcept {
+    return m_state ? m_state->view : DataInput{};
+}
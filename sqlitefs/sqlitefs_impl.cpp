@@ -1,8 +1,18 @@
 #include "sqlitefs_impl.h"
+#include <algorithm>
+#include <array>
 #include <cstring>
+#include <fstream>
+#include <limits>
 #include <mutex>
 #include <optional>
+#include <set>
+#include <sqlite3.h>
 #include <SQLiteCpp/SQLiteCpp.h>
+#include <utility>
+#include "chunker.h"
+#include "crc32c.h"
+#include "mapped_file.h"
 #include "sqlitefs/sqlitefs.h"
 #include "sqlqueries.h"
 #include "utils.h"
@@ -10,10 +20,9 @@
 
 namespace
 {
-struct SecureString final : public std::string {
-    using std::string::basic_string;
-    ~SecureString() { std::memset(data(), 0, size()); };
-};
+// set on the background workers, their failures are kept apart from the error of the caller threads
+thread_local bool                                                 t_worker = false;
+thread_local std::optional<std::pair<SQLiteFSError, std::string>> t_worker_error;
 
 SQLiteFS::DataOutput internalCall(const std::string&               name,
                                   SQLiteFS::DataInput              data,
@@ -26,11 +35,339 @@ SQLiteFS::DataOutput internalCall(const std::string&               name,
     return {};
 }
 
+SQLiteFS::PmrDataOutput internalCall(const std::string&                  name,
+                                     SQLiteFS::DataInput                 data,
+                                     const SQLiteFS::PmrConvertFuncsMap& pmr_map,
+                                     const SQLiteFS::ConvertFuncsMap&    map,
+                                     std::pmr::memory_resource*          resource) {
+    auto it = pmr_map.find(name);
+    if (it != pmr_map.end()) {
+        return std::invoke(it->second, data, resource);
+    }
+
+    // plain funcs allocate from the global heap, the result is moved into the resource with one copy
+    auto temp = internalCall(name, data, map);
+    return {temp.begin(), temp.end(), resource};
+}
+
+// update()d files are encoded chunk by chunk, stored holds them back to back
+SQLiteFS::DataOutput decodeChunks(const std::string&               name,
+                                  SQLiteFS::DataOutput             stored,
+                                  std::span<const std::size_t>     sizes,
+                                  const SQLiteFS::ConvertFuncsMap& map) {
+    if (name == "raw") {
+        return stored;
+    }
+
+    SQLiteFS::DataOutput result;
+    std::size_t          offset = 0;
+    for (auto size : sizes) {
+        auto part = internalCall(name, SQLiteFS::DataInput{stored}.subspan(offset, size), map);
+        result.insert(result.end(), part.begin(), part.end());
+        offset += size;
+    }
+    return result;
+}
+
+SQLiteFS::PmrDataOutput decodeChunks(const std::string&                  name,
+                                     SQLiteFS::DataInput                 stored,
+                                     std::span<const std::size_t>        sizes,
+                                     const SQLiteFS::PmrConvertFuncsMap& pmr_map,
+                                     const SQLiteFS::ConvertFuncsMap&    map,
+                                     std::pmr::memory_resource*          resource) {
+    SQLiteFS::PmrDataOutput result(resource);
+    if (name == "raw") {
+        result.assign(stored.begin(), stored.end());
+        return result;
+    }
+
+    std::size_t offset = 0;
+    for (auto size : sizes) {
+        auto part = internalCall(name, stored.subspan(offset, size), pmr_map, map, resource);
+        result.insert(result.end(), part.begin(), part.end());
+        offset += size;
+    }
+    return result;
+}
+
+std::string openTarget(const std::string& path, const SQLiteFS::Options& options) {
+    if (!options.immutable) {
+        return path;
+    }
+
+    // immutable is only available as an URI parameter
+    std::string uri = "file:";
+    for (char c : path) {
+        switch (c) {
+        case '%': uri += "%25"; break;
+        case '?': uri += "%3f"; break;
+        case '#': uri += "%23"; break;
+        default: uri += c;
+        }
+    }
+    return uri + "?immutable=1";
+}
+
+// serialized connections can be used from several threads at once, read only operations rely on it
+int mutexFlags() {
+    return sqlite3_threadsafe() != 0 ? SQLite::OPEN_FULLMUTEX : 0;
+}
+
+// max of concurrent updates without a lock
+void storeMax(std::atomic<std::int64_t>& target, std::int64_t value) noexcept {
+    auto current = target.load(std::memory_order_relaxed);
+    while (value > current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+}
+
+int openFlags(const SQLiteFS::Options& options) {
+    int flags = (options.immutable ? SQLite::OPEN_URI : 0) | mutexFlags();
+    if (options.read_only || options.immutable) {
+        return flags | SQLite::OPEN_READONLY;
+    }
+    return flags | SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE;
+}
+
+void applyPragmas(SQLite::Database& db, const SQLiteFS::Options& options) {
+    using namespace std::literals;
+    using Options = SQLiteFS::Options;
+
+    constexpr std::array journal_modes{"DELETE", "TRUNCATE", "PERSIST", "MEMORY", "WAL", "OFF"};
+    constexpr std::array sync_modes{"OFF", "NORMAL", "FULL", "EXTRA"};
+    constexpr std::array temp_stores{"FILE", "MEMORY"};
+
+    if (options.journal_mode != Options::JournalMode::DEFAULT) {
+        db.exec("PRAGMA journal_mode = "s + journal_modes.at(static_cast<std::size_t>(options.journal_mode) - 1));
+    }
+    if (options.synchronous != Options::Synchronous::DEFAULT) {
+        db.exec("PRAGMA synchronous = "s + sync_modes.at(static_cast<std::size_t>(options.synchronous) - 1));
+    }
+    if (options.temp_store != Options::TempStore::DEFAULT) {
+        db.exec("PRAGMA temp_store = "s + temp_stores.at(static_cast<std::size_t>(options.temp_store) - 1));
+    }
+    if (options.mmap_size) {
+        db.exec("PRAGMA mmap_size = " + std::to_string(*options.mmap_size));
+    }
+    if (options.cache_size) {
+        db.exec("PRAGMA cache_size = " + std::to_string(*options.cache_size));
+    }
+}
+
+void applyAutoVacuum(SQLite::Database& db, const SQLiteFS::Options& options) {
+    using namespace std::literals;
+
+    constexpr std::array auto_vacuums{"NONE", "FULL", "INCREMENTAL"};
+
+    if (options.auto_vacuum != SQLiteFS::Options::AutoVacuum::DEFAULT) {
+        db.exec("PRAGMA auto_vacuum = "s + auto_vacuums.at(static_cast<std::size_t>(options.auto_vacuum) - 1));
+    }
+}
+
+template<typename... Args>
+SQLite::Statement prepare(const SQLite::Database& db, const std::string& query_string, Args&&... args) {
+    SQLite::Statement query{db, query_string};
+
+    [&]<size_t... Is>(std::index_sequence<Is...>) {
+        (query.bind(Is + 1, std::forward<Args>(args)), ...);
+    }(std::make_index_sequence<sizeof...(Args)>{});
+    return query;
+}
+
+// binds a value read from another connection as is
+void bindColumn(SQLite::Statement& query, int index, const SQLite::Column& column) {
+    switch (column.getType()) {
+    case SQLITE_INTEGER: query.bind(index, static_cast<std::int64_t>(column.getInt64())); break;
+    case SQLITE_FLOAT: query.bind(index, column.getDouble()); break;
+    case SQLITE_TEXT: query.bind(index, std::string{column.getText()}); break;
+    case SQLITE_BLOB: query.bind(index, column.getBlob(), column.getBytes()); break;
+    default: query.bind(index);
+    }
+}
+
+std::vector<std::uint32_t> ancestors(const SQLite::Database& db, std::uint32_t id) {
+    std::vector<std::uint32_t> result;
+    for (auto query = prepare(db, ANCESTORS, id); query.executeStep();) {
+        result.push_back(query.getColumn(0).getUInt());
+    }
+    return result;
+}
+
+// sidecar files of a database with a key are encrypted with a key derived from it
+std::optional<CipherKey> sidecarKey(std::string_view key) {
+    if (key.empty()) {
+        return std::nullopt;
+    }
+    return deriveKey(key, "sqlitefs sidecar");
+}
+
+std::optional<CipherNonce> readNonce(const SQLite::Column& column) {
+    CipherNonce nonce{};
+    if (column.getBytes() != static_cast<int>(nonce.size())) {
+        return std::nullopt;
+    }
+    std::memcpy(nonce.data(), column.getBlob(), nonce.size());
+    return nonce;
+}
+
+// SET_SIDECAR, SYNC_SIDECAR or MOVE_SIDECAR, a plain file gets a NULL nonce
+int setSidecar(const SQLite::Database&           db,
+               const std::string&                query_string,
+               std::uint32_t                     id,
+               const std::string&                name,
+               const std::optional<CipherNonce>& nonce) {
+    auto query = prepare(db, query_string, id, name);
+    if (nonce) {
+        query.bind(3, nonce->data(), static_cast<int>(nonce->size()));
+    } else {
+        query.bind(3);
+    }
+    return query.exec();
+}
+
+std::optional<SidecarFile> sidecarFile(const SQLite::Database&      db,
+                                       const std::filesystem::path& sidecar_dir,
+                                       std::uint32_t                id) {
+    auto query = prepare(db, GET_SIDECAR, id);
+    if (!query.executeStep()) {
+        return std::nullopt;
+    }
+    return SidecarFile{.path = sidecar_dir / query.getColumn(0).getText(), .nonce = readNonce(query.getColumn(1))};
+}
+
+// the data of a sidecar as it's stored, nothing if it can't be read. A plain file is only mapped,
+// an encrypted one is decrypted from the mapping into the buffer
+std::optional<SQLiteFS::DataInput> loadSidecar(const SidecarFile&              file,
+                                               const std::optional<CipherKey>& key,
+                                               MappedFile&                     mapped,
+                                               SQLiteFS::DataOutput&           buffer) {
+    SQLITEFS_SCOPED_PROFILER;
+
+    mapped = MappedFile(file.path);
+    if (!mapped.valid() || (file.nonce && !key)) {
+        return std::nullopt;
+    }
+    if (!file.nonce) {
+        return mapped.data();
+    }
+
+    buffer.resize(mapped.data().size());
+    chacha20(*key, *file.nonce, 0, mapped.data(), buffer.data());
+    mapped = {};
+    return buffer;
+}
+
+// writes through a temporary file, so a sidecar is either whole or missing. Encrypted when a key is given
+void writeSidecar(const std::filesystem::path&      file,
+                  SQLiteFS::DataInput               data,
+                  const std::optional<CipherKey>&   key,
+                  const std::optional<CipherNonce>& nonce) {
+    SQLITEFS_SCOPED_PROFILER;
+
+    if (key && data.size() > CIPHER_MAX_SIZE) {
+        throw std::runtime_error("Sidecar file is too big to encrypt " + file.string());
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(file.parent_path(), ec);
+
+    auto temp = file;
+    temp += ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        if (key) {
+            // encrypted piece by piece, not as a whole copy
+            constexpr std::size_t PIECE = std::size_t{1} << 16U;
+            std::vector<char>     buffer(std::min(PIECE, data.size()));
+            for (std::size_t i = 0; i < data.size() && out; i += PIECE) {
+                auto piece = data.subspan(i, std::min(PIECE, data.size() - i));
+                chacha20(*key, *nonce, static_cast<std::uint32_t>(i / CIPHER_BLOCK), piece, buffer.data());
+                out.write(buffer.data(), static_cast<std::streamsize>(piece.size()));
+            }
+        } else {
+            out.write(data.data(), static_cast<std::streamsize>(data.size()));
+        }
+
+        if (!out.flush()) {
+            std::filesystem::remove(temp, ec);
+            throw std::runtime_error("Can't write sidecar file " + temp.string());
+        }
+    }
+
+    std::filesystem::rename(temp, file, ec);
+    if (ec) {
+        std::filesystem::remove(temp, ec);
+        throw std::runtime_error("Can't write sidecar file " + file.string() + ": " + ec.message());
+    }
+}
+
+// copies a sidecar for a database with dest_key, re-encrypted if the keys differ. Returns the nonce of the copy
+std::optional<CipherNonce> copySidecar(const SidecarFile&              file,
+                                       const std::optional<CipherKey>& key,
+                                       const std::filesystem::path&    dest,
+                                       const std::optional<CipherKey>& dest_key) {
+    SQLITEFS_SCOPED_PROFILER;
+
+    // a plain file stays plain for a plain database
+    if (file.nonce ? key == dest_key : !dest_key) {
+        std::filesystem::create_directories(dest.parent_path());
+        std::filesystem::copy_file(file.path, dest, std::filesystem::copy_options::overwrite_existing);
+        return file.nonce;
+    }
+
+    MappedFile           mapped;
+    SQLiteFS::DataOutput buffer;
+    auto                 data = loadSidecar(file, key, mapped, buffer);
+    if (!data) {
+        throw std::runtime_error("Can't read sidecar file " + file.path.string());
+    }
+
+    auto nonce = dest_key ? std::optional{randomNonce()} : std::nullopt;
+    writeSidecar(dest, *data, dest_key, nonce);
+    return nonce;
+}
+
+// CRC32C of the data as it's stored, nothing if the file has no data
+std::optional<std::uint32_t> storedChecksum(const SQLite::Database&         db,
+                                            const std::filesystem::path&    sidecar_dir,
+                                            const std::optional<CipherKey>& sidecar_key,
+                                            std::uint32_t                   id) {
+    if (auto data = prepare(db, GET_FILE_DATA, id); data.executeStep()) {
+        const auto& column = data.getColumn(0);
+        return crc32c({static_cast<const char*>(column.getBlob()), static_cast<std::size_t>(column.getBytes())});
+    }
+
+    if (auto file = sidecarFile(db, sidecar_dir, id); file) {
+        MappedFile           mapped;
+        SQLiteFS::DataOutput buffer;
+        auto                 stored = loadSidecar(*file, sidecar_key, mapped, buffer);
+        return stored ? std::optional{crc32c(*stored)} : std::nullopt;
+    }
+
+    std::optional<std::uint32_t> crc;
+    for (auto chunk = prepare(db, GET_CHUNKS, id); chunk.executeStep();) {
+        const auto& column = chunk.getColumn(0);
+        const auto* blob   = static_cast<const char*>(column.getBlob());
+        crc                = crc32c({blob, static_cast<std::size_t>(column.getBytes())}, crc.value_or(0));
+    }
+    return crc;
+}
+
+void readNode(const SQLite::Statement& query, SQLiteFSNode& out) {
+    out.id          = query.getColumn(0).getUInt();
+    out.parent_id   = query.getColumn(1).getUInt();
+    out.name        = query.getColumn(2).getText();
+    out.attributes  = static_cast<SQLiteFSNode::Attributes>(query.getColumn(3).getInt());
+    out.size        = query.getColumn(4).getInt64();
+    out.size_raw    = query.getColumn(5).getInt64();
+    out.compression = query.getColumn(6).getText();
+}
+
 } // namespace
 
 template<typename... Args>
 int SQLiteFS::Impl::exec(const std::string& query_string, Args&&... args) {
     SQLITEFS_SCOPED_PROFILER;
+    SQLITEFS_PROFILER(ZoneText(query_string.data(), query_string.size()));
     using namespace std::literals;
 
     try {
@@ -40,20 +377,23 @@ int SQLiteFS::Impl::exec(const std::string& query_string, Args&&... args) {
             (query.bind(Is + 1, std::forward<Args>(args)), ...);
         }(std::make_index_sequence<sizeof...(Args)>{});
         return query.exec();
-    } catch (std::exception& e) { m_last_error = "SQL Error: "s + e.what(); }
+    } catch (SQLite::Exception& e) {
+        // a taken name is an expected outcome of mkdir/write, no need for the message
+        if (e.getExtendedErrorCode() == SQLITE_CONSTRAINT_UNIQUE ||
+            e.getExtendedErrorCode() == SQLITE_CONSTRAINT_PRIMARYKEY) {
+            fail(SQLiteFSError::ALREADY_EXISTS);
+        } else {
+            fail(SQLiteFSError::SQL, "SQL Error: "s + e.what());
+        }
+    } catch (std::exception& e) { fail(SQLiteFSError::SQL, "SQL Error: "s + e.what()); }
     return 0;
 }
 
 template<typename... Args>
 SQLite::Statement SQLiteFS::Impl::select(const std::string& query_string, Args&&... args) const {
     SQLITEFS_SCOPED_PROFILER;
-
-    SQLite::Statement query{m_db, query_string};
-
-    [&]<size_t... Is>(std::index_sequence<Is...>) {
-        (query.bind(Is + 1, std::forward<Args>(args)), ...);
-    }(std::make_index_sequence<sizeof...(Args)>{});
-    return query;
+    SQLITEFS_PROFILER(ZoneText(query_string.data(), query_string.size()));
+    return prepare(m_db, query_string, std::forward<Args>(args)...);
 }
 
 bool SQLiteFS::Impl::saveBlob(std::uint32_t id, DataInput data) {
@@ -65,48 +405,263 @@ bool SQLiteFS::Impl::saveBlob(std::uint32_t id, DataInput data) {
         query.bind(1, id);
         query.bindNoCopy(2, data.data(), data.size());
         return query.exec();
-    } catch (std::exception& e) { m_last_error = "SQL Error: "s + e.what(); }
+    } catch (std::exception& e) { fail(SQLiteFSError::SQL, "SQL Error: "s + e.what()); }
     return false;
 }
 
+bool SQLiteFS::Impl::saveSidecar(std::uint32_t id, DataInput data, const std::string& name) {
+    SQLITEFS_SCOPED_PROFILER;
+    using namespace std::literals;
+
+    auto file  = m_sidecar_dir / name;
+    auto nonce = m_sidecar_key ? std::optional{randomNonce()} : std::nullopt;
+    try {
+        writeSidecar(file, data, m_sidecar_key, nonce);
+    } catch (std::exception& e) {
+        fail(SQLiteFSError::IO, e.what());
+        return false;
+    }
+
+    try {
+        if (setSidecar(m_db, SET_SIDECAR, id, name, nonce) > 0) {
+            return true;
+        }
+    } catch (std::exception& e) { fail(SQLiteFSError::SQL, "SQL Error: "s + e.what()); }
+
+    std::error_code ec;
+    std::filesystem::remove(file, ec);
+    return false;
+}
+
+bool SQLiteFS::Impl::copyData(std::uint32_t from, std::uint32_t to) {
+    SQLITEFS_SCOPED_PROFILER;
+    using namespace std::literals;
+
+    if (exec(COPY_FILE_RAW, to, from) > 0) {
+        return true;
+    }
+
+    // chunks of an update()d file get new ids, the list follows them. Kept versions stay with the source
+    std::vector<std::pair<std::int64_t, std::int64_t>> list;
+    for (auto query = select(LIST_GET, from); query.executeStep();) {
+        list.emplace_back(query.getColumn(0).getInt64(), query.getColumn(1).getInt64());
+    }
+    if (!list.empty()) {
+        std::unordered_map<std::int64_t, std::int64_t> copies;
+        for (const auto& [seq, chunk] : list) {
+            auto [copy, added] = copies.try_emplace(chunk, 0);
+            if (added) {
+                if (exec(COPY_CHUNK, to, chunk) == 0) {
+                    return false;
+                }
+                copy->second = m_db.getLastInsertRowid();
+            }
+
+            if (exec(LIST_ADD, to, seq, copy->second) == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    auto source = sidecar(from);
+    if (!source) {
+        return false;
+    }
+
+    // the copy keeps the nonce, both files hold the same data under the same key
+    auto                       name = std::to_string(to);
+    auto                       file = m_sidecar_dir / name;
+    std::optional<CipherNonce> nonce;
+    try {
+        nonce = copySidecar(*source, m_sidecar_key, file, m_sidecar_key);
+    } catch (std::exception& e) {
+        fail(SQLiteFSError::IO, "Can't copy sidecar file " + source->path.string() + ": " + e.what());
+        return false;
+    }
+
+    try {
+        if (setSidecar(m_db, SET_SIDECAR, to, name, nonce) > 0) {
+            return true;
+        }
+    } catch (std::exception& e) { fail(SQLiteFSError::SQL, "SQL Error: "s + e.what()); }
+
+    std::error_code ec;
+    std::filesystem::remove(file, ec);
+    return false;
+}
+
+
+SQLiteFS::Impl::Impl(std::string path, std::string_view key, const Options& options)
+  : m_db_path(std::move(path))
+  , m_db(options.in_memory ? ":memory:" : openTarget(m_db_path, options),
+         options.in_memory ? SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE | mutexFlags() : openFlags(options),
+         options.busy_timeout_ms)
+  , m_busy_timeout_ms(options.busy_timeout_ms)
+  , m_key(key)
+  , m_verify(options.verify)
+  , m_verify_sample(std::max(options.verify_sample, 1U))
+  , m_chunk_size(options.update_chunk_size)
+  , m_keep_versions(options.keep_versions)
+  , m_sidecar_dir(m_db_path + ".blobs")
+  , m_sidecar_threshold(options.sidecar_threshold)
+  , m_sidecar_key(sidecarKey(key))
+  , m_query_stats(options.query_stats)
+  , m_slow_query(options.slow_query_threshold)
+  , m_recompress_alg(options.recompress_alg)
+  , m_recompress_path(options.recompress_path)
+  , m_recompress_interval(options.recompress_interval)
+  , m_recompress_bytes(options.recompress_bytes)
+  , m_recompress_idle(options.recompress_idle)
+  , m_shared_reads(sqlite3_db_mutex(m_db.getHandle()) != nullptr)
+  , m_lock_stats(options.lock_stats) {
+    if (m_query_stats || m_slow_query.count() > 0) {
+        sqlite3_trace_v2(m_db.getHandle(), SQLITE_TRACE_PROFILE, &Impl::traceProfile, this);
+    }
+    if (options.in_memory) {
+        m_file.emplace(openTarget(m_db_path, options), openFlags(options), options.busy_timeout_ms);
+    }
+    auto& file = m_file ? *m_file : m_db;
+
+    // the cipher works with the page size, so it must be known before the key is set
+    if (options.page_size) {
+        file.exec("PRAGMA page_size = " + std::to_string(*options.page_size));
+    }
 
-SQLiteFS::Impl::Impl(std::string path, std::string_view key)
-  : m_db_path(std::move(path)), m_db(m_db_path, SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE) {
+    m_read_only = options.read_only || options.immutable;
+    m_immutable = options.immutable;
     if (!key.empty()) {
         SecureString secure{key};
-        if (SQLite::Database::isUnencrypted(m_db_path)) {
-            m_db.rekey(secure);
-        } else {
-            m_db.key(secure);
+        if (!SQLite::Database::isUnencrypted(m_db_path)) {
+            file.key(secure);
+        } else if (!m_read_only) {
+            file.rekey(secure);
         }
     }
 
+    applyPragmas(file, options);
+    if (m_file) {
+        load();
+    }
+    applyAutoVacuum(m_db, options);
     m_db.exec("PRAGMA foreign_keys = ON");
+
+    if (m_read_only) {
+        m_ancestor_index = m_db.tableExists("tree");
+        m_journal        = m_db.tableExists("changes");
+        m_checksums      = m_db.tableExists("checksum");
+        return;
+    }
+
+    const bool          has_usage = m_db.tableExists("usage");
     SQLite::Transaction transaction(m_db);
     for (const auto& q : INIT_DB) {
         m_db.exec(q);
     }
+    if (!has_usage) {
+        m_db.exec(USAGE_REBUILD);
+    }
+    // chunks stored before digests have none and are never reused
+    if (m_db.execAndGet(HAS_DIGEST).getInt() == 0) {
+        m_db.exec(ADD_DIGEST);
+    }
+
+    m_ancestor_index = m_db.tableExists("tree");
+    if (options.ancestor_index && !m_ancestor_index) {
+        for (const auto& q : INIT_TREE) {
+            m_db.exec(q);
+        }
+        m_db.exec(TREE_REBUILD);
+        m_ancestor_index = true;
+    }
+
+    if (options.change_journal) {
+        m_db.exec(INIT_JOURNAL);
+    }
+    m_journal      = m_db.tableExists("changes");
+    m_journal_keep = options.journal_keep;
+
+    m_checksums = m_db.tableExists("checksum");
+    if (options.checksums && !m_checksums) {
+        m_db.exec(INIT_CHECKSUMS);
+        m_checksums = true;
+
+        std::vector<std::uint32_t> files;
+        for (auto query = select(ALL_CHECKSUMS); query.executeStep();) {
+            files.push_back(query.getColumn(0).getUInt());
+        }
+        for (auto id : files) {
+            if (auto crc = storedChecksum(m_db, m_sidecar_dir, m_sidecar_key, id); crc) {
+                prepare(m_db, SET_CHECKSUM, id, *crc).exec();
+            }
+        }
+    }
+
+    // sidecars written before the key was set get encrypted copies, the plain files go after the commit
+    std::vector<std::filesystem::path> plain;
+    if (m_sidecar_key) {
+        std::vector<std::pair<std::uint32_t, std::string>> files;
+        for (auto query = select(PLAIN_SIDECARS); query.executeStep();) {
+            files.emplace_back(query.getColumn(0).getUInt(), query.getColumn(1).getText());
+        }
+        for (const auto& [id, name] : files) {
+            const SidecarFile file{.path = m_sidecar_dir / name, .nonce = std::nullopt};
+            const auto        encrypted = "key-" + name;
+            const auto        nonce     = copySidecar(file, std::nullopt, m_sidecar_dir / encrypted, m_sidecar_key);
+            setSidecar(m_db, MOVE_SIDECAR, id, encrypted, nonce);
+            plain.push_back(m_sidecar_dir / name);
+        }
+    }
     transaction.commit();
+    removeSidecars(std::move(plain));
+
+    if (options.reclaim_interval.count() > 0) {
+        every(options.reclaim_interval, [this, pages = options.reclaim_pages] { reclaim(pages); });
+    }
+
+    if (m_file && options.flush_interval.count() > 0) {
+        every(options.flush_interval, [this] { flush(); });
+    }
+
+    // codecs are registered after the construction, the worker is started by registerSaveFunc
+}
+
+SQLiteFS::Impl::~Impl() {
+    m_workers.clear();
+    if (m_file && !m_read_only) {
+        flush();
+    }
+    sqlite3_trace_v2(m_db.getHandle(), 0, nullptr, nullptr);
 }
 
 bool SQLiteFS::Impl::mkdir(const std::string& full_path) {
     SQLITEFS_SCOPED_PROFILER;
 
-    std::lock_guard lock(m_mutex);
+    Lock lock(*this, LockOp::MKDIR);
 
     const auto& [path_id, name] = splitPathAndName(full_path);
     if (!path_id) {
-        m_last_error = "Can't find path";
+        fail(SQLiteFSError::NOT_FOUND);
         return false;
     }
 
-    return exec(MKDIR, *path_id, name);
+    SQLite::Transaction transaction(m_db);
+
+    const bool success = exec(MKDIR, *path_id, name) > 0 &&
+                         journal(SQLiteFSChange::Op::MKDIR, static_cast<std::uint32_t>(m_db.getLastInsertRowid()), 0);
+
+    if (success) {
+        transaction.commit();
+    } else {
+        transaction.rollback();
+    }
+    return success;
 }
 
 bool SQLiteFS::Impl::cd(const std::string& path) {
     SQLITEFS_SCOPED_PROFILER;
 
-    std::lock_guard lock(m_mutex);
+    Lock lock(*this, LockOp::CD);
 
     auto path_id = resolve(path);
     if (!path_id) {
@@ -119,7 +674,7 @@ bool SQLiteFS::Impl::cd(const std::string& path) {
         return true;
     }
 
-    m_last_error = "Can't find path";
+    fail(SQLiteFSError::NOT_FOUND);
     return false;
 }
 
@@ -130,93 +685,251 @@ bool SQLiteFS::Impl::rm(const std::string& path) {
         return false;
     }
 
-    std::lock_guard lock(m_mutex);
+    Lock lock(*this, LockOp::RM);
 
     auto path_id = resolve(path);
-    if (!path_id) {
+    if (!path_id || *path_id == SQLITEFS_ROOT) {
+        return false;
+    }
+
+    auto current_node = node(*path_id);
+    if (!current_node) {
         return false;
     }
-    auto result = exec(RM, *path_id);
+
+
+    auto                amount  = usage(*current_node);
+    auto                files   = sidecars(*path_id);
+    bool                success = true;
+    SQLite::Transaction transaction(m_db);
+
+    success &= journal(SQLiteFSChange::Op::RM, *path_id, amount.size_raw);
+    success &= addUsage(current_node->parent_id, {-amount.files, -amount.size, -amount.size_raw});
+    success &= exec(m_ancestor_index ? RM_INDEXED : RM, *path_id) > 0;
+
+    if (success) {
+        transaction.commit();
+        removeSidecars(std::move(files));
+    } else {
+        fail(SQLiteFSError::INTERNAL, "Internal error: can't remove node");
+        transaction.rollback();
+    }
 
     // if folder in current path was removed
     if (!node(m_cwd)) {
         m_cwd = SQLITEFS_ROOT;
     }
 
-    return result;
+    return success;
 }
 
 std::string SQLiteFS::Impl::pwd() const {
     SQLITEFS_SCOPED_PROFILER;
 
-    std::lock_guard lock(m_mutex);
+    Lock lock(*this, LockOp::PWD, true);
 
-    auto query = select(PWD, m_cwd);
+    auto query = select(m_ancestor_index ? PWD_INDEXED : PWD, m_cwd);
     return query.executeStep() ? query.getColumn(0).getString() : "";
 }
 
-std::vector<SQLiteFSNode> SQLiteFS::Impl::ls(const std::string& path) const {
+SQLiteFSListing SQLiteFS::Impl::list(const std::string& path) const {
     SQLITEFS_SCOPED_PROFILER;
 
-    std::vector<SQLiteFSNode> content;
-    std::lock_guard           lock(m_mutex);
+    SQLiteFSListing listing;
+    listing.name_offsets.push_back(0);
+
+    auto append = [&listing](const SQLite::Statement& query) {
+        listing.ids.push_back(query.getColumn(0).getUInt());
+        listing.parent_ids.push_back(query.getColumn(1).getUInt());
+        listing.attributes.push_back(static_cast<SQLiteFSNode::Attributes>(query.getColumn(3).getInt()));
+        listing.sizes.push_back(query.getColumn(4).getInt64());
+        listing.sizes_raw.push_back(query.getColumn(5).getInt64());
+
+        auto name = query.getColumn(2);
+        listing.names.append(name.getText(), name.getBytes());
+        listing.name_offsets.push_back(static_cast<std::uint32_t>(listing.names.size()));
+
+        auto codec = query.getColumn(6);
+        if (codec.isNull()) {
+            listing.codec_ids.push_back(SQLiteFSListing::NO_CODEC);
+            return;
+        }
 
+        // there are only a few codecs, a linear search beats hashing here
+        std::string_view codec_name{codec.getText(), static_cast<std::size_t>(codec.getBytes())};
+        auto             it = std::find(listing.codecs.begin(), listing.codecs.end(), codec_name);
+        if (it == listing.codecs.end()) {
+            it = listing.codecs.emplace(it, codec_name);
+        }
+        listing.codec_ids.push_back(static_cast<std::uint16_t>(it - listing.codecs.begin()));
+    };
+
+    Lock lock(*this, LockOp::LS, true);
+
+    // resolved the same way as by the paged ls
     auto current_node = node(path + "/");
     if (!current_node) {
-        return content;
+        return listing;
     }
 
-    if (!(current_node->attributes & SQLiteFSNode::Attributes::FILE)) {
-        auto row_count = select(LS_COUNT, current_node->id);
-        if (!row_count.executeStep()) {
-            return content;
+    if (current_node->attributes & SQLiteFSNode::Attributes::FILE) {
+        if (auto query = select(GET_NODE_BY_ID, current_node->id); query.executeStep()) {
+            append(query);
         }
-        content.reserve(row_count.getColumn(0).getUInt());
+        return listing;
+    }
+
+    auto query = select(LS, current_node->id);
+    while (query.executeStep()) {
+        append(query);
+    }
+    return listing;
+}
+
+std::vector<SQLiteFSNode> SQLiteFS::Impl::ls(const std::string& path,
+                                             const std::string& after_name,
+                                             std::size_t        limit) const {
+    SQLITEFS_SCOPED_PROFILER;
+
+    std::vector<SQLiteFSNode> content;
+    Lock                      lock(*this, LockOp::LS, true);
 
-        auto query = select(LS, current_node->id);
+    auto current_node = node(path + "/");
+    if (!current_node || limit == 0) {
+        return content;
+    }
 
-        while (auto child_node = node(query)) {
-            content.emplace_back(std::move(*child_node));
+    if (current_node->attributes & SQLiteFSNode::Attributes::FILE) {
+        if (after_name.empty()) {
+            content.emplace_back(std::move(*current_node));
         }
         return content;
     }
 
-    content.emplace_back(std::move(*current_node));
+    // keyset pagination: (parent, name) is unique and indexed, so every page is a single range scan
+    auto page_size = static_cast<std::int64_t>(limit);
+    auto query     = after_name.empty() ? select(LS_PAGE_FIRST, current_node->id, page_size)
+                                        : select(LS_PAGE, current_node->id, after_name, page_size);
+
+    while (query.executeStep()) {
+        readNode(query, content.emplace_back());
+    }
     return content;
 }
 
-bool SQLiteFS::Impl::write(const std::string& full_path, DataInput data, const std::string& alg) {
+std::size_t SQLiteFS::Impl::find(const std::string&  path,
+                                 const FindFilter&   filter,
+                                 const FindCallback& callback) const {
     SQLITEFS_SCOPED_PROFILER;
+    using namespace std::literals;
 
-    auto data_modified = internalCall(alg, data, m_save_funcs);
+    std::size_t found = 0;
+    Lock        lock(*this, LockOp::FIND, true);
 
-    std::lock_guard lock(m_mutex);
+    auto root_id = resolve(path);
+    if (!root_id) {
+        return found;
+    }
 
-    const auto& [path_id, name] = splitPathAndName(full_path);
-    if (!path_id || name.empty()) {
-        m_last_error = "Can't find path";
+    try {
+        SQLite::Statement query{m_db, m_ancestor_index ? FIND_INDEXED : FIND};
+        query.bind(1, *root_id);
+        if (!filter.name.empty()) {
+            query.bind(2, filter.name);
+        }
+        if (filter.attributes) {
+            query.bind(3, static_cast<std::uint32_t>(*filter.attributes));
+        }
+        if (filter.min_size) {
+            query.bind(4, *filter.min_size);
+        }
+        if (filter.max_size) {
+            query.bind(5, *filter.max_size);
+        }
+        if (!filter.compression.empty()) {
+            query.bind(6, filter.compression);
+        }
+        if (filter.max_depth) {
+            query.bind(7, *filter.max_depth);
+        }
+
+        // one node is reused for the whole walk to keep string buffers
+        SQLiteFSNode current;
+        while (query.executeStep()) {
+            readNode(query, current);
+            ++found;
+            if (!std::invoke(callback, current)) {
+                break;
+            }
+        }
+    } catch (std::exception& e) { fail(SQLiteFSError::SQL, "SQL Error: "s + e.what()); }
+
+    return found;
+}
+
+bool SQLiteFS::Impl::write(const std::string& full_path, DataInput data, const std::string& alg) {
+    SQLITEFS_SCOPED_PROFILER;
+
+    auto data_modified = internalCall(alg, data, m_save_funcs);
+    return store(full_path, data_modified, data.size(), alg);
+}
+
+bool SQLiteFS::Impl::write(const std::string&         full_path,
+                           DataInput                  data,
+                           const std::string&         alg,
+                           std::pmr::memory_resource* resource) {
+    SQLITEFS_SCOPED_PROFILER;
+
+    auto data_modified = internalCall(alg, data, m_pmr_save_funcs, m_save_funcs, resource);
+    return store(full_path, data_modified, data.size(), alg);
+}
+
+bool SQLiteFS::Impl::store(const std::string& full_path,
+                           DataInput          data_modified,
+                           std::size_t        size_raw,
+                           const std::string& alg) {
+    SQLITEFS_SCOPED_PROFILER;
+
+    Lock lock(*this, LockOp::WRITE);
+
+    const auto& [path_id, name] = splitPathAndName(full_path);
+    if (!path_id || name.empty()) {
+        fail(SQLiteFSError::NOT_FOUND);
         return false;
     }
 
 
-    bool                success = true;
     SQLite::Transaction transaction(m_db);
 
-    success &= exec(TOUCH,
-                    *path_id,
-                    name,
-                    static_cast<std::int64_t>(data_modified.size()),
-                    static_cast<std::int64_t>(data.size()),
-                    alg);
+    const bool touched = exec(TOUCH,
+                              *path_id,
+                              name,
+                              static_cast<std::int64_t>(data_modified.size()),
+                              static_cast<std::int64_t>(size_raw),
+                              alg) > 0;
 
-    auto new_node = node(*path_id, name);
-    success &= new_node && saveBlob(new_node->id, data_modified);
+    const bool sidecar = m_sidecar_threshold > 0 && std::ssize(data_modified) > m_sidecar_threshold;
+
+    auto       new_node = node(*path_id, name);
+    const bool stored   = touched && new_node &&
+                        (sidecar ? saveSidecar(new_node->id, data_modified, std::to_string(new_node->id))
+                                 : saveBlob(new_node->id, data_modified));
+    const bool success  = stored &&
+                         (!m_checksums || exec(SET_CHECKSUM, new_node->id, crc32c(data_modified)) > 0) &&
+                         addUsage(*path_id, usage(*new_node)) &&
+                         journal(SQLiteFSChange::Op::WRITE, new_node->id, static_cast<std::int64_t>(size_raw));
 
     if (success) {
         transaction.commit();
     } else {
-        m_last_error = "Internal error: Can't write data";
+        // a failed touch already tells why
+        if (touched) {
+            fail(SQLiteFSError::INTERNAL, "Internal error: Can't write data");
+        }
         transaction.rollback();
+        if (sidecar && stored) {
+            removeSidecars({m_sidecar_dir / std::to_string(new_node->id)});
+        }
     }
 
     return success;
@@ -224,10 +937,78 @@ bool SQLiteFS::Impl::write(const std::string& full_path, DataInput data, const s
 
 SQLiteFS::DataOutput SQLiteFS::Impl::read(const std::string& full_path) const {
     SQLITEFS_SCOPED_PROFILER;
+
+    auto result = tryRead(full_path);
+    return result ? std::move(result).value() : DataOutput{};
+}
+
+SQLiteFSResult<SQLiteFS::DataOutput> SQLiteFS::Impl::tryRead(const std::string& full_path) const {
+    SQLITEFS_SCOPED_PROFILER;
     using namespace std::literals;
 
-    DataOutput       result;
-    std::unique_lock lock(m_mutex);
+    Lock lock(*this, LockOp::READ, true);
+
+    auto id = resolve(full_path);
+    if (!id) {
+        return SQLiteFSError::NOT_FOUND;
+    }
+
+    auto current_node = node(*id);
+    if (!current_node) {
+        return SQLiteFSError::NOT_FOUND;
+    }
+    if (!(current_node->attributes & SQLiteFSNode::Attributes::FILE)) {
+        return fail(SQLiteFSError::NOT_A_FILE);
+    }
+
+    std::string              data;
+    MappedFile               mapped;
+    DataOutput               decrypted;
+    DataOutput               chunked;
+    std::vector<std::size_t> chunk_sizes;
+    DataInput                view;
+
+    auto data_query = select(GET_FILE_DATA, *id);
+    if (data_query.executeStep()) {
+        data = data_query.getColumn(0).getString();
+        view = std::span{reinterpret_cast<const char*>(data.data()), data.size()};
+    } else if (auto file = sidecar(*id); file) {
+        // the mapping stays readable even if the file is removed while the lock is released
+        auto stored = loadSidecar(*file, m_sidecar_key, mapped, decrypted);
+        if (!stored) {
+            return fail(SQLiteFSError::IO, "Can't read sidecar file " + file->path.string());
+        }
+        view = *stored;
+    } else if (chunks(*id, chunked, chunk_sizes)) {
+        view = chunked;
+    } else {
+        assert(false && "internal error: DB is broken. No data for file node");
+        return fail(SQLiteFSError::INTERNAL, "Internal error: no data for file node");
+    }
+
+    if (!verify(*id, view)) {
+        return SQLiteFSError::CORRUPTED;
+    }
+
+    lock.unlock();
+    auto&& temp = chunk_sizes.empty()
+                  ? internalCall(current_node->compression, view, m_load_funcs)
+                  : decodeChunks(current_node->compression, std::move(chunked), chunk_sizes, m_load_funcs);
+    lock.lock();
+
+    if (static_cast<std::size_t>(current_node->size_raw) != temp.size()) {
+        return fail(SQLiteFSError::SIZE_MISMATCH,
+                    "File size doesn't mach.\nFS meta - "s + std::to_string(current_node->size_raw) +
+                      ", File - " + std::to_string(temp.size()));
+    }
+    return std::move(temp);
+}
+
+SQLiteFS::PmrDataOutput SQLiteFS::Impl::read(const std::string& full_path, std::pmr::memory_resource* resource) const {
+    SQLITEFS_SCOPED_PROFILER;
+
+    PmrDataOutput result(resource);
+    Lock          lock(*this, LockOp::READ, true);
 
     auto id = resolve(full_path);
     if (!id) {
@@ -235,37 +1016,309 @@ SQLiteFS::DataOutput SQLiteFS::Impl::read(const std::string& full_path) const {
     }
 
     auto current_node = node(*id);
-    if (current_node && (current_node->attributes & SQLiteFSNode::Attributes::FILE)) {
-        auto data_query = select(GET_FILE_DATA, *id);
-        if (!data_query.executeStep()) {
-            assert(false && "internal error: DB is broken. No data for file node");
+    if (!current_node) {
+        return result;
+    }
+    if (!(current_node->attributes & SQLiteFSNode::Attributes::FILE)) {
+        fail(SQLiteFSError::NOT_A_FILE);
+        return result;
+    }
+
+    const bool               raw = current_node->compression == "raw";
+    PmrDataOutput            data(resource);
+    MappedFile               mapped;
+    DataOutput               decrypted;
+    DataOutput               chunked;
+    std::vector<std::size_t> chunk_sizes;
+    DataInput                view;
+
+    auto data_query = select(GET_FILE_DATA, *id);
+    if (data_query.executeStep()) {
+        const auto& column = data_query.getColumn(0);
+        const auto* blob   = static_cast<const char*>(column.getBlob());
+
+        // raw data goes straight to the result, anything else is copied once to decode it without the lock
+        auto& target = raw ? result : data;
+        target.assign(blob, blob + column.getBytes());
+        view = target;
+    } else if (auto file = sidecar(*id); file) {
+        auto stored = loadSidecar(*file, m_sidecar_key, mapped, decrypted);
+        if (!stored) {
+            fail(SQLiteFSError::IO, "Can't read sidecar file " + file->path.string());
             return result;
         }
+        view = *stored;
+    } else if (chunks(*id, chunked, chunk_sizes)) {
+        view = chunked;
+    } else {
+        assert(false && "internal error: DB is broken. No data for file node");
+        return result;
+    }
 
-        auto data = data_query.getColumn(0).getString();
+    if (!verify(*id, view)) {
+        result.clear();
+        return result;
+    }
 
+    if (view.data() != result.data()) {
         lock.unlock();
-        auto   view = std::span{reinterpret_cast<const char*>(data.data()), data.size()};
-        auto&& temp = internalCall(current_node->compression, view, m_load_funcs);
+        auto temp =
+          chunk_sizes.empty()
+            ? internalCall(current_node->compression, view, m_pmr_load_funcs, m_load_funcs, resource)
+            : decodeChunks(current_node->compression, view, chunk_sizes, m_pmr_load_funcs, m_load_funcs, resource);
         lock.lock();
+        result = std::move(temp);
+    }
 
-        if (static_cast<std::size_t>(current_node->size_raw) != temp.size()) {
-            m_last_error = "File size doesn't mach.\nFS meta - "s + std::to_string(current_node->size_raw) +
-                           ", File - " + std::to_string(temp.size());
-        } else {
-            result = std::move(temp);
+    if (static_cast<std::size_t>(current_node->size_raw) != result.size()) {
+        fail(SQLiteFSError::SIZE_MISMATCH,
+             "File size doesn't mach.\nFS meta - " + std::to_string(current_node->size_raw) +
+               ", File - " + std::to_string(result.size()));
+        result.clear();
+    }
+    return result;
+}
+
+SQLiteFS::ReadView SQLiteFS::Impl::readView(const std::string& full_path) const {
+    SQLITEFS_SCOPED_PROFILER;
+
+    ReadView result;
+    auto     state = std::make_unique<ReadView::State>();
+    Lock     lock(*this, LockOp::READ, true);
+
+    auto id = resolve(full_path);
+    if (!id) {
+        return result;
+    }
+
+    auto current_node = node(*id);
+    if (!current_node) {
+        return result;
+    }
+    if (!(current_node->attributes & SQLiteFSNode::Attributes::FILE)) {
+        fail(SQLiteFSError::NOT_A_FILE);
+        return result;
+    }
+
+    const bool               raw = current_node->compression == "raw";
+    std::vector<std::size_t> chunk_sizes;
+
+    auto data_query = select(GET_FILE_DATA, *id);
+    if (data_query.executeStep()) {
+        const auto& column = data_query.getColumn(0);
+        state->view = {static_cast<const char*>(column.getBlob()), static_cast<std::size_t>(column.getBytes())};
+        state->statement.emplace(std::move(data_query));
+    } else if (auto file = sidecar(*id); file) {
+        // an encrypted file is decrypted into the buffer
+        auto stored = loadSidecar(*file, m_sidecar_key, state->mapped, state->buffer);
+        if (!stored) {
+            fail(SQLiteFSError::IO, "Can't read sidecar file " + file->path.string());
+            return result;
         }
+        state->view = *stored;
+    } else if (chunks(*id, state->buffer, chunk_sizes)) {
+        // chunks are put together into the buffer anyway
+        state->view = state->buffer;
+    } else {
+        assert(false && "internal error: DB is broken. No data for file node");
+        return result;
+    }
+
+    if (!verify(*id, state->view)) {
+        return result;
+    }
+
+    if (!raw) {
+        // the decoded copy doesn't depend on the db anymore
+        auto input = state->view;
+        lock.unlock();
+        state->buffer = chunk_sizes.empty()
+                        ? internalCall(current_node->compression, input, m_load_funcs)
+                        : decodeChunks(current_node->compression, std::move(state->buffer), chunk_sizes, m_load_funcs);
+        state->statement.reset();
+        state->mapped = {};
+        state->view   = state->buffer;
+        lock.lock();
+    }
+
+    if (static_cast<std::size_t>(current_node->size_raw) != state->view.size()) {
+        fail(SQLiteFSError::SIZE_MISMATCH,
+             "File size doesn't mach.\nFS meta - " + std::to_string(current_node->size_raw) +
+               ", File - " + std::to_string(state->view.size()));
         return result;
     }
 
-    m_last_error = "Can't read folder data";
+    // only a view into SQLite's buffer needs the lock
+    if (state->statement) {
+        state->lock = std::move(lock);
+    }
+    result.m_state = std::move(state);
     return result;
 }
 
+bool SQLiteFS::Impl::update(const std::string& full_path, DataInput data, const std::string& alg) {
+    SQLITEFS_SCOPED_PROFILER;
+    using namespace std::literals;
+
+    const auto pieces = splitChunks(data, m_chunk_size);
+    Lock       lock(*this, LockOp::UPDATE);
+
+    const auto& [path_id, name] = splitPathAndName(full_path);
+    if (!path_id || name.empty()) {
+        fail(SQLiteFSError::NOT_FOUND);
+        return false;
+    }
+
+    // a missing file isn't an error here
+    auto existing = [&, &path_id = path_id, &name = name] {
+        std::optional<SQLiteFSNode> result;
+        if (auto query = select(GET_NODE, *path_id, name); query.executeStep()) {
+            readNode(query, result.emplace());
+        }
+        return result;
+    };
+
+    // chunks are reused only with the same codec
+    auto reusable = [&](const std::optional<SQLiteFSNode>& current) {
+        return current ? storedChunks(current->id, alg) : StoredChunks{};
+    };
+
+    // the hash only finds a candidate, the digest decides
+    auto find = [](const StoredChunks& stored, const DataChunk& piece) -> const StoredChunk* {
+        auto it = stored.find(piece.hash);
+        return it != stored.end() && it->second.size_raw == static_cast<std::int64_t>(piece.size) &&
+                   it->second.digest == piece.digest
+                 ? &it->second
+                 : nullptr;
+    };
+
+    // new chunks are encoded without the lock
+    std::vector<std::optional<DataOutput>> encoded(pieces.size());
+    {
+        auto stored = reusable(existing());
+        lock.unlock();
+        for (std::size_t i = 0; i < pieces.size(); ++i) {
+            if (!find(stored, pieces[i])) {
+                encoded[i] = internalCall(alg, data.subspan(pieces[i].offset, pieces[i].size), m_save_funcs);
+            }
+        }
+        lock.lock();
+    }
+
+    // the file could be changed in the meantime, so the stored chunks are taken again
+    auto current = existing();
+    if (current && !(current->attributes & SQLiteFSNode::Attributes::FILE)) {
+        fail(SQLiteFSError::NOT_A_FILE);
+        return false;
+    }
+
+    // sizes and the checksum of the whole file come from the chunks, reused ones aren't read
+    auto                       stored = reusable(current);
+    std::vector<std::int64_t>  ids(pieces.size());
+    std::vector<std::uint32_t> crcs(pieces.size());
+    std::int64_t               size = 0;
+    std::uint32_t              crc  = 0;
+    for (std::size_t i = 0; i < pieces.size(); ++i) {
+        if (const auto* chunk = find(stored, pieces[i]); chunk) {
+            ids[i]  = chunk->id;
+            crcs[i] = chunk->crc;
+            size   += chunk->size;
+            crc     = crc32cCombine(crc, chunk->crc, static_cast<std::size_t>(chunk->size));
+            continue;
+        }
+
+        if (!encoded[i]) {
+            encoded[i] = internalCall(alg, data.subspan(pieces[i].offset, pieces[i].size), m_save_funcs);
+        }
+        crcs[i] = crc32c(*encoded[i]);
+        size   += std::ssize(*encoded[i]);
+        crc     = crc32cCombine(crc, crcs[i], encoded[i]->size());
+    }
+
+    const auto                         size_raw = static_cast<std::int64_t>(data.size());
+    std::vector<std::filesystem::path> stale;
+    bool                               success = true;
+    SQLite::Transaction                transaction(m_db);
+
+    try {
+        std::uint32_t id = 0;
+        if (current) {
+            id = current->id;
+            if (m_keep_versions > 0) {
+                success &= keepVersion(*current);
+            }
+            success &= exec(SET_FILE_META, size, size_raw, alg, id) > 0;
+
+            // the first update replaces the blob or the sidecar with chunks
+            if (auto file = sidecar(id); file) {
+                stale.push_back(file->path);
+                success &= exec(DEL_SIDECAR, id) > 0;
+            } else {
+                exec(DEL_FILE_DATA, id);
+            }
+            exec(LIST_CLEAR, id);
+        } else if (exec(TOUCH, *path_id, name, size, size_raw, alg) > 0) {
+            id = static_cast<std::uint32_t>(m_db.getLastInsertRowid());
+        } else {
+            // a failed touch already tells why
+            return false;
+        }
+
+        SQLite::Statement add_chunk{m_db, ADD_CHUNK};
+        SQLite::Statement add_list{m_db, LIST_ADD};
+        for (std::size_t i = 0; success && i < pieces.size(); ++i) {
+            if (ids[i] == 0) {
+                // an empty blob must not be bound as NULL
+                const char* bytes = encoded[i]->empty() ? "" : encoded[i]->data();
+
+                add_chunk.reset();
+                add_chunk.bind(1, id);
+                add_chunk.bind(2, static_cast<std::int64_t>(pieces[i].hash));
+                add_chunk.bind(3, static_cast<std::int64_t>(pieces[i].size));
+                add_chunk.bind(4, crcs[i]);
+                add_chunk.bindNoCopy(5, bytes, static_cast<int>(encoded[i]->size()));
+                add_chunk.bindNoCopy(6, pieces[i].digest.data(), static_cast<int>(pieces[i].digest.size()));
+                success &= add_chunk.exec() > 0;
+                ids[i]   = m_db.getLastInsertRowid();
+            }
+
+            add_list.reset();
+            add_list.bind(1, id);
+            add_list.bind(2, static_cast<std::int64_t>(i));
+            add_list.bind(3, ids[i]);
+            success &= add_list.exec() > 0;
+        }
+        if (m_keep_versions > 0) {
+            exec(VERSION_PRUNE, id, m_keep_versions);
+        }
+        exec(CHUNK_PRUNE, id);
+
+        const SQLiteFSUsage delta = current ? SQLiteFSUsage{.size     = size - current->size,
+                                                            .size_raw = size_raw - current->size_raw}
+                                            : SQLiteFSUsage{.files = 1, .size = size, .size_raw = size_raw};
+
+        success = success && (!m_checksums || exec(SET_CHECKSUM, id, crc) > 0) && addUsage(*path_id, delta) &&
+                  journal(current ? SQLiteFSChange::Op::UPDATE : SQLiteFSChange::Op::WRITE, id, size_raw);
+    } catch (std::exception& e) {
+        fail(SQLiteFSError::SQL, "SQL Error: "s + e.what());
+        success = false;
+    }
+
+    if (success) {
+        transaction.commit();
+        removeSidecars(std::move(stale));
+    } else {
+        fail(SQLiteFSError::INTERNAL, "Internal error: Can't update data");
+        transaction.rollback();
+    }
+
+    return success;
+}
+
 bool SQLiteFS::Impl::mv(const std::string& from, const std::string& to) {
     SQLITEFS_SCOPED_PROFILER;
 
-    std::lock_guard lock(m_mutex);
+    Lock lock(*this, LockOp::MV);
 
     auto [target_path_id, target_name] = splitPathAndName(to);
     if (!target_path_id) {
@@ -284,7 +1337,12 @@ bool SQLiteFS::Impl::mv(const std::string& from, const std::string& to) {
 
     if (auto target = node(*target_path_id, target_name);
         target && (target->attributes & SQLiteFSNode::Attributes::FILE)) {
-        m_last_error = "The target cannot be an existing file";
+        fail(SQLiteFSError::ALREADY_EXISTS);
+        return false;
+    }
+
+    if (isInside(source->id, *target_path_id)) {
+        fail(SQLiteFSError::INVALID_TARGET);
         return false;
     }
 
@@ -297,10 +1355,17 @@ bool SQLiteFS::Impl::mv(const std::string& from, const std::string& to) {
         success &= exec(SET_NAME, target_name, source->id);
     }
 
+    if (source->parent_id != *target_path_id) {
+        auto amount = usage(*source);
+        success &= addUsage(source->parent_id, {-amount.files, -amount.size, -amount.size_raw});
+        success &= addUsage(*target_path_id, amount);
+    }
+    success &= journal(SQLiteFSChange::Op::MV, source->id, usage(*source).size_raw);
+
     if (success) {
         transaction.commit();
     } else {
-        m_last_error = "Internal error: can't move node";
+        fail(SQLiteFSError::INTERNAL, "Internal error: can't move node");
         transaction.rollback();
     }
 
@@ -310,7 +1375,7 @@ bool SQLiteFS::Impl::mv(const std::string& from, const std::string& to) {
 bool SQLiteFS::Impl::cp(const std::string& from, const std::string& to) {
     SQLITEFS_SCOPED_PROFILER;
 
-    std::lock_guard lock(m_mutex);
+    Lock lock(*this, LockOp::CP);
 
     auto [target_path_id, target_name] = splitPathAndName(to);
     if (!target_path_id) {
@@ -329,7 +1394,7 @@ bool SQLiteFS::Impl::cp(const std::string& from, const std::string& to) {
 
     if (auto target = node(*target_path_id, target_name);
         target && (target->attributes & SQLiteFSNode::Attributes::FILE)) {
-        m_last_error = "The target cannot be an existing file";
+        fail(SQLiteFSError::ALREADY_EXISTS);
         return false;
     }
 
@@ -337,108 +1402,1528 @@ bool SQLiteFS::Impl::cp(const std::string& from, const std::string& to) {
     bool                success = true;
     SQLite::Transaction transaction(m_db);
 
-    success &= exec(COPY_FILE_FS, *target_path_id, target_name, source->id);
-    success &= exec(COPY_FILE_RAW, source->id);
+    success &= exec(COPY_FILE_FS, *target_path_id, target_name, source->id) > 0;
+
+    auto copy = node(*target_path_id, target_name);
+    success &= copy && copyData(source->id, copy->id);
+    success &= copy && (!m_checksums || exec(COPY_CHECKSUM, copy->id, source->id) > 0);
+    success &= addUsage(*target_path_id, usage(*source));
+    success &= copy && journal(SQLiteFSChange::Op::CP, copy->id, source->size_raw);
 
     if (success) {
         transaction.commit();
     } else {
-        m_last_error = "Internal error: can't copy node";
+        fail(SQLiteFSError::INTERNAL, "Internal error: can't copy node");
         transaction.rollback();
     }
 
     return success;
 }
 
-void SQLiteFS::Impl::vacuum() {
+SQLiteFSResult<SQLiteFSNode> SQLiteFS::Impl::stat(const std::string& path) const {
     SQLITEFS_SCOPED_PROFILER;
-    std::lock_guard lock(m_mutex);
-    exec("VACUUM");
-}
 
-std::string SQLiteFS::Impl::error() const {
-    std::string temp;
-    {
-        std::lock_guard lock(m_mutex);
-        temp.swap(m_last_error);
-    }
-    return temp;
-};
+    Lock lock(*this, LockOp::STAT, true);
 
-const std::string& SQLiteFS::Impl::path() const noexcept {
-    return m_db_path;
+    FolderCache       folders;
+    SQLite::Statement get_node{m_db, GET_NODE};
+    if (auto n = lookup(path, get_node, folders); n) {
+        return std::move(*n);
+    }
+    return SQLiteFSError::NOT_FOUND;
 }
 
-void SQLiteFS::Impl::registerSaveFunc(const std::string& name, const ConvertFunc& func) {
+std::vector<SQLiteFSResult<SQLiteFSNode>> SQLiteFS::Impl::statMany(std::span<const std::string> paths) const {
     SQLITEFS_SCOPED_PROFILER;
-    assert(!m_save_funcs.contains(name));
-    m_save_funcs.try_emplace(name, func);
+
+    std::vector<SQLiteFSResult<SQLiteFSNode>> result;
+    result.reserve(paths.size());
+
+    Lock lock(*this, LockOp::STAT, true);
+
+    FolderCache       folders;
+    SQLite::Statement get_node{m_db, GET_NODE};
+    for (const auto& path : paths) {
+        if (auto n = lookup(path, get_node, folders); n) {
+            result.emplace_back(std::move(*n));
+        } else {
+            result.emplace_back(SQLiteFSError::NOT_FOUND);
+        }
+    }
+    return result;
 }
-void SQLiteFS::Impl::registerLoadFunc(const std::string& name, const ConvertFunc& func) {
+
+std::vector<SQLiteFSVersion> SQLiteFS::Impl::versions(const std::string& full_path) const {
     SQLITEFS_SCOPED_PROFILER;
-    assert(!m_load_funcs.contains(name));
-    m_load_funcs.try_emplace(name, func);
+
+    Lock                         lock(*this, LockOp::VERSIONS, true);
+    std::vector<SQLiteFSVersion> result;
+
+    auto file = node(full_path);
+    if (!file) {
+        return result;
+    }
+    if (!(file->attributes & SQLiteFSNode::Attributes::FILE)) {
+        fail(SQLiteFSError::NOT_A_FILE);
+        return result;
+    }
+
+    for (auto query = select(GET_VERSIONS, file->id); query.executeStep();) {
+        result.push_back({
+          .version     = static_cast<std::uint32_t>(query.getColumn(0).getInt64()),
+          .size        = query.getColumn(1).getInt64(),
+          .size_raw    = query.getColumn(2).getInt64(),
+          .compression = query.getColumn(3).getText(),
+          .time        = query.getColumn(4).getInt64(),
+        });
+    }
+    return result;
 }
 
-SQLiteFS::DataOutput SQLiteFS::Impl::callSaveFunc(const std::string& name, DataInput data) {
+SQLiteFSResult<SQLiteFS::DataOutput> SQLiteFS::Impl::readVersion(const std::string& full_path,
+                                                                 std::uint32_t      version) const {
     SQLITEFS_SCOPED_PROFILER;
-    return internalCall(name, data, m_save_funcs);
+    using namespace std::literals;
+
+    Lock lock(*this, LockOp::VERSIONS, true);
+
+    auto file = node(full_path);
+    if (!file) {
+        return SQLiteFSError::NOT_FOUND;
+    }
+    if (!(file->attributes & SQLiteFSNode::Attributes::FILE)) {
+        return fail(SQLiteFSError::NOT_A_FILE);
+    }
+
+    auto info = select(GET_VERSION, file->id, version);
+    if (!info.executeStep()) {
+        return fail(SQLiteFSError::NOT_FOUND);
+    }
+    const auto        size_raw    = info.getColumn(0).getInt64();
+    const std::string compression = info.getColumn(1).getText();
+
+    DataOutput               stored;
+    std::vector<std::size_t> sizes;
+    auto                     query = select(GET_VERSION_CHUNKS, file->id, version);
+    chunks(query, stored, sizes);
+
+    lock.unlock();
+    auto data = decodeChunks(compression, std::move(stored), sizes, m_load_funcs);
+    lock.lock();
+
+    if (static_cast<std::size_t>(size_raw) != data.size()) {
+        return fail(SQLiteFSError::SIZE_MISMATCH,
+                    "File size doesn't mach.\nFS meta - "s + std::to_string(size_raw) +
+                      ", File - " + std::to_string(data.size()));
+    }
+    return data;
 }
-SQLiteFS::DataOutput SQLiteFS::Impl::callLoadFunc(const std::string& name, DataInput data) {
-    SQLITEFS_SCOPED_PROFILER;
-    return internalCall(name, data, m_load_funcs);
+
+std::size_t SQLiteFS::Impl::recompress(const std::string& path, const std::string& alg, std::int64_t budget) {
+    std::uint32_t after = 0;
+    return recompress(path, alg, budget, after);
 }
 
-void SQLiteFS::Impl::rawCall(const std::function<void(SQLite::Database*)>& callback) {
+std::size_t SQLiteFS::Impl::recompress(const std::string& path,
+                                       const std::string& alg,
+                                       std::int64_t       budget,
+                                       std::uint32_t&     after) {
     SQLITEFS_SCOPED_PROFILER;
-    std::lock_guard lock(m_mutex);
-    std::invoke(callback, &m_db);
+    constexpr std::int64_t PAGE = 256;
+
+    // files go in id order from after, only rewritten ones take the budget. A file that fails is passed,
+    // so it can't hold back the rest of the subtree
+    std::size_t  done  = 0;
+    std::int64_t spent = 0;
+    while (budget <= 0 || spent < budget) {
+        std::vector<std::pair<std::uint32_t, std::int64_t>> files;
+        {
+            Lock lock(*this, LockOp::RECOMPRESS);
+            if (!m_save_funcs.contains(alg)) {
+                fail(SQLiteFSError::NOT_FOUND, "Unknown codec " + alg);
+                return done;
+            }
+
+            auto id = resolve(path);
+            if (!id) {
+                return done;
+            }
+
+            for (auto query = select(m_ancestor_index ? RECOMPRESS_LIST_INDEXED : RECOMPRESS_LIST,
+                                     *id,
+                                     alg,
+                                     std::int64_t{after},
+                                     PAGE);
+                 query.executeStep();) {
+                files.emplace_back(query.getColumn(0).getUInt(), query.getColumn(1).getInt64());
+            }
+        }
+
+        // the end of the subtree, the next call starts over
+        if (files.empty()) {
+            after = 0;
+            break;
+        }
+
+        // the lock is free between the files
+        for (const auto& [id, size_raw] : files) {
+            after = id;
+            if (recompressFile(id, alg)) {
+                ++done;
+                spent += size_raw;
+                if (budget > 0 && spent >= budget) {
+                    break;
+                }
+            }
+        }
+    }
+    return done;
 }
 
-std::optional<SQLiteFSNode> SQLiteFS::Impl::node(const std::string& path) const {
+std::vector<SQLiteFSChange> SQLiteFS::Impl::changesSince(std::int64_t seq, std::size_t limit) const {
     SQLITEFS_SCOPED_PROFILER;
+    using namespace std::literals;
 
-    const auto& [path_id, name] = splitPathAndName(path);
-    if (!path_id) {
-        m_last_error = "Can't find path";
-        return std::nullopt;
+    std::vector<SQLiteFSChange> result;
+    Lock                        lock(*this, LockOp::CHANGES, true);
+
+    if (!m_journal) {
+        return result;
     }
-    return name.empty() ? node(*path_id) : node(*path_id, name);
+
+    try {
+        for (auto query = select(JOURNAL_GET, seq, static_cast<std::int64_t>(limit)); query.executeStep();) {
+            result.push_back({
+              .seq  = query.getColumn(0).getInt64(),
+              .op   = static_cast<SQLiteFSChange::Op>(query.getColumn(1).getInt()),
+              .id   = query.getColumn(2).getUInt(),
+              .path = query.getColumn(3).getText(),
+              .size = query.getColumn(4).getInt64(),
+            });
+        }
+    } catch (std::exception& e) { fail(SQLiteFSError::SQL, "SQL Error: "s + e.what()); }
+
+    return result;
 }
 
-std::optional<SQLiteFSNode> SQLiteFS::Impl::node(std::uint32_t id) const {
+std::size_t SQLiteFS::Impl::pruneChanges(std::int64_t seq) {
     SQLITEFS_SCOPED_PROFILER;
 
-    auto query = select(GET_NODE_BY_ID, id);
-    return node(query);
+    Lock lock(*this, LockOp::CHANGES);
+    return m_journal ? static_cast<std::size_t>(exec(JOURNAL_PRUNE, seq)) : 0;
 }
 
-
-std::optional<SQLiteFSNode> SQLiteFS::Impl::node(std::uint32_t path_id, const std::string& name) const {
+std::optional<SQLiteFSUsage> SQLiteFS::Impl::du(const std::string& path) const {
     SQLITEFS_SCOPED_PROFILER;
 
-    auto query = select(GET_NODE, path_id, name);
-    return node(query);
+    Lock lock(*this, LockOp::DU, true);
+
+    auto id = resolve(path);
+    if (!id) {
+        return std::nullopt;
+    }
+
+    auto current_node = node(*id);
+    if (!current_node) {
+        return std::nullopt;
+    }
+    return usage(*current_node);
 }
 
-std::optional<SQLiteFSNode> SQLiteFS::Impl::node(SQLite::Statement& query) const {
+void SQLiteFS::Impl::vacuum() {
     SQLITEFS_SCOPED_PROFILER;
+    Lock lock(*this, LockOp::VACUUM);
+    exec("VACUUM");
+    collectSidecars();
+}
 
-    if (query.executeStep()) {
-        SQLiteFSNode out;
-        out.id          = query.getColumn(0).getUInt();
-        out.parent_id   = query.getColumn(1).getUInt();
-        out.name        = query.getColumn(2).getString();
-        out.attributes  = static_cast<SQLiteFSNode::Attributes>(query.getColumn(3).getInt());
-        out.size        = query.getColumn(4).getInt64();
-        out.size_raw    = query.getColumn(5).getInt64();
-        out.compression = query.getColumn(6).getString();
+std::size_t SQLiteFS::Impl::reclaim(std::size_t max_pages) {
+    SQLITEFS_SCOPED_PROFILER;
+    using namespace std::literals;
 
-        return out;
+    if (max_pages == 0) {
+        return 0;
     }
 
-    m_last_error = "Can't find node";
-    return std::nullopt;
+    Lock lock(*this, LockOp::VACUUM);
+
+    auto before = spaceUnlocked().freelist_count;
+    try {
+        // the pragma frees a page per step, Database::exec runs it to the end
+        m_db.exec("PRAGMA incremental_vacuum(" + std::to_string(max_pages) + ")");
+    } catch (std::exception& e) { fail(SQLiteFSError::SQL, "SQL Error: "s + e.what()); }
+    auto after = spaceUnlocked().freelist_count;
+    return static_cast<std::size_t>(std::max<std::int64_t>(before - after, 0));
+}
+
+SQLiteFSSpace SQLiteFS::Impl::space() const {
+    SQLITEFS_SCOPED_PROFILER;
+    Lock lock(*this, LockOp::SPACE, true);
+    return spaceUnlocked();
+}
+
+bool SQLiteFS::Impl::backup(const std::string& dest_path, std::string_view key, int pages_per_step) {
+    SQLITEFS_SCOPED_PROFILER;
+    using namespace std::literals;
+
+    try {
+        SQLite::Database dest(dest_path, SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE);
+        if (!key.empty()) {
+            dest.key(SecureString{key});
+        }
+
+        Lock                            lock(*this, LockOp::BACKUP);
+        std::unique_ptr<SQLite::Backup> backup = std::make_unique<SQLite::Backup>(dest, "main", m_db, "main");
+
+        // changes made through m_db between steps are picked up by the backup automatically
+        for (;;) {
+            auto result = backup->executeStep(pages_per_step > 0 ? pages_per_step : -1);
+            if (result == SQLITE_DONE) {
+                break;
+            }
+
+            lock.unlock();
+            if (result == SQLITE_BUSY || result == SQLITE_LOCKED) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            } else {
+                std::this_thread::yield();
+            }
+            lock.lock();
+        }
+
+        // finishing the backup touches the source connection
+        backup.reset();
+
+        // sidecars are re-encrypted for another key
+        const auto dest_dir = std::filesystem::path(dest_path + ".blobs");
+        const auto dest_key = sidecarKey(key);
+        for (auto query = select(ALL_SIDECARS); query.executeStep();) {
+            const auto        id   = query.getColumn(0).getUInt();
+            const std::string name = query.getColumn(1).getText();
+            const SidecarFile file{.path = m_sidecar_dir / name, .nonce = readNonce(query.getColumn(2))};
+
+            auto nonce = copySidecar(file, m_sidecar_key, dest_dir / name, dest_key);
+            if (nonce != file.nonce) {
+                setSidecar(dest, MOVE_SIDECAR, id, name, nonce);
+            }
+        }
+        return true;
+    } catch (std::exception& e) {
+        Lock lock(*this, LockOp::BACKUP);
+        fail(SQLiteFSError::IO, "Backup Error: "s + e.what());
+    }
+    return false;
+}
+
+SQLiteFSCheck SQLiteFS::Impl::fsck(unsigned threads) const {
+    SQLITEFS_SCOPED_PROFILER;
+    using namespace std::literals;
+
+    SQLiteFSCheck result;
+    Lock          lock(*this, LockOp::FSCK);
+
+    try {
+        if (!m_checksums) {
+            auto query = select(FILES_COUNT);
+            query.executeStep();
+            result.unchecked = query.getColumn(0).getInt64();
+            return result;
+        }
+
+        std::vector<std::pair<std::uint32_t, std::uint32_t>> files; // id, expected crc
+        for (auto query = select(ALL_CHECKSUMS); query.executeStep();) {
+            if (query.getColumn(1).isNull()) {
+                ++result.unchecked;
+            } else {
+                files.emplace_back(query.getColumn(0).getUInt(), query.getColumn(1).getUInt());
+            }
+        }
+        result.files = std::ssize(files);
+
+        // the memory copy can't be opened by other connections
+        if (threads == 0) {
+            threads = std::max(std::thread::hardware_concurrency(), 1U);
+        }
+        threads = m_file ? 1 : static_cast<unsigned>(std::min<std::size_t>(threads, std::max<std::size_t>(files.size(), 1)));
+
+        std::atomic<std::size_t>                next = 0;
+        std::vector<std::vector<std::uint32_t>> corrupted(threads);
+        std::vector<std::string>                errors(threads);
+
+        // the fs lock keeps writers of this connection away, so the other connections see the same data
+        auto check = [&](std::size_t worker) {
+            try {
+                std::optional<SQLite::Database> own;
+                if (threads > 1) {
+                    // opened like the main connection, but never for writing
+                    const Options options{.read_only = true, .immutable = m_immutable};
+                    own.emplace(openTarget(m_db_path, options), openFlags(options), m_busy_timeout_ms);
+                    if (!m_key.empty()) {
+                        own->key(m_key);
+                    }
+                }
+
+                const auto& db = own ? *own : m_db;
+                for (auto i = next++; i < files.size(); i = next++) {
+                    if (storedChecksum(db, m_sidecar_dir, m_sidecar_key, files[i].first) != files[i].second) {
+                        corrupted[worker].push_back(files[i].first);
+                    }
+                }
+            } catch (std::exception& e) { errors[worker] = e.what(); }
+        };
+
+        if (threads == 1) {
+            check(0);
+        } else {
+            std::vector<std::jthread> workers;
+            for (std::size_t worker = 0; worker < threads; ++worker) {
+                workers.emplace_back(check, worker);
+            }
+        }
+
+        for (const auto& error : errors) {
+            if (!error.empty()) {
+                fail(SQLiteFSError::SQL, "Fsck Error: "s + error);
+                break;
+            }
+        }
+
+        for (const auto& ids : corrupted) {
+            for (auto id : ids) {
+                auto path = select(m_ancestor_index ? PWD_INDEXED : PWD, id);
+                result.corrupted.push_back(path.executeStep() ? path.getColumn(0).getString() : std::to_string(id));
+            }
+        }
+        std::ranges::sort(result.corrupted);
+    } catch (std::exception& e) { fail(SQLiteFSError::SQL, "Fsck Error: "s + e.what()); }
+
+    return result;
+}
+
+bool SQLiteFS::Impl::replicate(const std::string& replica_path, std::string_view key) {
+    SQLITEFS_SCOPED_PROFILER;
+    using namespace std::literals;
+
+    try {
+        if (syncReplica(replica_path, key)) {
+            return true;
+        }
+    } catch (std::exception& e) {
+        // e.g. names swapped between two syncs can't be applied row by row, the full copy fixes it
+        Lock lock(*this, LockOp::REPLICATE);
+        fail(SQLiteFSError::SQL, "Replica Error: "s + e.what());
+    }
+
+    return backup(replica_path, key, 256); // NOLINT
+}
+
+bool SQLiteFS::Impl::syncReplica(const std::string& replica_path, std::string_view key) {
+    SQLITEFS_SCOPED_PROFILER;
+
+    SQLite::Database replica(replica_path, SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE, m_busy_timeout_ms);
+    if (!key.empty()) {
+        replica.key(SecureString{key});
+    }
+    const auto replica_key = sidecarKey(key);
+    replica.exec("PRAGMA foreign_keys = ON");
+
+    Lock lock(*this, LockOp::REPLICATE);
+
+    // a new replica or one that was made without the journal, the checksums or the versions gets a full copy
+    if (!m_journal || !replica.tableExists("changes") || (m_checksums && !replica.tableExists("checksum")) ||
+        !replica.tableExists("version")) {
+        return false;
+    }
+
+    // the last seq ever issued survives pruning, copied entries move it on the replica too
+    auto replica_last = prepare(replica, JOURNAL_LAST);
+    replica_last.executeStep();
+    const auto replica_seq = replica_last.getColumn(0).getInt64();
+
+    auto last = select(JOURNAL_LAST);
+    last.executeStep();
+    const auto last_seq = last.getColumn(0).getInt64();
+
+    auto range = select(JOURNAL_RANGE);
+    range.executeStep();
+    const bool has_changes = !range.getColumn(0).isNull();
+    const auto first_seq   = range.getColumn(0).getInt64();
+
+    // entries the replica needs were pruned, maybe all of them
+    if (last_seq > replica_seq && (!has_changes || first_seq > replica_seq + 1)) {
+        return false;
+    }
+
+    std::vector<SQLiteFSChange> changes;
+    for (auto query = select(JOURNAL_GET, replica_seq, std::int64_t{-1}); query.executeStep();) {
+        changes.push_back({
+          .seq  = query.getColumn(0).getInt64(),
+          .op   = static_cast<SQLiteFSChange::Op>(query.getColumn(1).getInt()),
+          .id   = query.getColumn(2).getUInt(),
+          .path = query.getColumn(3).getText(),
+          .size = query.getColumn(4).getInt64(),
+        });
+    }
+    if (changes.empty()) {
+        return true;
+    }
+
+
+    const auto replica_dir = std::filesystem::path(replica_path + ".blobs");
+
+    std::set<std::uint32_t>            synced;
+    std::set<std::uint32_t>            folders; // usage to refresh
+    std::vector<std::filesystem::path> stale;   // sidecars of removed nodes
+
+    // copies the current primary row of the node and everything it needs. Rows are taken as they are now,
+    // so a node changed several times is copied once
+    auto sync = [&](std::uint32_t id) {
+        auto source = select(GET_NODE_BY_ID, id);
+        if (!synced.insert(id).second || !source.executeStep()) {
+            return;
+        }
+
+        auto target = prepare(replica, SYNC_NODE);
+        for (int i = 0; i < source.getColumnCount(); ++i) {
+            bindColumn(target, i + 1, source.getColumn(i));
+        }
+        target.exec();
+
+        // update() and recompress() can change the way the data is stored, what the replica had is dropped
+        std::optional<std::string> old_sidecar;
+        std::optional<std::string> new_sidecar;
+        if (auto old = prepare(replica, GET_SIDECAR, id); old.executeStep()) {
+            old_sidecar = old.getColumn(0).getText();
+        }
+
+        auto data = select(GET_FILE_DATA, id);
+        if (data.executeStep()) {
+            auto copy = prepare(replica, SYNC_DATA, id);
+            bindColumn(copy, 2, data.getColumn(0));
+            copy.exec();
+        } else if (auto file = sidecar(id); file) {
+            new_sidecar = file->path.filename().string();
+            auto nonce  = copySidecar(*file, m_sidecar_key, replica_dir / *new_sidecar, replica_key);
+            prepare(replica, DEL_FILE_DATA, id).exec();
+            setSidecar(replica, SYNC_SIDECAR, id, *new_sidecar, nonce);
+        } else if (source.getColumn(3).getInt() & SQLiteFSNode::Attributes::FILE) {
+            prepare(replica, DEL_FILE_DATA, id).exec();
+
+            // chunks never change and their ids aren't reused, only the missing ones are copied
+            std::set<std::int64_t> present;
+            for (auto query = prepare(replica, CHUNK_IDS, id); query.executeStep();) {
+                present.insert(query.getColumn(0).getInt64());
+            }
+            for (auto query = select(CHUNK_IDS, id); query.executeStep();) {
+                auto chunk = query.getColumn(0).getInt64();
+                if (present.contains(chunk)) {
+                    continue;
+                }
+
+                auto row  = select(GET_CHUNK, chunk);
+                auto copy = prepare(replica, SYNC_CHUNK);
+                row.executeStep();
+                for (int i = 0; i < row.getColumnCount(); ++i) {
+                    bindColumn(copy, i + 1, row.getColumn(i));
+                }
+                copy.exec();
+            }
+
+            prepare(replica, LIST_CLEAR, id).exec();
+            for (auto query = select(LIST_GET, id); query.executeStep();) {
+                prepare(replica, LIST_ADD, id, query.getColumn(0).getInt64(), query.getColumn(1).getInt64()).exec();
+            }
+
+            // kept versions are copied as rows, their chunks are already there
+            auto copy_rows = [&](const std::string& rows, const std::string& sync_rows) {
+                auto copy = prepare(replica, sync_rows);
+                for (auto query = select(rows, id); query.executeStep();) {
+                    copy.reset();
+                    for (int i = 0; i < query.getColumnCount(); ++i) {
+                        bindColumn(copy, i + 1, query.getColumn(i));
+                    }
+                    copy.exec();
+                }
+            };
+            prepare(replica, VERSION_CLEAR, id).exec();
+            copy_rows(VERSION_ROWS, SYNC_VERSION);
+            copy_rows(VLIST_ROWS, SYNC_VLIST);
+            prepare(replica, CHUNK_PRUNE, id).exec();
+        }
+
+        if (old_sidecar && old_sidecar != new_sidecar) {
+            stale.push_back(replica_dir / *old_sidecar);
+            if (!new_sidecar) {
+                prepare(replica, DEL_SIDECAR, id).exec();
+            }
+        }
+
+        if (m_checksums) {
+            if (auto crc = select(GET_CHECKSUM, id); crc.executeStep()) {
+                prepare(replica, SET_CHECKSUM, id, crc.getColumn(0).getUInt()).exec();
+            }
+        }
+    };
+
+    SQLite::Transaction transaction(replica);
+    replica.exec("PRAGMA defer_foreign_keys = ON");
+
+    // applied in journal order, so names are freed before they are taken again
+    for (const auto& change : changes) {
+        for (auto folder : ancestors(replica, change.id)) {
+            folders.insert(folder);
+        }
+
+        if (change.op == SQLiteFSChange::Op::RM) {
+            for (auto query = prepare(replica, SIDECAR_SUBTREE, change.id); query.executeStep();) {
+                stale.push_back(replica_dir / query.getColumn(0).getText());
+            }
+            prepare(replica, RM, change.id).exec();
+            continue;
+        }
+
+        // parents first, closure triggers of the replica expect them
+        auto up = ancestors(m_db, change.id);
+        for (auto it = up.rbegin(); it != up.rend(); ++it) {
+            folders.insert(*it);
+            if (!prepare(replica, GET_NODE_BY_ID, *it).executeStep()) {
+                sync(*it);
+            }
+        }
+        sync(change.id);
+    }
+
+    for (auto folder : folders) {
+        if (auto amount = select(GET_USAGE, folder); amount.executeStep()) {
+            prepare(replica,
+                    SYNC_USAGE,
+                    folder,
+                    amount.getColumn(0).getInt64(),
+                    amount.getColumn(1).getInt64(),
+                    amount.getColumn(2).getInt64())
+              .exec();
+        } else {
+            prepare(replica, SYNC_NO_USAGE, folder).exec();
+        }
+    }
+
+    for (const auto& change : changes) {
+        const auto op = static_cast<std::int32_t>(change.op);
+        prepare(replica, JOURNAL_COPY, change.seq, op, change.id, change.path, change.size).exec();
+    }
+    if (has_changes) {
+        prepare(replica, JOURNAL_PRUNE, first_seq - 1).exec();
+    }
+    transaction.commit();
+
+    std::error_code ec;
+    for (const auto& file : stale) {
+        std::filesystem::remove(file, ec);
+    }
+    return true;
+}
+
+SQLiteFS::DataOutput SQLiteFS::Impl::snapshot() const {
+    SQLITEFS_SCOPED_PROFILER;
+    using namespace std::literals;
+
+    DataOutput result;
+    Lock       lock(*this, LockOp::SNAPSHOT);
+
+    sqlite3_int64 size  = 0;
+    auto*         image = sqlite3_serialize(m_db.getHandle(), "main", &size, 0);
+    if (image == nullptr) {
+        fail(SQLiteFSError::INTERNAL, "Internal error: can't serialize the database");
+        return result;
+    }
+
+    if (!select(ALL_SIDECARS).executeStep()) {
+        result.assign(image, image + size);
+        sqlite3_free(image);
+        return result;
+    }
+
+    // the image must not depend on the sidecar folder, sidecar data is put back into a copy of it.
+    // A WAL image can't be used in memory, the file format bytes switch the copy to a rollback journal
+    image[18] = image[19] = 1; // NOLINT
+    try {
+        SQLite::Database copy(":memory:", SQLite::OPEN_READWRITE);
+        if (sqlite3_deserialize(copy.getHandle(),
+                                "main",
+                                image,
+                                size,
+                                size,
+                                SQLITE_DESERIALIZE_FREEONCLOSE | SQLITE_DESERIALIZE_RESIZEABLE) != SQLITE_OK) {
+            throw SQLite::Exception("Can't load the database image");
+        }
+
+        SQLite::Transaction transaction(copy);
+        for (auto query = select(ALL_SIDECARS); query.executeStep();) {
+            const auto        id = query.getColumn(0).getUInt();
+            const SidecarFile file{.path  = m_sidecar_dir / query.getColumn(1).getText(),
+                                   .nonce = readNonce(query.getColumn(2))};
+
+            MappedFile mapped;
+            DataOutput decrypted;
+            auto       stored = loadSidecar(file, m_sidecar_key, mapped, decrypted);
+            if (!stored) {
+                fail(SQLiteFSError::IO, "Can't read sidecar file " + file.path.string());
+                return result;
+            }
+
+            SQLite::Statement data{copy, SET_FILE_DATA};
+            data.bind(1, id);
+            data.bindNoCopy(2, stored->empty() ? "" : stored->data(), static_cast<int>(stored->size()));
+            data.exec();
+            prepare(copy, DEL_SIDECAR, id).exec();
+        }
+        transaction.commit();
+
+        image = sqlite3_serialize(copy.getHandle(), "main", &size, 0);
+        if (image == nullptr) {
+            fail(SQLiteFSError::INTERNAL, "Internal error: can't serialize the database");
+            return result;
+        }
+        result.assign(image, image + size);
+        sqlite3_free(image);
+    } catch (std::exception& e) { fail(SQLiteFSError::SQL, "SQL Error: "s + e.what()); }
+    return result;
+}
+
+bool SQLiteFS::Impl::flush() {
+    SQLITEFS_SCOPED_PROFILER;
+    using namespace std::literals;
+
+    Lock lock(*this, LockOp::FLUSH);
+
+    if (!m_file) {
+        return true;
+    }
+
+    if (m_read_only) {
+        fail(SQLiteFSError::READ_ONLY);
+        return false;
+    }
+
+    auto state = changesState();
+    if (state == m_flushed_state) {
+        return true;
+    }
+
+    try {
+        // a single step copies everything in one transaction, so the file is replaced atomically
+        SQLite::Backup backup(*m_file, "main", m_db, "main");
+        if (backup.executeStep(-1) != SQLITE_DONE) {
+            fail(SQLiteFSError::BUSY);
+            return false;
+        }
+        m_flushed_state = state;
+
+        std::error_code ec;
+        for (const auto& file : std::exchange(m_removed_sidecars, {})) {
+            std::filesystem::remove(file, ec);
+        }
+        return true;
+    } catch (std::exception& e) { fail(SQLiteFSError::IO, "Flush Error: "s + e.what()); }
+    return false;
+}
+
+std::string SQLiteFS::Impl::error() const {
+    std::string temp;
+    {
+        std::lock_guard lock(m_error_mutex);
+        temp.swap(m_last_error);
+        if (auto code = m_last_code.exchange(SQLiteFSError::NONE); temp.empty() && code != SQLiteFSError::NONE) {
+            temp = describe(code);
+        }
+    }
+    return temp;
+};
+
+SQLiteFSError SQLiteFS::Impl::errorCode() const noexcept {
+    return m_last_code;
+}
+
+SQLiteFSError SQLiteFS::Impl::fail(SQLiteFSError code) const noexcept {
+    if (t_worker) {
+        // the first failure tells why, the rest usually repeat it
+        if (!t_worker_error) {
+            t_worker_error.emplace(code, std::string{});
+        }
+        return code;
+    }
+
+    std::lock_guard lock(m_error_mutex);
+    m_last_code = code;
+    m_last_error.clear();
+    return code;
+}
+
+SQLiteFSError SQLiteFS::Impl::fail(SQLiteFSError code, std::string detail) const {
+    if (t_worker) {
+        if (!t_worker_error) {
+            t_worker_error.emplace(code, std::move(detail));
+        }
+        return code;
+    }
+
+    std::lock_guard lock(m_error_mutex);
+    m_last_code  = code;
+    m_last_error = std::move(detail);
+    return code;
+}
+
+const std::string& SQLiteFS::Impl::path() const noexcept {
+    return m_db_path;
+}
+
+void SQLiteFS::Impl::registerSaveFunc(const std::string& name, const ConvertFunc& func) {
+    SQLITEFS_SCOPED_PROFILER;
+    Lock lock(*this, LockOp::FUNCS); // the recompress worker can look funcs up at any time
+    assert(!m_save_funcs.contains(name));
+    m_save_funcs.try_emplace(name, func);
+    if (name == m_recompress_alg) {
+        startRecompress();
+    }
+}
+void SQLiteFS::Impl::registerLoadFunc(const std::string& name, const ConvertFunc& func) {
+    SQLITEFS_SCOPED_PROFILER;
+    Lock lock(*this, LockOp::FUNCS);
+    assert(!m_load_funcs.contains(name));
+    m_load_funcs.try_emplace(name, func);
+}
+
+void SQLiteFS::Impl::registerSaveFunc(const std::string& name, const PmrConvertFunc& func) {
+    SQLITEFS_SCOPED_PROFILER;
+    assert(!m_pmr_save_funcs.contains(name));
+    m_pmr_save_funcs.try_emplace(name, func);
+}
+void SQLiteFS::Impl::registerLoadFunc(const std::string& name, const PmrConvertFunc& func) {
+    SQLITEFS_SCOPED_PROFILER;
+    assert(!m_pmr_load_funcs.contains(name));
+    m_pmr_load_funcs.try_emplace(name, func);
+}
+
+SQLiteFS::DataOutput SQLiteFS::Impl::callSaveFunc(const std::string& name, DataInput data) {
+    SQLITEFS_SCOPED_PROFILER;
+    return internalCall(name, data, m_save_funcs);
+}
+SQLiteFS::DataOutput SQLiteFS::Impl::callLoadFunc(const std::string& name, DataInput data) {
+    SQLITEFS_SCOPED_PROFILER;
+    return internalCall(name, data, m_load_funcs);
+}
+
+std::vector<std::string> SQLiteFS::Impl::codecs() const {
+    Lock lock(*this, LockOp::FUNCS, true);
+
+    std::vector<std::string> result;
+    for (const auto& [name, func] : m_save_funcs) {
+        if (m_load_funcs.contains(name)) {
+            result.push_back(name);
+        }
+    }
+    std::ranges::sort(result);
+    return result;
+}
+
+std::vector<SQLiteFSQueryStats> SQLiteFS::Impl::queryStats() const {
+    std::lock_guard lock(m_trace_mutex);
+
+    std::vector<SQLiteFSQueryStats> result;
+    result.reserve(m_queries.size());
+    for (const auto& [sql, stats] : m_queries) {
+        result.push_back(stats);
+    }
+    std::ranges::sort(result, std::greater{}, &SQLiteFSQueryStats::time);
+    return result;
+}
+
+void SQLiteFS::Impl::resetQueryStats() {
+    std::lock_guard lock(m_trace_mutex);
+    m_queries.clear();
+}
+
+void SQLiteFS::Impl::setSlowQueryCallback(SlowQueryCallback callback) {
+    std::lock_guard lock(m_trace_mutex);
+    m_slow_query_callback = std::move(callback);
+}
+
+int SQLiteFS::Impl::traceProfile(unsigned type, void* context, void* statement, void* time) {
+    if (type != SQLITE_TRACE_PROFILE) {
+        return 0;
+    }
+
+    auto& self = *static_cast<Impl*>(context);
+    auto* stmt = static_cast<sqlite3_stmt*>(statement);
+    auto* db   = sqlite3_db_handle(stmt);
+
+    int hits   = 0;
+    int misses = 0;
+    int unused = 0;
+    sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_HIT, &hits, &unused, 1);
+    sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_MISS, &misses, &unused, 1);
+
+    const char*        sql = sqlite3_sql(stmt);
+    SQLiteFSQueryStats run{
+      .sql             = sql ? sql : "",
+      .calls           = 1,
+      .time            = std::chrono::nanoseconds(*static_cast<sqlite3_int64*>(time)),
+      .max_time        = std::chrono::nanoseconds(*static_cast<sqlite3_int64*>(time)),
+      .vm_steps        = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1),
+      .full_scan_steps = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1),
+      .sorts           = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1),
+      .auto_index_rows = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 1),
+      .cache_hits      = hits,
+      .cache_misses    = misses,
+    };
+
+    // the callback is copied and called without the trace lock, so it can run statements and read the stats
+    const bool        slow = self.m_slow_query.count() > 0 && run.time >= self.m_slow_query;
+    SlowQueryCallback callback;
+    {
+        std::lock_guard lock(self.m_trace_mutex);
+        if (self.m_query_stats) {
+            auto& total = self.m_queries.try_emplace(run.sql, SQLiteFSQueryStats{.sql = run.sql}).first->second;
+            total.calls           += 1;
+            total.time            += run.time;
+            total.max_time         = std::max(total.max_time, run.time);
+            total.vm_steps        += run.vm_steps;
+            total.full_scan_steps += run.full_scan_steps;
+            total.sorts           += run.sorts;
+            total.auto_index_rows += run.auto_index_rows;
+            total.cache_hits      += run.cache_hits;
+            total.cache_misses    += run.cache_misses;
+        }
+        if (slow) {
+            callback = self.m_slow_query_callback;
+        }
+    }
+
+    if (slow) {
+        SQLITEFS_PROFILER(TracyMessage(run.sql.data(), run.sql.size()));
+        if (callback) {
+            callback(run);
+        }
+    }
+    return 0;
+}
+
+std::vector<SQLiteFSLockStats> SQLiteFS::Impl::lockStats() const {
+    // in LockOp order
+    constexpr std::array<const char*, static_cast<std::size_t>(LockOp::COUNT)> names{
+      "mkdir", "cd", "rm", "pwd", "ls", "find", "write", "read", "update", "mv", "cp", "stat", "versions",
+      "recompress", "changes", "du", "vacuum", "space", "backup", "fsck", "replicate", "snapshot", "flush", "funcs",
+      "raw_call"};
+
+    std::vector<SQLiteFSLockStats> result;
+    for (std::size_t i = 0; i < names.size(); ++i) {
+        const auto& counters = m_lock_counters[i];
+        if (counters.acquisitions == 0) {
+            continue;
+        }
+        result.push_back({
+          .op           = names[i],
+          .acquisitions = counters.acquisitions,
+          .contended    = counters.contended,
+          .wait         = std::chrono::nanoseconds(counters.wait_ns),
+          .max_wait     = std::chrono::nanoseconds(counters.max_wait_ns),
+          .hold         = std::chrono::nanoseconds(counters.hold_ns),
+          .max_hold     = std::chrono::nanoseconds(counters.max_hold_ns),
+        });
+    }
+    std::ranges::sort(result, std::greater{}, &SQLiteFSLockStats::wait);
+    return result;
+}
+
+void SQLiteFS::Impl::resetLockStats() {
+    for (auto& counters : m_lock_counters) {
+        counters.acquisitions = 0;
+        counters.contended    = 0;
+        counters.wait_ns      = 0;
+        counters.max_wait_ns  = 0;
+        counters.hold_ns      = 0;
+        counters.max_hold_ns  = 0;
+    }
+}
+
+std::int64_t SQLiteFS::Impl::workerErrors() const noexcept {
+    return m_worker_errors;
+}
+
+void SQLiteFS::Impl::setWorkerErrorCallback(WorkerErrorCallback callback) {
+    std::lock_guard lock(m_error_mutex);
+    m_worker_error_callback = std::move(callback);
+}
+
+SQLiteFS::Impl::Guard::Guard(const Impl& fs, LockOp op, bool shared)
+  : m_fs(&fs)
+  , m_op(op)
+  , m_shared(shared && fs.m_shared_reads) {
+    lock();
+}
+
+SQLiteFS::Impl::Guard::~Guard() {
+    if (m_locked) {
+        unlock();
+    }
+}
+
+SQLiteFS::Impl::Guard::Guard(Guard&& other) noexcept
+  : m_fs(std::exchange(other.m_fs, nullptr))
+  , m_op(other.m_op)
+  , m_shared(other.m_shared)
+  , m_locked(std::exchange(other.m_locked, false))
+  , m_since(other.m_since) {}
+
+SQLiteFS::Impl::Guard& SQLiteFS::Impl::Guard::operator=(Guard&& other) noexcept {
+    if (this != &other) {
+        if (m_locked) {
+            unlock();
+        }
+        m_fs     = std::exchange(other.m_fs, nullptr);
+        m_op     = other.m_op;
+        m_shared = other.m_shared;
+        m_locked = std::exchange(other.m_locked, false);
+        m_since  = other.m_since;
+    }
+    return *this;
+}
+
+void SQLiteFS::Impl::Guard::lock() {
+    using Clock = std::chrono::steady_clock;
+
+    auto& mutex = m_fs->m_mutex;
+    if (!m_fs->m_lock_stats) {
+        m_shared ? mutex.lock_shared() : mutex.lock();
+        m_locked = true;
+        used();
+        return;
+    }
+
+    auto start     = Clock::now();
+    bool contended = !(m_shared ? mutex.try_lock_shared() : mutex.try_lock());
+    if (contended) {
+        m_shared ? mutex.lock_shared() : mutex.lock();
+    }
+    m_since  = Clock::now();
+    m_locked = true;
+    used();
+
+    auto& counters = m_fs->m_lock_counters[static_cast<std::size_t>(m_op)];
+    auto  wait     = std::chrono::duration_cast<std::chrono::nanoseconds>(m_since - start).count();
+    counters.acquisitions.fetch_add(1, std::memory_order_relaxed);
+    counters.contended.fetch_add(contended ? 1 : 0, std::memory_order_relaxed);
+    counters.wait_ns.fetch_add(wait, std::memory_order_relaxed);
+    storeMax(counters.max_wait_ns, wait);
+}
+
+void SQLiteFS::Impl::Guard::unlock() {
+    if (m_fs->m_lock_stats) {
+        auto& counters = m_fs->m_lock_counters[static_cast<std::size_t>(m_op)];
+        auto  hold =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_since).count();
+        counters.hold_ns.fetch_add(hold, std::memory_order_relaxed);
+        storeMax(counters.max_hold_ns, hold);
+    }
+
+    used();
+    m_locked = false;
+    m_shared ? m_fs->m_mutex.unlock_shared() : m_fs->m_mutex.unlock();
+}
+
+void SQLiteFS::Impl::Guard::used() const noexcept {
+    if (m_fs->m_recompress_started && m_op != LockOp::RECOMPRESS) {
+        const auto now = std::chrono::steady_clock::now().time_since_epoch();
+        m_fs->m_last_use.store(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count(),
+                               std::memory_order_relaxed);
+    }
+}
+
+void SQLiteFS::Impl::rawCall(const std::function<void(SQLite::Database*)>& callback) {
+    SQLITEFS_SCOPED_PROFILER;
+    Lock lock(*this, LockOp::RAW_CALL);
+    std::invoke(callback, &m_db);
+}
+
+std::optional<SQLiteFSNode> SQLiteFS::Impl::node(const std::string& path) const {
+    SQLITEFS_SCOPED_PROFILER;
+
+    const auto& [path_id, name] = splitPathAndName(path);
+    if (!path_id) {
+        fail(SQLiteFSError::NOT_FOUND);
+        return std::nullopt;
+    }
+    return name.empty() ? node(*path_id) : node(*path_id, name);
+}
+
+std::optional<SQLiteFSNode> SQLiteFS::Impl::node(std::uint32_t id) const {
+    SQLITEFS_SCOPED_PROFILER;
+
+    auto query = select(GET_NODE_BY_ID, id);
+    return node(query);
+}
+
+
+std::optional<SQLiteFSNode> SQLiteFS::Impl::node(std::uint32_t path_id, const std::string& name) const {
+    SQLITEFS_SCOPED_PROFILER;
+
+    auto query = select(GET_NODE, path_id, name);
+    return node(query);
+}
+
+std::optional<SQLiteFSNode> SQLiteFS::Impl::node(SQLite::Statement& query) const {
+    SQLITEFS_SCOPED_PROFILER;
+
+    if (query.executeStep()) {
+        SQLiteFSNode out;
+        readNode(query, out);
+        return out;
+    }
+
+    fail(SQLiteFSError::NOT_FOUND);
+    return std::nullopt;
+}
+
+std::optional<SQLiteFSNode> SQLiteFS::Impl::lookup(const std::string& path,
+                                                   SQLite::Statement& get_node,
+                                                   FolderCache&       folders) const {
+    SQLITEFS_SCOPED_PROFILER;
+
+    auto pos  = path.find_last_of('/');
+    auto name = pos == std::string::npos ? path : path.substr(pos + 1);
+    if (name.empty() || name == "." || name == "..") {
+        auto id = resolve(path);
+        return id ? node(*id) : std::nullopt;
+    }
+
+    auto folder = pos == std::string::npos ? std::string{} : path.substr(0, pos + 1);
+    auto it     = folders.find(folder);
+    if (it == folders.end()) {
+        it = folders.emplace(folder, resolve(folder)).first;
+    }
+    if (!it->second) {
+        fail(SQLiteFSError::NOT_FOUND);
+        return std::nullopt;
+    }
+
+    // the prepared statement is reused for the whole batch
+    get_node.reset();
+    get_node.bind(1, *it->second);
+    get_node.bind(2, name);
+    return node(get_node);
+}
+
+SQLiteFSUsage SQLiteFS::Impl::usage(const SQLiteFSNode& node) const {
+    SQLITEFS_SCOPED_PROFILER;
+
+    if (node.attributes & SQLiteFSNode::Attributes::FILE) {
+        return {.files = 1, .size = node.size, .size_raw = node.size_raw};
+    }
+
+    auto query = select(GET_USAGE, node.id);
+    if (!query.executeStep()) {
+        return {};
+    }
+    return {
+      .files    = query.getColumn(0).getInt64(),
+      .size     = query.getColumn(1).getInt64(),
+      .size_raw = query.getColumn(2).getInt64(),
+    };
+}
+
+bool SQLiteFS::Impl::addUsage(std::uint32_t folder_id, const SQLiteFSUsage& delta) {
+    SQLITEFS_SCOPED_PROFILER;
+
+    if (delta == SQLiteFSUsage{}) {
+        return true;
+    }
+    const auto& query = m_ancestor_index ? USAGE_ADD_INDEXED : USAGE_ADD;
+    return exec(query, folder_id, delta.files, delta.size, delta.size_raw) > 0;
+}
+
+bool SQLiteFS::Impl::journal(SQLiteFSChange::Op op, std::uint32_t id, std::int64_t size) {
+    SQLITEFS_SCOPED_PROFILER;
+
+    if (!m_journal) {
+        return true;
+    }
+
+    auto path = select(m_ancestor_index ? PWD_INDEXED : PWD, id);
+    if (!path.executeStep() ||
+        exec(JOURNAL_ADD, static_cast<std::int32_t>(op), id, path.getColumn(0).getString(), size) == 0) {
+        return false;
+    }
+
+    // seq is the rowid, so everything older than the last journal_keep entries is a single range
+    if (m_journal_keep > 0) {
+        exec(JOURNAL_PRUNE, m_db.getLastInsertRowid() - m_journal_keep);
+    }
+    return true;
+}
+
+bool SQLiteFS::Impl::verify(std::uint32_t id, DataInput stored) const {
+    SQLITEFS_SCOPED_PROFILER;
+
+    if (!m_checksums || m_verify == Options::Verify::NEVER ||
+        (m_verify == Options::Verify::SAMPLED && m_reads++ % m_verify_sample != 0)) {
+        return true;
+    }
+
+    // files without a checksum can't be checked, they aren't treated as broken
+    auto query = select(GET_CHECKSUM, id);
+    if (!query.executeStep() || query.getColumn(0).getUInt() == crc32c(stored)) {
+        return true;
+    }
+
+    fail(SQLiteFSError::CORRUPTED, "File data doesn't match its checksum, node " + std::to_string(id));
+    return false;
+}
+
+bool SQLiteFS::Impl::isInside(std::uint32_t ancestor, std::uint32_t id) const {
+    SQLITEFS_SCOPED_PROFILER;
+
+    auto query = select(m_ancestor_index ? IS_INSIDE_INDEXED : IS_INSIDE, ancestor, id);
+    return query.executeStep();
+}
+
+std::optional<SidecarFile> SQLiteFS::Impl::sidecar(std::uint32_t id) const {
+    SQLITEFS_SCOPED_PROFILER;
+    return sidecarFile(m_db, m_sidecar_dir, id);
+}
+
+bool SQLiteFS::Impl::chunks(std::uint32_t id, DataOutput& stored, std::vector<std::size_t>& sizes) const {
+    auto query = select(GET_CHUNKS, id);
+    return chunks(query, stored, sizes);
+}
+
+bool SQLiteFS::Impl::chunks(SQLite::Statement& query, DataOutput& stored, std::vector<std::size_t>& sizes) const {
+    SQLITEFS_SCOPED_PROFILER;
+
+    while (query.executeStep()) {
+        const auto& column = query.getColumn(0);
+        const auto* blob   = static_cast<const char*>(column.getBlob());
+        stored.insert(stored.end(), blob, blob + column.getBytes());
+        sizes.push_back(static_cast<std::size_t>(column.getBytes()));
+    }
+    return !sizes.empty();
+}
+
+SQLiteFS::Impl::StoredChunks SQLiteFS::Impl::storedChunks(std::uint32_t id, const std::string& alg) const {
+    SQLITEFS_SCOPED_PROFILER;
+
+    StoredChunks result;
+    for (auto query = select(CHUNK_INFO, id, alg); query.executeStep();) {
+        auto digest = query.getColumn(5);
+        if (digest.getBytes() != static_cast<int>(sizeof(ChunkDigest))) {
+            continue;
+        }
+
+        StoredChunk chunk{
+          .id       = query.getColumn(0).getInt64(),
+          .size_raw = query.getColumn(2).getInt64(),
+          .crc      = query.getColumn(3).getUInt(),
+          .size     = query.getColumn(4).getInt64(),
+        };
+        std::memcpy(chunk.digest.data(), digest.getBlob(), chunk.digest.size());
+        result.try_emplace(static_cast<std::uint64_t>(query.getColumn(1).getInt64()), chunk);
+    }
+    return result;
+}
+
+bool SQLiteFS::Impl::keepVersion(const SQLiteFSNode& file) {
+    SQLITEFS_SCOPED_PROFILER;
+
+    // a file stored by write() has no chunks yet, its blob or sidecar is kept as one chunk
+    if (!select(LIST_GET, file.id).executeStep()) {
+        std::string blob;
+        MappedFile  mapped;
+        DataOutput  decrypted;
+        DataInput   stored;
+        if (auto query = select(GET_FILE_DATA, file.id); query.executeStep()) {
+            blob   = query.getColumn(0).getString();
+            stored = blob;
+        } else if (auto sidecar_file = sidecar(file.id); sidecar_file) {
+            auto data = loadSidecar(*sidecar_file, m_sidecar_key, mapped, decrypted);
+            if (!data) {
+                fail(SQLiteFSError::IO, "Can't read sidecar file " + sidecar_file->path.string());
+                return false;
+            }
+            stored = *data;
+        } else {
+            return false;
+        }
+
+        // the chunk is hashed like update() does it, without a load func it gets no digest and is never reused
+        DataOutput               decoded;
+        std::optional<DataInput>   raw;
+        if (file.compression == "raw") {
+            raw = stored;
+        } else if (m_load_funcs.contains(file.compression)) {
+            decoded = internalCall(file.compression, stored, m_load_funcs);
+            raw     = decoded;
+        }
+        const auto digest = raw ? std::optional{sha256(*raw)} : std::nullopt;
+
+        SQLite::Statement add_chunk{m_db, ADD_CHUNK};
+        add_chunk.bind(1, file.id);
+        add_chunk.bind(2, static_cast<std::int64_t>(raw ? hash64(*raw) : 0));
+        add_chunk.bind(3, file.size_raw);
+        add_chunk.bind(4, crc32c(stored));
+        add_chunk.bindNoCopy(5, stored.empty() ? "" : stored.data(), static_cast<int>(stored.size()));
+        if (digest) {
+            add_chunk.bindNoCopy(6, digest->data(), static_cast<int>(digest->size()));
+        }
+        if (add_chunk.exec() == 0 || exec(LIST_ADD, file.id, 0, m_db.getLastInsertRowid()) == 0) {
+            return false;
+        }
+    }
+
+    auto next = select(VERSION_NEXT, file.id);
+    next.executeStep();
+    const auto version = next.getColumn(0).getInt64();
+    return exec(VERSION_ADD, version, file.id) > 0 && exec(VERSION_LIST, version, file.id) > 0;
+}
+
+bool SQLiteFS::Impl::recompressFile(std::uint32_t id, const std::string& alg) {
+    SQLITEFS_SCOPED_PROFILER;
+    using namespace std::literals;
+
+    Lock lock(*this, LockOp::RECOMPRESS);
+
+    // the file could be removed or updated since it was listed
+    std::optional<SQLiteFSNode> file;
+    if (auto query = select(GET_NODE_BY_ID, id); query.executeStep()) {
+        readNode(query, file.emplace());
+    }
+    if (!file || file->compression == alg || select(LIST_GET, id).executeStep()) {
+        return false;
+    }
+
+    std::string blob;
+    MappedFile  mapped;
+    DataOutput  decrypted;
+    DataInput   stored;
+    auto        old_sidecar = sidecar(id);
+    if (old_sidecar) {
+        auto data = loadSidecar(*old_sidecar, m_sidecar_key, mapped, decrypted);
+        if (!data) {
+            fail(SQLiteFSError::IO, "Can't read sidecar file " + old_sidecar->path.string());
+            return false;
+        }
+        stored = *data;
+    } else if (auto query = select(GET_FILE_DATA, id); query.executeStep()) {
+        blob   = query.getColumn(0).getString();
+        stored = blob;
+    } else {
+        return false;
+    }
+
+    // broken data must not get a new valid checksum, so it's checked whatever verify is
+    if (m_checksums) {
+        auto crc = select(GET_CHECKSUM, id);
+        if (crc.executeStep() && crc.getColumn(0).getUInt() != crc32c(stored)) {
+            fail(SQLiteFSError::CORRUPTED, "File data doesn't match its checksum, node " + std::to_string(id));
+            return false;
+        }
+    }
+
+    // funcs are copied, they can be registered while the lock is free
+    auto load = m_load_funcs.find(file->compression);
+    auto save = m_save_funcs.find(alg);
+    if (load == m_load_funcs.end() || save == m_save_funcs.end()) {
+        fail(SQLiteFSError::NOT_FOUND, "Unknown codec " + (load == m_load_funcs.end() ? file->compression : alg));
+        return false;
+    }
+    ConvertFunc decode = load->second;
+    ConvertFunc encode = save->second;
+
+    lock.unlock();
+    auto data    = decode(stored);
+    auto encoded = static_cast<std::size_t>(file->size_raw) == data.size() ? encode(data) : DataOutput{};
+    lock.lock();
+
+    if (static_cast<std::size_t>(file->size_raw) != data.size()) {
+        fail(SQLiteFSError::SIZE_MISMATCH,
+             "File size doesn't mach.\nFS meta - "s + std::to_string(file->size_raw) +
+               ", File - " + std::to_string(data.size()));
+        return false;
+    }
+
+    // a stored file changes only through update(), which turns it into chunks
+    if (select(LIST_GET, id).executeStep() || !select(GET_NODE_BY_ID, id).executeStep()) {
+        return false;
+    }
+
+    // a new sidecar gets a new name, the old one stays valid until the commit
+    const auto size        = std::ssize(encoded);
+    const bool to_sidecar  = m_sidecar_threshold > 0 && size > m_sidecar_threshold;
+    const auto new_sidecar = std::to_string(id) + "-" + alg;
+    bool       saved       = false;
+    bool       success     = false;
+
+    SQLite::Transaction transaction(m_db);
+    try {
+        success = exec(old_sidecar ? DEL_SIDECAR : DEL_FILE_DATA, id) > 0;
+        saved   = success && (to_sidecar ? saveSidecar(id, encoded, new_sidecar) : saveBlob(id, encoded));
+        success = saved && exec(SET_FILE_META, size, file->size_raw, alg, id) > 0 &&
+                  (!m_checksums || exec(SET_CHECKSUM, id, crc32c(encoded)) > 0) &&
+                  addUsage(file->parent_id, {.size = size - file->size}) &&
+                  journal(SQLiteFSChange::Op::UPDATE, id, file->size_raw);
+    } catch (std::exception& e) {
+        fail(SQLiteFSError::SQL, "SQL Error: "s + e.what());
+        success = false;
+    }
+
+    if (success) {
+        transaction.commit();
+        if (old_sidecar) {
+            removeSidecars({old_sidecar->path});
+        }
+    } else {
+        fail(SQLiteFSError::INTERNAL, "Internal error: Can't recompress data");
+        transaction.rollback();
+        if (to_sidecar && saved) {
+            removeSidecars({m_sidecar_dir / new_sidecar});
+        }
+    }
+    return success;
+}
+
+std::vector<std::filesystem::path> SQLiteFS::Impl::sidecars(std::uint32_t id) const {
+    SQLITEFS_SCOPED_PROFILER;
+
+    std::vector<std::filesystem::path> result;
+    for (auto query = select(m_ancestor_index ? SIDECAR_SUBTREE_INDEXED : SIDECAR_SUBTREE, id);
+         query.executeStep();) {
+        result.push_back(m_sidecar_dir / query.getColumn(0).getText());
+    }
+    return result;
+}
+
+void SQLiteFS::Impl::removeSidecars(std::vector<std::filesystem::path> files) {
+    SQLITEFS_SCOPED_PROFILER;
+
+    // the file on disk still references them until the next flush
+    if (m_file) {
+        m_removed_sidecars.insert(m_removed_sidecars.end(), files.begin(), files.end());
+        return;
+    }
+
+    std::error_code ec;
+    for (const auto& file : files) {
+        std::filesystem::remove(file, ec);
+    }
+}
+
+void SQLiteFS::Impl::collectSidecars() {
+    SQLITEFS_SCOPED_PROFILER;
+
+    // files left by interrupted writes and removals. In memory mode only the flushed state is safe to compare with
+    std::error_code ec;
+    if (m_read_only || (m_file && changesState() != m_flushed_state) ||
+        !std::filesystem::is_directory(m_sidecar_dir, ec)) {
+        return;
+    }
+
+    std::vector<std::filesystem::path> orphans;
+    for (const auto& entry : std::filesystem::directory_iterator(m_sidecar_dir, ec)) {
+        auto query = select(HAS_SIDECAR, entry.path().filename().string());
+        if (!query.executeStep()) {
+            orphans.push_back(entry.path());
+        }
+    }
+
+    for (const auto& file : orphans) {
+        std::filesystem::remove(file, ec);
+    }
+}
+
+void SQLiteFS::Impl::load() {
+    SQLITEFS_SCOPED_PROFILER;
+
+    sqlite3_int64 size  = 0;
+    auto*         image = sqlite3_serialize(m_file->getHandle(), "main", &size, 0);
+    if (image != nullptr && size > 0) {
+        unsigned flags = SQLITE_DESERIALIZE_FREEONCLOSE;
+        flags |= m_read_only ? SQLITE_DESERIALIZE_READONLY : SQLITE_DESERIALIZE_RESIZEABLE;
+        if (sqlite3_deserialize(m_db.getHandle(), "main", image, size, size, flags) != SQLITE_OK) {
+            throw SQLite::Exception("Can't load the database into memory");
+        }
+
+        // memdb stops growing at 1GiB by default
+        auto limit = std::numeric_limits<sqlite3_int64>::max();
+        sqlite3_file_control(m_db.getHandle(), "main", SQLITE_FCNTL_SIZE_LIMIT, &limit);
+    } else {
+        sqlite3_free(image);
+    }
+
+    m_flushed_state = changesState();
+}
+
+std::optional<std::pair<std::int64_t, std::int64_t>> SQLiteFS::Impl::changesState() const {
+    auto schema = select("PRAGMA schema_version");
+    if (!schema.executeStep()) {
+        return std::nullopt;
+    }
+    return std::pair{schema.getColumn(0).getInt64(), static_cast<std::int64_t>(m_db.getTotalChanges())};
+}
+
+SQLiteFSSpace SQLiteFS::Impl::spaceUnlocked() const {
+    SQLITEFS_SCOPED_PROFILER;
+
+    auto pragma = [this](const char* name) {
+        auto query = select(name);
+        return query.executeStep() ? query.getColumn(0).getInt64() : 0;
+    };
+
+    return {
+      .page_size      = pragma("PRAGMA page_size"),
+      .page_count     = pragma("PRAGMA page_count"),
+      .freelist_count = pragma("PRAGMA freelist_count"),
+    };
+}
+
+void SQLiteFS::Impl::every(std::chrono::milliseconds interval, std::function<void()> task) {
+    m_workers.emplace_back([this, interval, task = std::move(task)](std::stop_token stop) {
+        t_worker = true;
+
+        std::mutex       sleep_mutex;
+        std::unique_lock sleep_lock(sleep_mutex);
+        while (!stop.stop_requested()) {
+            m_workers_cv.wait_for(sleep_lock, stop, interval, [] { return false; });
+            if (stop.stop_requested()) {
+                break;
+            }
+
+            task();
+            if (auto failure = std::exchange(t_worker_error, std::nullopt); failure) {
+                m_worker_errors.fetch_add(1, std::memory_order_relaxed);
+                WorkerErrorCallback callback;
+                {
+                    std::lock_guard lock(m_error_mutex);
+                    callback = m_worker_error_callback;
+                }
+                if (callback) {
+                    callback(failure->first, failure->second.empty() ? describe(failure->first) : failure->second);
+                }
+            }
+        }
+    });
+}
+
+void SQLiteFS::Impl::startRecompress() {
+    if (m_recompress_started || m_recompress_interval.count() <= 0) {
+        return;
+    }
+    m_recompress_started = true;
+
+    every(m_recompress_interval, [this] {
+        // only an idle fs is recompressed, the worker must not compete with the callers
+        const auto now = std::chrono::steady_clock::now().time_since_epoch();
+        if (now - std::chrono::nanoseconds(m_last_use.load(std::memory_order_relaxed)) >= m_recompress_idle) {
+            recompress(m_recompress_path, m_recompress_alg, m_recompress_bytes, m_recompress_after);
+        }
+    });
 }
 
 std::optional<std::uint32_t> SQLiteFS::Impl::resolve(const std::string& path) const {
@@ -475,7 +2960,7 @@ std::optional<std::uint32_t> SQLiteFS::Impl::resolve(const std::string& path) co
             continue;
         }
 
-        m_last_error = "Can't find target path";
+        fail(SQLiteFSError::NOT_FOUND);
         return std::nullopt;
     }
     return id;
@@ -1,41 +1,219 @@
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <filesystem>
 #include <mutex>
 #include <optional>
+#include <shared_mutex>
+#include <thread>
 #include <sqlitefs/sqlitefs.h>
 #include <SQLiteCpp/SQLiteCpp.h>
+#include "chunker.h"
+#include "cipher.h"
+#include "mapped_file.h"
 #include "utils.h"
 
 
 constexpr std::uint32_t SQLITEFS_ROOT = 0;
 
+// a file in the sidecar folder, encrypted when it has a nonce
+struct SidecarFile {
+    std::filesystem::path      path;
+    std::optional<CipherNonce> nonce;
+};
+
 struct SQLiteFS::Impl {
-    Impl(std::string path, std::string_view key);
+    // resolved folder ids by path, misses included
+    using FolderCache = std::unordered_map<std::string, std::optional<std::uint32_t>>;
+
+    Impl(std::string path, std::string_view key, const Options& options);
+    ~Impl();
 
     bool                      mkdir(const std::string& full_path);
     bool                      cd(const std::string& path);
     bool                      rm(const std::string& path);
     std::string               pwd() const;
-    std::vector<SQLiteFSNode> ls(const std::string& path) const;
+    SQLiteFSListing           list(const std::string& path) const;
+    std::vector<SQLiteFSNode> ls(const std::string& path, const std::string& after_name, std::size_t limit) const;
+    std::size_t               find(const std::string&  path,
+                                   const FindFilter&   filter,
+                                   const FindCallback& callback) const;
     bool                      write(const std::string& full_path, DataInput data, const std::string& alg);
+    bool                      write(const std::string&         full_path,
+                                    DataInput                  data,
+                                    const std::string&         alg,
+                                    std::pmr::memory_resource* resource);
     DataOutput                read(const std::string& full_path) const;
+    SQLiteFSResult<DataOutput> tryRead(const std::string& full_path) const;
+    PmrDataOutput             read(const std::string& full_path, std::pmr::memory_resource* resource) const;
+    ReadView                  readView(const std::string& full_path) const;
+    bool                      update(const std::string& full_path, DataInput data, const std::string& alg);
     bool                      mv(const std::string& from, const std::string& to);
     bool                      cp(const std::string& from, const std::string& to);
     void                      vacuum();
     std::string               error() const;
+    SQLiteFSError             errorCode() const noexcept;
     const std::string&        path() const noexcept;
     void                      registerSaveFunc(const std::string& name, const ConvertFunc& func);
     void                      registerLoadFunc(const std::string& name, const ConvertFunc& func);
+    void                      registerSaveFunc(const std::string& name, const PmrConvertFunc& func);
+    void                      registerLoadFunc(const std::string& name, const PmrConvertFunc& func);
     DataOutput                callSaveFunc(const std::string& name, DataInput data);
     DataOutput                callLoadFunc(const std::string& name, DataInput data);
+    std::vector<std::string>  codecs() const;
     void                      rawCall(const std::function<void(SQLite::Database*)>& callback);
 
+    std::vector<SQLiteFSQueryStats> queryStats() const;
+    void                            resetQueryStats();
+    void                            setSlowQueryCallback(SlowQueryCallback callback);
+    std::vector<SQLiteFSLockStats>  lockStats() const;
+    void                            resetLockStats();
+    std::int64_t                    workerErrors() const noexcept;
+    void                            setWorkerErrorCallback(WorkerErrorCallback callback);
+
+    SQLiteFSResult<SQLiteFSNode>              stat(const std::string& path) const;
+    std::vector<SQLiteFSResult<SQLiteFSNode>> statMany(std::span<const std::string> paths) const;
+
+    std::vector<SQLiteFSVersion> versions(const std::string& full_path) const;
+    SQLiteFSResult<DataOutput>   readVersion(const std::string& full_path, std::uint32_t version) const;
+    std::size_t                  recompress(const std::string& path, const std::string& alg, std::int64_t budget);
+
+    std::vector<SQLiteFSChange> changesSince(std::int64_t seq, std::size_t limit) const;
+    std::size_t                 pruneChanges(std::int64_t seq);
+
+    std::optional<SQLiteFSUsage> du(const std::string& path) const;
+    std::size_t                  reclaim(std::size_t max_pages);
+    SQLiteFSSpace                space() const;
+    bool                         backup(const std::string& dest_path, std::string_view key, int pages_per_step);
+    DataOutput                   snapshot() const;
+    bool                         replicate(const std::string& replica_path, std::string_view key);
+    SQLiteFSCheck                fsck(unsigned threads) const;
+    bool                         flush();
+
+    // what the fs lock is taken for, see Options::lock_stats
+    enum class LockOp : std::uint8_t {
+        MKDIR,
+        CD,
+        RM,
+        PWD,
+        LS,
+        FIND,
+        WRITE,
+        READ,
+        UPDATE,
+        MV,
+        CP,
+        STAT,
+        VERSIONS,
+        RECOMPRESS,
+        CHANGES,
+        DU,
+        VACUUM,
+        SPACE,
+        BACKUP,
+        FSCK,
+        REPLICATE,
+        SNAPSHOT,
+        FLUSH,
+        FUNCS,
+        RAW_CALL,
+        COUNT
+    };
+
+    // m_mutex taken for op, shared or exclusive, and counted when lock_stats is on. Movable like std::unique_lock.
+    // A shared guard is exclusive unless the connection is serialized, see m_shared_reads
+    class Guard {
+    public:
+        Guard() = default;
+        Guard(const Impl& fs, LockOp op, bool shared = false);
+        ~Guard();
+        Guard(Guard&& other) noexcept;
+        Guard& operator=(Guard&& other) noexcept;
+
+        void lock();
+        void unlock();
+
+    private:
+        // marks the fs busy for the recompress worker
+        void used() const noexcept;
+
+        const Impl*                           m_fs     = nullptr;
+        LockOp                                m_op     = LockOp::COUNT;
+        bool                                  m_shared = false;
+        bool                                  m_locked = false;
+        std::chrono::steady_clock::time_point m_since;
+    };
+
 private:
+    // a chunk of an update()d file as it's stored
+    struct StoredChunk {
+        std::int64_t  id       = 0;
+        std::int64_t  size_raw = 0;
+        std::uint32_t crc      = 0;
+        std::int64_t  size     = 0;
+        ChunkDigest   digest{};
+    };
+    using StoredChunks = std::unordered_map<std::uint64_t, StoredChunk>; // by content hash
+
+    bool                                                 store(const std::string& full_path,
+                                                               DataInput          data_modified,
+                                                               std::size_t        size_raw,
+                                                               const std::string& alg);
     bool                                                 saveBlob(std::uint32_t id, DataInput data);
+    bool                                                 saveSidecar(std::uint32_t      id,
+                                                                     DataInput          data,
+                                                                     const std::string& name);
+    bool                                                 copyData(std::uint32_t from, std::uint32_t to);
+    bool                                                 chunks(std::uint32_t             id,
+                                                                DataOutput&               stored,
+                                                                std::vector<std::size_t>& sizes) const;
+    bool                                                 chunks(SQLite::Statement&        query,
+                                                                DataOutput&               stored,
+                                                                std::vector<std::size_t>& sizes) const;
+    StoredChunks                                         storedChunks(std::uint32_t id, const std::string& alg) const;
+    bool                                                 keepVersion(const SQLiteFSNode& file);
+    bool                                                 recompressFile(std::uint32_t id, const std::string& alg);
+    std::size_t                                          recompress(const std::string& path,
+                                                                    const std::string& alg,
+                                                                    std::int64_t       budget,
+                                                                    std::uint32_t&     after);
+    std::optional<SidecarFile>                           sidecar(std::uint32_t id) const;
+    std::vector<std::filesystem::path>                   sidecars(std::uint32_t id) const;
+    void                                                 removeSidecars(std::vector<std::filesystem::path> files);
+    void                                                 collectSidecars();
     std::optional<SQLiteFSNode>                          node(const std::string& path) const;
     std::optional<SQLiteFSNode>                          node(std::uint32_t id) const;
     std::optional<SQLiteFSNode>                          node(std::uint32_t path_id, const std::string& name) const;
     std::optional<SQLiteFSNode>                          node(SQLite::Statement& query) const;
+    SQLiteFSUsage                                        usage(const SQLiteFSNode& node) const;
+    std::optional<SQLiteFSNode>                          lookup(const std::string& path,
+                                                                SQLite::Statement& get_node,
+                                                                FolderCache&       folders) const;
+    bool                                                 addUsage(std::uint32_t folder_id, const SQLiteFSUsage& delta);
+    bool                                                 journal(SQLiteFSChange::Op op,
+                                                                 std::uint32_t      id,
+                                                                 std::int64_t       size);
+    bool                                                 isInside(std::uint32_t ancestor, std::uint32_t id) const;
+    bool                                                 verify(std::uint32_t id, DataInput stored) const;
     std::optional<std::uint32_t>                         resolve(const std::string& path) const;
     std::pair<std::optional<std::uint32_t>, std::string> splitPathAndName(const std::string& full_path) const;
+    SQLiteFSSpace                                        spaceUnlocked() const;
+    bool                                                 syncReplica(const std::string& replica_path,
+                                                                     std::string_view   key);
+    void                                                 load();
+    std::optional<std::pair<std::int64_t, std::int64_t>> changesState() const;
+
+    // misses only store the code, the message is built by error()
+    SQLiteFSError fail(SQLiteFSError code) const noexcept;
+    SQLiteFSError fail(SQLiteFSError code, std::string detail) const;
+
+    // runs task every interval on a background thread until the fs is destroyed. Failures of the task go to
+    // the worker error callback, not to error()
+    void every(std::chrono::milliseconds interval, std::function<void()> task);
+    void startRecompress();
+
+    // sqlite3_trace_v2 profile callback, see Options::query_stats
+    static int traceProfile(unsigned type, void* context, void* statement, void* time);
 
 private:
     template<typename... Args>
@@ -48,10 +226,90 @@ private:
     std::string      m_db_path;
     std::uint32_t    m_cwd = SQLITEFS_ROOT;
     SQLite::Database m_db;
+    bool             m_ancestor_index  = false;
+    bool             m_read_only       = false;
+    bool             m_immutable       = false; // for the extra connections of fsck
+    bool             m_journal         = false;
+    std::int64_t     m_journal_keep    = 0;
+    int              m_busy_timeout_ms = 0;
+    SecureString     m_key; // for the extra connections of fsck
+
+    bool                               m_checksums     = false;
+    Options::Verify                    m_verify        = Options::Verify::NEVER;
+    std::uint32_t                      m_verify_sample = 1;
+    mutable std::atomic<std::uint32_t> m_reads         = 0;
+    std::size_t                        m_chunk_size    = 0;
+    std::uint32_t                      m_keep_versions = 0;
+
+    // in memory mode m_db is a ":memory:" copy of this file
+    std::optional<SQLite::Database>                      m_file;
+    std::optional<std::pair<std::int64_t, std::int64_t>> m_flushed_state;
+
+    // big blobs stored next to the database. Removed files wait for the next flush in memory mode
+    std::filesystem::path              m_sidecar_dir;
+    std::int64_t                       m_sidecar_threshold = 0;
+    std::vector<std::filesystem::path> m_removed_sidecars;
+    std::optional<CipherKey>           m_sidecar_key; // derived from the database key, none for a plain database
+
+    // statement totals by sql. The trace callback runs inside SQLite calls, so it has its own lock
+    bool                                                m_query_stats = false;
+    std::chrono::nanoseconds                            m_slow_query{0};
+    SlowQueryCallback                                   m_slow_query_callback;
+    std::unordered_map<std::string, SQLiteFSQueryStats> m_queries;
+    mutable std::mutex                                  m_trace_mutex;
+
+    ConvertFuncsMap    m_save_funcs;
+    ConvertFuncsMap    m_load_funcs;
+    PmrConvertFuncsMap m_pmr_save_funcs;
+    PmrConvertFuncsMap m_pmr_load_funcs;
+
+    // readers fail concurrently, so the message has its own lock. Workers report through the callback
+    mutable std::atomic<SQLiteFSError> m_last_code = SQLiteFSError::NONE;
+    mutable std::string                m_last_error;
+    mutable std::mutex                 m_error_mutex;
+    std::atomic<std::int64_t>          m_worker_errors = 0;
+    WorkerErrorCallback                m_worker_error_callback;
+
+    // background recompress, started once its codec is there. Skips ticks while other operations use the fs
+    std::string                       m_recompress_alg;
+    std::string                       m_recompress_path;
+    std::chrono::milliseconds         m_recompress_interval{0};
+    std::int64_t                      m_recompress_bytes = 0;
+    std::chrono::milliseconds         m_recompress_idle{0};
+    bool                              m_recompress_started = false;
+    std::uint32_t                     m_recompress_after   = 0; // the worker goes on from here every tick
+    mutable std::atomic<std::int64_t> m_last_use           = 0; // steady clock ns, 0 - never
+
+    // operations that only read share m_mutex when SQLite serializes calls on the connection itself.
+    // Without a connection mutex every operation is exclusive
+    struct LockCounters {
+        std::atomic<std::int64_t> acquisitions = 0;
+        std::atomic<std::int64_t> contended    = 0;
+        std::atomic<std::int64_t> wait_ns      = 0;
+        std::atomic<std::int64_t> max_wait_ns  = 0;
+        std::atomic<std::int64_t> hold_ns      = 0;
+        std::atomic<std::int64_t> max_hold_ns  = 0;
+    };
+    bool                                                                     m_shared_reads = false;
+    bool                                                                     m_lock_stats   = false;
+    mutable std::array<LockCounters, static_cast<std::size_t>(LockOp::COUNT)> m_lock_counters;
+    mutable SQLITEFS_SHARED_LOCABLE_PROFILER(std::shared_mutex, m_mutex);
+
+public:
+    using Lock = Guard;
+
+private:
+    // must be the last members: workers are stopped before anything they use is destroyed
+    std::condition_variable_any m_workers_cv;
+    std::vector<std::jthread>   m_workers;
+};
 
-    ConvertFuncsMap m_save_funcs;
-    ConvertFuncsMap m_load_funcs;
+struct SQLiteFS::ReadView::State {
+    DataInput view;
 
-    mutable std::string m_last_error;
-    mutable SQLITEFS_LOCABLE_PROFILER(std::mutex, m_mutex);
+    // only what the view points into is set
+    Impl::Lock                       lock;
+    std::optional<SQLite::Statement> statement;
+    MappedFile                       mapped;
+    DataOutput                       buffer;
 };
@@ -29,38 +29,411 @@ const inline std::vector<std::string> INIT_DB{
         )
     )query",
 
+  R"query(
+        CREATE TABLE IF NOT EXISTS "chunk" (
+            "id"    INTEGER,
+            "file"  INTEGER NOT NULL,
+            "hash"  INTEGER NOT NULL,
+            "size"  INTEGER NOT NULL,
+            "crc"   INTEGER NOT NULL,
+            "data"  BLOB NOT NULL,
+            "digest" BLOB,
+            PRIMARY KEY("id" AUTOINCREMENT),
+            CONSTRAINT "chunk_file" FOREIGN KEY("file") REFERENCES "fs"("id") ON UPDATE CASCADE ON DELETE CASCADE
+        )
+    )query",
+
+  R"query(CREATE INDEX IF NOT EXISTS "chunk_by_file" ON "chunk" ("file"))query",
+
+  R"query(
+        CREATE TABLE IF NOT EXISTS "chunk_list" (
+            "file"  INTEGER NOT NULL,
+            "seq"   INTEGER NOT NULL,
+            "chunk" INTEGER NOT NULL,
+            PRIMARY KEY("file","seq"),
+            CONSTRAINT "list_file" FOREIGN KEY("file") REFERENCES "fs"("id") ON UPDATE CASCADE ON DELETE CASCADE
+        ) WITHOUT ROWID
+    )query",
+
+  R"query(
+        CREATE TABLE IF NOT EXISTS "version" (
+            "file"        INTEGER NOT NULL,
+            "version"     INTEGER NOT NULL,
+            "size"        INTEGER NOT NULL,
+            "size_raw"    INTEGER NOT NULL,
+            "compression" TEXT NOT NULL,
+            "time"        INTEGER NOT NULL DEFAULT (strftime('%s', 'now')),
+            PRIMARY KEY("file","version"),
+            CONSTRAINT "version_file" FOREIGN KEY("file") REFERENCES "fs"("id") ON UPDATE CASCADE ON DELETE CASCADE
+        ) WITHOUT ROWID
+    )query",
+
+  R"query(
+        CREATE TABLE IF NOT EXISTS "version_list" (
+            "file"    INTEGER NOT NULL,
+            "version" INTEGER NOT NULL,
+            "seq"     INTEGER NOT NULL,
+            "chunk"   INTEGER NOT NULL,
+            PRIMARY KEY("file","version","seq"),
+            CONSTRAINT "list_version" FOREIGN KEY("file","version") REFERENCES "version"("file","version")
+                ON UPDATE CASCADE ON DELETE CASCADE
+        ) WITHOUT ROWID
+    )query",
+
+  R"query(
+        CREATE TABLE IF NOT EXISTS "usage" (
+            "id"          INTEGER,
+            "files"       INTEGER NOT NULL DEFAULT 0,
+            "size"        INTEGER NOT NULL DEFAULT 0,
+            "size_raw"    INTEGER NOT NULL DEFAULT 0,
+            PRIMARY KEY("id"),
+            CONSTRAINT "usage_fk" FOREIGN KEY("id") REFERENCES "fs"("id") ON UPDATE CASCADE ON DELETE CASCADE
+        )
+    )query",
+
+  R"query(
+        CREATE TABLE IF NOT EXISTS "sidecar" (
+            "id"    INTEGER,
+            "file"  TEXT NOT NULL UNIQUE,
+            "nonce" BLOB,
+            PRIMARY KEY("id"),
+            CONSTRAINT "sidecar_fk" FOREIGN KEY("id") REFERENCES "fs"("id") ON UPDATE CASCADE ON DELETE CASCADE
+        )
+    )query",
+
   R"query(INSERT OR IGNORE INTO fs ("id", "name") VALUES ('0','/'))query",
 };
 
+// optional ancestor/descendant closure of the fs tree. Triggers keep it in sync with every insert and move,
+// deletes are cascaded by the foreign keys
+const inline std::vector<std::string> INIT_TREE{
+  R"query(
+        CREATE TABLE IF NOT EXISTS "tree" (
+            "ancestor"    INTEGER NOT NULL,
+            "descendant"  INTEGER NOT NULL,
+            "depth"       INTEGER NOT NULL,
+            PRIMARY KEY("ancestor","descendant"),
+            CONSTRAINT "ancestor_fk" FOREIGN KEY("ancestor") REFERENCES "fs"("id") ON UPDATE CASCADE ON DELETE CASCADE,
+            CONSTRAINT "descendant_fk" FOREIGN KEY("descendant") REFERENCES "fs"("id") ON UPDATE CASCADE ON DELETE CASCADE
+        ) WITHOUT ROWID
+    )query",
+
+  R"query(CREATE INDEX IF NOT EXISTS "tree_descendant" ON "tree" ("descendant", "depth"))query",
+
+  R"query(
+        CREATE TRIGGER IF NOT EXISTS "tree_insert" AFTER INSERT ON fs BEGIN
+            INSERT INTO tree (ancestor, descendant, depth)
+                SELECT ancestor, NEW.id, depth + 1 FROM tree WHERE descendant IS NEW.parent
+                UNION ALL
+                SELECT NEW.id, NEW.id, 0;
+        END
+    )query",
+
+  R"query(
+        CREATE TRIGGER IF NOT EXISTS "tree_move" AFTER UPDATE OF parent ON fs WHEN OLD.parent IS NOT NEW.parent BEGIN
+            DELETE FROM tree
+                WHERE descendant IN (SELECT descendant FROM tree WHERE ancestor IS NEW.id)
+                  AND ancestor NOT IN (SELECT descendant FROM tree WHERE ancestor IS NEW.id);
+            INSERT INTO tree (ancestor, descendant, depth)
+                SELECT up.ancestor, down.descendant, up.depth + down.depth + 1 FROM tree up, tree down
+                WHERE up.descendant IS NEW.parent AND down.ancestor IS NEW.id;
+        END
+    )query",
+};
+
+// optional change log, appended in the same transaction as the change itself
+const inline std::string INIT_JOURNAL = R"query(
+        CREATE TABLE IF NOT EXISTS "changes" (
+            "seq"   INTEGER,
+            "op"    INTEGER NOT NULL,
+            "id"    INTEGER NOT NULL,
+            "path"  TEXT NOT NULL,
+            "size"  INTEGER NOT NULL DEFAULT 0,
+            PRIMARY KEY("seq" AUTOINCREMENT)
+        )
+    )query";
+
+// optional CRC32C of the stored data, see Options::checksums
+const inline std::string INIT_CHECKSUMS = R"query(
+        CREATE TABLE IF NOT EXISTS "checksum" (
+            "id"    INTEGER,
+            "crc"   INTEGER NOT NULL,
+            PRIMARY KEY("id"),
+            CONSTRAINT "checksum_id" FOREIGN KEY("id") REFERENCES "fs"("id") ON UPDATE CASCADE ON DELETE CASCADE
+        )
+    )query";
+
+// chunks of an update()d file in order
+const inline std::string GET_CHUNKS = R"query(
+        SELECT chunk.data FROM chunk_list JOIN chunk ON chunk.id IS chunk_list.chunk
+        WHERE chunk_list.file IS ? ORDER BY chunk_list.seq
+    )query";
+
+// chunks of a kept version in order
+const inline std::string GET_VERSION_CHUNKS = R"query(
+        SELECT chunk.data FROM version_list JOIN chunk ON chunk.id IS version_list.chunk
+        WHERE version_list.file IS ? AND version_list.version IS ? ORDER BY version_list.seq
+    )query";
+
+// ?1 - file, ?2 - codec. Chunks of the current data and the kept versions encoded with the codec
+const inline std::string CHUNK_INFO = R"query(
+        SELECT id, hash, size, crc, length(data), digest FROM chunk WHERE file IS ?1 AND id IN (
+            SELECT chunk FROM chunk_list JOIN fs ON fs.id IS chunk_list.file WHERE file IS ?1 AND compression IS ?2
+            UNION
+            SELECT chunk FROM version_list JOIN version USING (file, version) WHERE file IS ?1 AND compression IS ?2
+        )
+    )query";
+
+// chunks used neither by the file nor by its versions
+const inline std::string CHUNK_PRUNE = R"query(
+        DELETE FROM chunk WHERE file IS ?1 AND id NOT IN (
+            SELECT chunk FROM chunk_list WHERE file IS ?1 UNION SELECT chunk FROM version_list WHERE file IS ?1
+        )
+    )query";
+
+// ?1 - file, ?2 - versions to keep. Versions are numbered without gaps, so the newest ones stay
+const inline std::string VERSION_PRUNE = R"query(
+        DELETE FROM version WHERE file IS ?1 AND version <= (SELECT max(version) FROM version WHERE file IS ?1) - ?2
+    )query";
+
+// ?1 - node id. Folders above the node, the closest first
+const inline std::string ANCESTORS = R"query(
+        WITH RECURSIVE
+        up(id, depth) AS (
+            SELECT parent, 1 FROM fs WHERE id IS ?1 AND parent NOT NULL
+            UNION ALL
+            SELECT fs.parent, up.depth + 1 FROM fs JOIN up ON fs.id IS up.id WHERE fs.parent NOT NULL
+        )
+        SELECT id FROM up ORDER BY depth
+    )query";
+
+// replicas get primary rows as is, existing ones are updated in place to keep their data and closure rows
+const inline std::string SYNC_NODE = R"query(
+        INSERT INTO fs (id, parent, name, attrib, size, size_raw, compression) VALUES (?, ?, ?, ?, ?, ?, ?)
+        ON CONFLICT(id) DO UPDATE SET
+            parent      = excluded.parent,
+            name        = excluded.name,
+            attrib      = excluded.attrib,
+            size        = excluded.size,
+            size_raw    = excluded.size_raw,
+            compression = excluded.compression
+    )query";
+
+// fills the closure from scratch when the index is enabled for an existing database
+const inline std::string TREE_REBUILD = R"query(
+        INSERT OR IGNORE INTO tree (ancestor, descendant, depth)
+            WITH RECURSIVE
+            up(ancestor, descendant, depth) AS (
+                SELECT id, id, 0 FROM fs
+                UNION ALL
+                SELECT fs.parent, up.descendant, up.depth + 1 FROM up JOIN fs ON fs.id IS up.ancestor
+                WHERE fs.parent NOT NULL
+            )
+            SELECT * FROM up
+    )query";
+
+// fills folder totals from scratch, used once for databases created before the usage table
+const inline std::string USAGE_REBUILD = R"query(
+        INSERT INTO usage (id, files, size, size_raw)
+            WITH RECURSIVE
+            up(dir, file) AS (
+                SELECT parent, id FROM fs WHERE attrib & 1
+                UNION ALL
+                SELECT fs.parent, up.file FROM up JOIN fs ON fs.id IS up.dir WHERE fs.parent NOT NULL
+            )
+            SELECT up.dir, count(*), sum(fs.size), sum(fs.size_raw) FROM up JOIN fs ON fs.id IS up.file GROUP BY up.dir
+    )query";
+
+// ?1 - folder id, ?2 - files, ?3 - size, ?4 - size_raw. Adds deltas to the folder and all its parents
+const inline std::string USAGE_ADD = R"query(
+        WITH RECURSIVE
+        up(id) AS (
+            SELECT ?1
+            UNION
+            SELECT fs.parent FROM fs JOIN up ON fs.id IS up.id WHERE fs.parent NOT NULL
+        )
+        INSERT INTO usage (id, files, size, size_raw) SELECT id, ?2, ?3, ?4 FROM up WHERE true
+        ON CONFLICT(id) DO UPDATE SET
+            files    = files + excluded.files,
+            size     = size + excluded.size,
+            size_raw = size_raw + excluded.size_raw
+    )query";
+
 const inline std::string PWD = R"query(
         SELECT concat('/', group_concat(n, '/')) FROM (
             WITH RECURSIVE
-            pwd(i, p, n) AS (
-                SELECT id, parent, name FROM fs WHERE id IS ? and parent not NULL
+            pwd(p, n, depth) AS (
+                SELECT parent, name, 0 FROM fs WHERE id IS ? and parent not NULL
                 UNION ALL
-                SELECT id, parent, name FROM fs, pwd WHERE fs.id IS pwd.p and parent not NULL
+                SELECT parent, name, depth + 1 FROM fs, pwd WHERE fs.id IS pwd.p and parent not NULL
             )
-            SELECT * FROM pwd ORDER BY i ASC
+            SELECT n FROM pwd ORDER BY depth DESC
+        )
+    )query";
+
+const inline std::string PWD_INDEXED = R"query(
+        SELECT concat('/', group_concat(name, '/')) FROM (
+            SELECT fs.name FROM tree JOIN fs ON fs.id IS tree.ancestor
+            WHERE tree.descendant IS ? AND fs.parent NOT NULL
+            ORDER BY tree.depth DESC
         )
     )query";
 
+// ?1 - ancestor, ?2 - node. Returns a row if the node is the ancestor or lies inside it
+const inline std::string IS_INSIDE = R"query(
+        WITH RECURSIVE
+        up(id) AS (
+            SELECT ?2
+            UNION
+            SELECT parent FROM fs JOIN up ON fs.id IS up.id WHERE parent NOT NULL
+        )
+        SELECT 1 FROM up WHERE id IS ?1
+    )query";
+
+const inline std::string IS_INSIDE_INDEXED = R"query(SELECT 1 FROM tree WHERE ancestor IS ?1 AND descendant IS ?2)query";
+
+// ?1 - root id, ?2 - name glob, ?3 - attributes, ?4/?5 - size_raw range, ?6 - compression, ?7 - max depth
+const inline std::string FIND = R"query(
+        WITH RECURSIVE
+        tree(id, depth) AS (
+            SELECT id, 1 FROM fs WHERE parent IS ?1
+            UNION ALL
+            SELECT fs.id, tree.depth + 1 FROM fs JOIN tree ON fs.parent IS tree.id WHERE ?7 IS NULL OR tree.depth < ?7
+        )
+        SELECT fs.* FROM tree JOIN fs ON fs.id IS tree.id
+        WHERE (?2 IS NULL OR fs.name GLOB ?2)
+          AND (?3 IS NULL OR fs.attrib IS ?3)
+          AND (?4 IS NULL OR fs.size_raw >= ?4)
+          AND (?5 IS NULL OR fs.size_raw <= ?5)
+          AND (?6 IS NULL OR fs.compression IS ?6)
+    )query";
+
+// the same filters as FIND, but the subtree is a single range scan of the closure table
+const inline std::string FIND_INDEXED = R"query(
+        SELECT fs.* FROM tree JOIN fs ON fs.id IS tree.descendant
+        WHERE tree.ancestor IS ?1 AND tree.depth > 0
+          AND (?7 IS NULL OR tree.depth <= ?7)
+          AND (?2 IS NULL OR fs.name GLOB ?2)
+          AND (?3 IS NULL OR fs.attrib IS ?3)
+          AND (?4 IS NULL OR fs.size_raw >= ?4)
+          AND (?5 IS NULL OR fs.size_raw <= ?5)
+          AND (?6 IS NULL OR fs.compression IS ?6)
+    )query";
+
+const inline std::string USAGE_ADD_INDEXED = R"query(
+        INSERT INTO usage (id, files, size, size_raw) SELECT ancestor, ?2, ?3, ?4 FROM tree WHERE descendant IS ?1
+        ON CONFLICT(id) DO UPDATE SET
+            files    = files + excluded.files,
+            size     = size + excluded.size,
+            size_raw = size_raw + excluded.size_raw
+    )query";
+
+// ?1 - node id. Sidecar files of the node and everything inside it
+const inline std::string SIDECAR_SUBTREE = R"query(
+        WITH RECURSIVE
+        down(id) AS (
+            SELECT ?1
+            UNION ALL
+            SELECT fs.id FROM fs JOIN down ON fs.parent IS down.id
+        )
+        SELECT sidecar.file FROM down JOIN sidecar ON sidecar.id IS down.id
+    )query";
+
+const inline std::string SIDECAR_SUBTREE_INDEXED = R"query(
+        SELECT sidecar.file FROM tree JOIN sidecar ON sidecar.id IS tree.descendant WHERE tree.ancestor IS ?1
+    )query";
+
+// ?1 - node id, ?2 - codec. Files of the subtree stored as one blob or sidecar with another codec
+const inline std::string RECOMPRESS_LIST = R"query(
+        WITH RECURSIVE
+        down(id) AS (
+            SELECT ?1
+            UNION ALL
+            SELECT fs.id FROM fs JOIN down ON fs.parent IS down.id
+        )
+        SELECT fs.id, fs.size_raw FROM down JOIN fs ON fs.id IS down.id
+        WHERE fs.attrib & 1 AND fs.compression IS NOT ?2 AND NOT EXISTS (SELECT 1 FROM chunk_list WHERE file IS fs.id)
+          AND fs.id > ?3
+        ORDER BY fs.id LIMIT ?4
+    )query";
+
+const inline std::string RECOMPRESS_LIST_INDEXED = R"query(
+        SELECT fs.id, fs.size_raw FROM tree JOIN fs ON fs.id IS tree.descendant
+        WHERE tree.ancestor IS ?1 AND fs.attrib & 1 AND fs.compression IS NOT ?2
+          AND NOT EXISTS (SELECT 1 FROM chunk_list WHERE file IS fs.id) AND fs.id > ?3
+        ORDER BY fs.id LIMIT ?4
+    )query";
+
 // clang-format off
 
-const inline std::string LS             = R"query(SELECT * FROM fs WHERE parent IS ?)query";
-const inline std::string LS_COUNT       = R"query(SELECT COUNT(*) FROM fs WHERE parent IS ?)query";
+const inline std::string LS             = R"query(SELECT * FROM fs WHERE parent IS ? ORDER BY name)query";
+const inline std::string LS_PAGE_FIRST  = R"query(SELECT * FROM fs WHERE parent IS ? ORDER BY name LIMIT ?)query";
+const inline std::string LS_PAGE        = R"query(SELECT * FROM fs WHERE parent IS ? AND name > ? ORDER BY name LIMIT ?)query";
+const inline std::string GET_USAGE      = R"query(SELECT files, size, size_raw FROM usage WHERE id IS ?)query";
 const inline std::string GET_NODE_BY_ID = R"query(SELECT * FROM fs WHERE id IS ?)query";
 const inline std::string GET_NODE       = R"query(SELECT * FROM fs WHERE parent IS ? AND name IS ?)query";
 const inline std::string RM             = R"query(DELETE FROM fs WHERE id IS ?)query";
+const inline std::string RM_INDEXED     = R"query(DELETE FROM fs WHERE id IN (SELECT descendant FROM tree WHERE ancestor IS ?))query";
 const inline std::string MKDIR          = R"query(INSERT INTO fs (parent, name) VALUES (?, ?))query";
 
 const inline std::string SET_PARENT_ID  = R"query(UPDATE fs SET parent = ? WHERE id IS ?)query";
 const inline std::string SET_NAME       = R"query(UPDATE fs SET name = ? WHERE id IS ?)query";
 
 const inline std::string COPY_FILE_FS   = R"query(INSERT INTO fs (parent, name, attrib, size, size_raw, compression) SELECT ?, ?, attrib, size, size_raw, compression FROM fs WHERE id is ?;)query";
-const inline std::string COPY_FILE_RAW  = R"query(INSERT INTO data (id, data) SELECT last_insert_rowid(), data FROM data WHERE id is ?;)query";
+const inline std::string COPY_FILE_RAW  = R"query(INSERT INTO data (id, data) SELECT ?, data FROM data WHERE id IS ?)query";
 
 const inline std::string TOUCH          = R"query(INSERT INTO fs (parent, name, size, size_raw, compression, attrib) VALUES (?, ?, ?, ?, ?, 1))query";
+const inline std::string SET_FILE_META  = R"query(UPDATE fs SET size = ?, size_raw = ?, compression = ? WHERE id IS ?)query";
 const inline std::string SET_FILE_DATA  = R"query(INSERT INTO data (id, data) VALUES (?, ?))query";
 const inline std::string GET_FILE_DATA  = R"query(SELECT data FROM data WHERE id IS ?)query";
+const inline std::string DEL_FILE_DATA  = R"query(DELETE FROM data WHERE id IS ?)query";
+
+const inline std::string CHUNK_IDS      = R"query(SELECT id FROM chunk WHERE file IS ?)query";
+const inline std::string GET_CHUNK      = R"query(SELECT * FROM chunk WHERE id IS ?)query";
+const inline std::string ADD_CHUNK      = R"query(INSERT INTO chunk (file, hash, size, crc, data, digest) VALUES (?, ?, ?, ?, ?, ?))query";
+const inline std::string COPY_CHUNK     = R"query(INSERT INTO chunk (file, hash, size, crc, data, digest) SELECT ?, hash, size, crc, data, digest FROM chunk WHERE id IS ?)query";
+const inline std::string SYNC_CHUNK     = R"query(INSERT OR REPLACE INTO chunk (id, file, hash, size, crc, data, digest) VALUES (?, ?, ?, ?, ?, ?, ?))query";
+const inline std::string HAS_DIGEST     = R"query(SELECT count(*) FROM pragma_table_info('chunk') WHERE name = 'digest')query";
+const inline std::string ADD_DIGEST     = R"query(ALTER TABLE chunk ADD COLUMN digest BLOB)query";
+const inline std::string LIST_GET       = R"query(SELECT seq, chunk FROM chunk_list WHERE file IS ? ORDER BY seq)query";
+const inline std::string LIST_ADD       = R"query(INSERT INTO chunk_list (file, seq, chunk) VALUES (?, ?, ?))query";
+const inline std::string LIST_CLEAR     = R"query(DELETE FROM chunk_list WHERE file IS ?)query";
+
+const inline std::string VERSION_NEXT   = R"query(SELECT ifnull(max(version), 0) + 1 FROM version WHERE file IS ?)query";
+const inline std::string VERSION_ADD    = R"query(INSERT INTO version (file, version, size, size_raw, compression) SELECT id, ?, size, size_raw, compression FROM fs WHERE id IS ?)query";
+const inline std::string VERSION_LIST   = R"query(INSERT INTO version_list (file, version, seq, chunk) SELECT file, ?, seq, chunk FROM chunk_list WHERE file IS ?)query";
+const inline std::string GET_VERSIONS   = R"query(SELECT version, size, size_raw, compression, time FROM version WHERE file IS ? ORDER BY version)query";
+const inline std::string GET_VERSION    = R"query(SELECT size_raw, compression FROM version WHERE file IS ? AND version IS ?)query";
+const inline std::string VERSION_CLEAR  = R"query(DELETE FROM version WHERE file IS ?)query";
+const inline std::string VERSION_ROWS   = R"query(SELECT * FROM version WHERE file IS ?)query";
+const inline std::string VLIST_ROWS     = R"query(SELECT * FROM version_list WHERE file IS ?)query";
+const inline std::string SYNC_VERSION   = R"query(INSERT INTO version (file, version, size, size_raw, compression, time) VALUES (?, ?, ?, ?, ?, ?))query";
+const inline std::string SYNC_VLIST     = R"query(INSERT INTO version_list (file, version, seq, chunk) VALUES (?, ?, ?, ?))query";
+
+const inline std::string JOURNAL_ADD    = R"query(INSERT INTO changes (op, id, path, size) VALUES (?, ?, ?, ?))query";
+const inline std::string JOURNAL_GET    = R"query(SELECT * FROM changes WHERE seq > ? ORDER BY seq LIMIT ?)query";
+const inline std::string JOURNAL_PRUNE  = R"query(DELETE FROM changes WHERE seq <= ?)query";
+const inline std::string JOURNAL_RANGE  = R"query(SELECT min(seq), max(seq) FROM changes)query";
+const inline std::string JOURNAL_LAST   = R"query(SELECT ifnull(max(seq), 0) FROM sqlite_sequence WHERE name = 'changes')query";
+const inline std::string JOURNAL_COPY   = R"query(INSERT OR IGNORE INTO changes (seq, op, id, path, size) VALUES (?, ?, ?, ?, ?))query";
+
+const inline std::string SET_SIDECAR    = R"query(INSERT INTO sidecar (id, file, nonce) VALUES (?, ?, ?))query";
+const inline std::string GET_SIDECAR    = R"query(SELECT file, nonce FROM sidecar WHERE id IS ?)query";
+const inline std::string HAS_SIDECAR    = R"query(SELECT 1 FROM sidecar WHERE file IS ?)query";
+const inline std::string DEL_SIDECAR    = R"query(DELETE FROM sidecar WHERE id IS ?)query";
+const inline std::string ALL_SIDECARS   = R"query(SELECT id, file, nonce FROM sidecar)query";
+const inline std::string PLAIN_SIDECARS = R"query(SELECT id, file FROM sidecar WHERE nonce IS NULL)query";
+const inline std::string MOVE_SIDECAR   = R"query(UPDATE sidecar SET file = ?2, nonce = ?3 WHERE id IS ?1)query";
+
+const inline std::string SYNC_DATA      = R"query(INSERT OR REPLACE INTO data (id, data) VALUES (?, ?))query";
+const inline std::string SYNC_SIDECAR   = R"query(INSERT OR REPLACE INTO sidecar (id, file, nonce) VALUES (?, ?, ?))query";
+const inline std::string SYNC_USAGE     = R"query(INSERT OR REPLACE INTO usage (id, files, size, size_raw) VALUES (?, ?, ?, ?))query";
+const inline std::string SYNC_NO_USAGE  = R"query(DELETE FROM usage WHERE id IS ?)query";
+
+const inline std::string SET_CHECKSUM   = R"query(INSERT OR REPLACE INTO checksum (id, crc) VALUES (?, ?))query";
+const inline std::string GET_CHECKSUM   = R"query(SELECT crc FROM checksum WHERE id IS ?)query";
+const inline std::string COPY_CHECKSUM  = R"query(INSERT OR REPLACE INTO checksum (id, crc) SELECT ?, crc FROM checksum WHERE id IS ?)query";
+const inline std::string ALL_CHECKSUMS  = R"query(SELECT fs.id, checksum.crc FROM fs LEFT JOIN checksum ON checksum.id IS fs.id WHERE fs.attrib & 1)query";
+const inline std::string FILES_COUNT    = R"query(SELECT count(*) FROM fs WHERE attrib & 1)query";
 
 // clang-format on
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstring>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -25,6 +26,10 @@
 #define SQLITEFS_LOCABLE_PROFILER(TYPE, NAME) TracyLockable(TYPE, NAME)
 #endif
 
+#ifndef SQLITEFS_SHARED_LOCABLE_PROFILER
+#define SQLITEFS_SHARED_LOCABLE_PROFILER(TYPE, NAME) TracySharedLockable(TYPE, NAME)
+#endif
+
 #else
 #define SQLITEFS_PROFILER(...)
 #define SQLITEFS_NO_PROFILER(...) __VA_ARGS__
@@ -32,9 +37,16 @@
 #define SQLITEFS_SCOPED_PROFILER
 #define SQLITEFS_SCOPEDN_PROFILER(...)
 #define SQLITEFS_LOCABLE_PROFILER(TYPE, NAME) TYPE NAME
+#define SQLITEFS_SHARED_LOCABLE_PROFILER(TYPE, NAME) TYPE NAME
 #endif
 
 
+// wiped on destruction, used for keys
+struct SecureString final : public std::string {
+    using std::string::basic_string;
+    ~SecureString() { std::memset(data(), 0, size()); };
+};
+
 template<typename Out>
 inline void split(const std::string& s, char delim, Out result) {
     std::istringstream iss(s);
@@ -1,9 +1,21 @@
+#include <algorithm>
+#include <array>
 #include <filesystem>
+#include <fstream>
 #include <gtest/gtest.h>
+#include <sqlitefs/sharded_sqlitefs.h>
 #include <sqlitefs/sqlitefs.h>
+#include <SQLiteCpp/SQLiteCpp.h>
 #include <thread>
 
 
+// exposes the raw connection to check the db state directly
+struct RawFS : SQLiteFS {
+    using SQLiteFS::rawCall;
+    using SQLiteFS::SQLiteFS;
+};
+
+
 class FSFixture : public testing::Test {
 protected:
     void SetUp() override { db = std::make_unique<SQLiteFS>(db_path, "password"); }
@@ -348,6 +360,7 @@ TEST_F(FSFixture, MoveFileOrFolder) {
 
     ASSERT_FALSE(db->mv("/f2", "/f1"));
     ASSERT_TRUE(db->mv("/f2", "/f1/f3"));
+    ASSERT_FALSE(db->mv("/f1", "/f1/f3/f1"));
 
     {
         auto read_data = db->read("/f1/f3/test2.txt");
@@ -459,6 +472,1368 @@ TEST_F(FSFixture, CopyFileMT) {
 }
 
 
+TEST_F(FSFixture, FindFiles) {
+    ASSERT_TRUE(db->mkdir("f1"));
+    ASSERT_TRUE(db->mkdir("f1/f2"));
+    ASSERT_TRUE(db->mkdir("f3"));
+
+    std::string       data("random test data");
+    std::vector<char> content(data.begin(), data.end());
+    std::vector<char> big(1024, 'x'); // NOLINT
+
+    ASSERT_TRUE(db->write("test.txt", content));
+    ASSERT_TRUE(db->write("f1/test.txt", content));
+    ASSERT_TRUE(db->write("f1/f2/test.bin", big));
+    ASSERT_TRUE(db->write("f3/test.txt", big));
+
+    auto collect = [&](const std::string& path, const SQLiteFS::FindFilter& filter) {
+        std::vector<std::string> names;
+        db->find(path, filter, [&](const SQLiteFSNode& n) {
+            names.emplace_back(n.name);
+            return true;
+        });
+        std::sort(names.begin(), names.end());
+        return names;
+    };
+
+    ASSERT_EQ(collect("/", {}).size(), 7);
+    ASSERT_EQ(collect("/", {.name = "*.txt"}), (std::vector<std::string>{"test.txt", "test.txt", "test.txt"}));
+    ASSERT_EQ(collect("/", {.min_size = 100}), (std::vector<std::string>{"test.bin", "test.txt"}));
+    ASSERT_EQ(collect("/f1", {.name = "*.txt"}), (std::vector<std::string>{"test.txt"}));
+    ASSERT_EQ(collect("/", {.max_depth = 1}), (std::vector<std::string>{"f1", "f3", "test.txt"}));
+    ASSERT_EQ(collect("/", {.attributes = SQLiteFSNode::Attributes{}}),
+              (std::vector<std::string>{"f1", "f2", "f3"}));
+    ASSERT_EQ(collect("/", {.compression = "lzma"}).size(), 0);
+    ASSERT_EQ(collect("/missing", {}).size(), 0);
+
+    std::size_t visited = 0;
+    ASSERT_EQ(db->find("/", {}, [&](const SQLiteFSNode&) { return ++visited < 2; }), 2);
+}
+
+
+TEST_F(FSFixture, PaginatedLs) {
+    ASSERT_TRUE(db->mkdir("f1"));
+    for (int i = 0; i < 25; i++) { // NOLINT
+        ASSERT_TRUE(db->mkdir("f1/d" + std::to_string(100 + i)));
+    }
+
+    auto page = db->ls("f1", "", 10);
+    ASSERT_EQ(page.size(), 10);
+    ASSERT_EQ(page.front().name, "d100");
+    ASSERT_EQ(page.back().name, "d109");
+
+    page = db->ls("f1", page.back().name, 10);
+    ASSERT_EQ(page.size(), 10);
+    ASSERT_EQ(page.front().name, "d110");
+
+    page = db->ls("f1", page.back().name, 10);
+    ASSERT_EQ(page.size(), 5);
+    ASSERT_EQ(page.back().name, "d124");
+
+    ASSERT_TRUE(db->ls("f1", page.back().name, 10).empty());
+    ASSERT_TRUE(db->ls("missing", "", 10).empty());
+
+    std::vector<std::string> names;
+    SQLiteFS::LsCursor       cursor(*db, "/f1", 7);
+    while (const auto* n = cursor.next()) {
+        names.emplace_back(n->name);
+    }
+    ASSERT_EQ(names.size(), 25);
+    ASSERT_TRUE(std::is_sorted(names.begin(), names.end()));
+}
+
+
+TEST_F(FSFixture, CompactListing) {
+    db->registerSaveFunc("reverse",
+                         [](SQLiteFS::DataInput data) { return SQLiteFS::DataOutput{data.rbegin(), data.rend()}; });
+
+    std::string       data("random test data");
+    std::vector<char> content(data.begin(), data.end());
+
+    ASSERT_TRUE(db->mkdir("f1"));
+    ASSERT_TRUE(db->write("c.txt", content));
+    ASSERT_TRUE(db->write("a.txt", content, "reverse"));
+    ASSERT_TRUE(db->write("b.txt", content));
+
+    auto listing = db->list();
+    ASSERT_EQ(listing.size(), 4);
+    ASSERT_EQ(listing.codecs.size(), 2);
+    ASSERT_EQ(listing.name(0), "a.txt");
+    ASSERT_EQ(listing.compression(0), "reverse");
+    ASSERT_EQ(listing.name(3), "f1");
+    ASSERT_EQ(listing.compression(3), "");
+    ASSERT_EQ(listing.codec_ids[3], SQLiteFSListing::NO_CODEC);
+
+    auto nodes = db->ls();
+    ASSERT_EQ(nodes.size(), listing.size());
+    for (std::size_t i = 0; i < nodes.size(); ++i) {
+        ASSERT_EQ(nodes[i], listing.node(i));
+    }
+
+    auto by_id = listing.sorted([&](auto l, auto r) { return listing.ids[l] < listing.ids[r]; });
+    ASSERT_EQ(listing.name(by_id.front()), "f1");
+    ASSERT_EQ(listing.name(by_id.back()), "b.txt");
+
+    ASSERT_EQ(db->list("a.txt").size(), 1);
+    ASSERT_TRUE(db->list("missing").empty());
+
+    // an empty path is resolved the same way by both listings
+    ASSERT_TRUE(db->write("f1/d.txt", content));
+    ASSERT_TRUE(db->cd("f1"));
+    ASSERT_EQ(db->ls(""), db->ls("", "", 100)); // NOLINT
+    ASSERT_EQ(db->list("").size(), 4);
+    ASSERT_EQ(db->list().size(), 1);
+}
+
+
+TEST_F(FSFixture, DiskUsage) {
+    std::string       data("random test data");
+    std::vector<char> content(data.begin(), data.end());
+
+    ASSERT_TRUE(db->mkdir("f1"));
+    ASSERT_TRUE(db->mkdir("f1/f2"));
+    ASSERT_TRUE(db->mkdir("f3"));
+    ASSERT_EQ(db->du("/"), SQLiteFSUsage{});
+
+    ASSERT_TRUE(db->write("f1/f2/test.txt", content));
+    ASSERT_TRUE(db->write("f1/test.txt", content));
+    ASSERT_EQ(db->du("/"), (SQLiteFSUsage{.files = 2, .size = 32, .size_raw = 32}));
+    ASSERT_EQ(db->du("f1/f2"), (SQLiteFSUsage{.files = 1, .size = 16, .size_raw = 16}));
+    ASSERT_EQ(db->du("f1/test.txt"), (SQLiteFSUsage{.files = 1, .size = 16, .size_raw = 16}));
+    ASSERT_FALSE(db->du("missing"));
+
+    ASSERT_TRUE(db->cp("f1/test.txt", "f3/copy.txt"));
+    ASSERT_EQ(db->du("f3"), (SQLiteFSUsage{.files = 1, .size = 16, .size_raw = 16}));
+    ASSERT_EQ(db->du("/")->files, 3);
+
+    ASSERT_TRUE(db->mv("f1/f2", "f3/"));
+    ASSERT_EQ(db->du("f1"), (SQLiteFSUsage{.files = 1, .size = 16, .size_raw = 16}));
+    ASSERT_EQ(db->du("f3"), (SQLiteFSUsage{.files = 2, .size = 32, .size_raw = 32}));
+    ASSERT_EQ(db->du("/")->files, 3);
+
+    ASSERT_TRUE(db->rm("f3"));
+    ASSERT_EQ(db->du("/"), (SQLiteFSUsage{.files = 1, .size = 16, .size_raw = 16}));
+    ASSERT_TRUE(db->rm("f1/test.txt"));
+    ASSERT_EQ(db->du("/"), SQLiteFSUsage{});
+}
+
+
+TEST_F(FSFixture, DiskUsageRebuild) {
+    std::string       data("random test data");
+    std::vector<char> content(data.begin(), data.end());
+
+    ASSERT_TRUE(db->mkdir("f1"));
+    ASSERT_TRUE(db->write("f1/test.txt", content));
+    ASSERT_TRUE(db->write("test.txt", content));
+    db.reset();
+
+    // simulate a database created before folder totals existed
+    RawFS(db_path, "password").rawCall([](SQLite::Database* raw) { raw->exec("DROP TABLE usage"); });
+
+    db = std::make_unique<SQLiteFS>(db_path, "password");
+    ASSERT_EQ(db->du("/"), (SQLiteFSUsage{.files = 2, .size = 32, .size_raw = 32}));
+    ASSERT_EQ(db->du("f1")->files, 1);
+}
+
+
+TEST_F(FSFixture, AncestorIndex) {
+    std::string       data("random test data");
+    std::vector<char> content(data.begin(), data.end());
+
+    ASSERT_TRUE(db->mkdir("f1"));
+    ASSERT_TRUE(db->mkdir("f1/f2"));
+    ASSERT_TRUE(db->write("f1/f2/test.txt", content));
+    db.reset();
+
+    // the index is built for an existing database and maintained from now on
+    db = std::make_unique<SQLiteFS>(db_path, "password", SQLiteFS::Options{.ancestor_index = true});
+    ASSERT_TRUE(db->mkdir("f3"));
+    ASSERT_TRUE(db->mv("f1/f2", "f3/"));
+    ASSERT_FALSE(db->mv("f3", "f3/f2/f4"));
+    ASSERT_FALSE(db->mv("f3", "f3/"));
+
+    ASSERT_TRUE(db->cd("f3/f2"));
+    ASSERT_EQ(db->pwd(), "/f3/f2");
+    ASSERT_TRUE(db->cd("/"));
+
+    std::size_t found = 0;
+    db->find("/f3", {.name = "*.txt"}, [&](const SQLiteFSNode&) {
+        ++found;
+        return true;
+    });
+    ASSERT_EQ(found, 1);
+    ASSERT_EQ(db->du("f3")->files, 1);
+    ASSERT_EQ(db->du("f1")->files, 0);
+
+    ASSERT_TRUE(db->rm("f3"));
+    ASSERT_EQ(db->du("/")->files, 0);
+    ASSERT_EQ(db->ls().size(), 1);
+    db.reset();
+
+    // it stays enabled without the option
+    db = std::make_unique<SQLiteFS>(db_path, "password");
+    ASSERT_TRUE(db->mkdir("f1/f2"));
+    ASSERT_TRUE(db->mkdir("f1/f2/f3"));
+    ASSERT_TRUE(db->cd("f1/f2/f3"));
+    ASSERT_EQ(db->pwd(), "/f1/f2/f3");
+    ASSERT_FALSE(db->mv("/f1", "/f1/f2/f3/f1"));
+}
+
+
+TEST_F(FSFixture, ConnectionOptions) {
+    db.reset();
+    std::filesystem::remove(db_path);
+
+    auto pragma = [](RawFS& fs, const std::string& name) {
+        std::string value;
+        fs.rawCall([&](SQLite::Database* raw) { value = raw->execAndGet("PRAGMA " + name).getString(); });
+        return value;
+    };
+
+    std::string       data("random test data");
+    std::vector<char> content(data.begin(), data.end());
+
+    {
+        RawFS fs(db_path,
+                 "password",
+                 {.journal_mode    = SQLiteFS::Options::JournalMode::WAL,
+                  .synchronous     = SQLiteFS::Options::Synchronous::NORMAL,
+                  .temp_store      = SQLiteFS::Options::TempStore::MEMORY,
+                  .mmap_size       = 1 << 20,
+                  .cache_size      = -4096,
+                  .page_size       = 8192,
+                  .busy_timeout_ms = 1000});
+        ASSERT_EQ(pragma(fs, "journal_mode"), "wal");
+        ASSERT_EQ(pragma(fs, "synchronous"), "1");
+        ASSERT_EQ(pragma(fs, "temp_store"), "2");
+        ASSERT_EQ(pragma(fs, "cache_size"), "-4096");
+        ASSERT_EQ(pragma(fs, "page_size"), "8192");
+        ASSERT_TRUE(fs.write("test.txt", content));
+    }
+
+    {
+        SQLiteFS fs(db_path, "password", {.read_only = true});
+        ASSERT_EQ(fs.read("test.txt"), content);
+        ASSERT_FALSE(fs.write("test2.txt", content));
+        ASSERT_FALSE(fs.mkdir("f1"));
+    }
+
+    {
+        SQLiteFS fs(db_path, "password", {.journal_mode = SQLiteFS::Options::JournalMode::DELETE});
+    }
+
+    {
+        SQLiteFS fs(db_path, "password", {.immutable = true});
+        ASSERT_EQ(fs.read("test.txt"), content);
+        ASSERT_EQ(fs.ls().size(), 1);
+    }
+}
+
+
+TEST_F(FSFixture, IncrementalVacuum) {
+    db.reset();
+    std::filesystem::remove(db_path);
+
+    std::vector<char> content(64 * 1024, 'x'); // NOLINT
+
+    auto fill_and_clear = [&] {
+        ASSERT_TRUE(db->mkdir("f1"));
+        for (int i = 0; i < 16; i++) { // NOLINT
+            ASSERT_TRUE(db->write("f1/test" + std::to_string(i), content));
+        }
+        ASSERT_TRUE(db->rm("f1"));
+    };
+
+    db = std::make_unique<SQLiteFS>(db_path,
+                                    "password",
+                                    SQLiteFS::Options{.auto_vacuum = SQLiteFS::Options::AutoVacuum::INCREMENTAL});
+    fill_and_clear();
+
+    auto before = db->space();
+    ASSERT_GT(before.freelist_count, 10);
+
+    ASSERT_EQ(db->reclaim(10), 10);
+    auto after = db->space();
+    ASSERT_EQ(after.freelist_count, before.freelist_count - 10);
+    ASSERT_EQ(after.page_count, before.page_count - 10);
+    db.reset();
+
+    db = std::make_unique<SQLiteFS>(db_path,
+                                    "password",
+                                    SQLiteFS::Options{.auto_vacuum      = SQLiteFS::Options::AutoVacuum::INCREMENTAL,
+                                                      .reclaim_interval = std::chrono::milliseconds(1),
+                                                      .reclaim_pages    = 4});
+    fill_and_clear();
+
+    for (int i = 0; i < 1000 && db->space().freelist_count > 0; i++) { // NOLINT
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));     // NOLINT
+    }
+    ASSERT_EQ(db->space().freelist_count, 0);
+}
+
+
+TEST_F(FSFixture, BackupAndSnapshot) {
+    std::string       data("random test data");
+    std::vector<char> content(data.begin(), data.end());
+    std::vector<char> big(256 * 1024, 'x'); // NOLINT
+
+    ASSERT_TRUE(db->mkdir("f1"));
+    ASSERT_TRUE(db->write("f1/test.txt", content));
+    ASSERT_TRUE(db->write("f1/big.bin", big));
+
+    std::string backup_path = "backup.db";
+    std::filesystem::remove(backup_path);
+
+    {
+        // writers keep working while the backup is stepping
+        std::jthread writer([&] {
+            for (int i = 0; i < 20; i++) { // NOLINT
+                ASSERT_TRUE(db->write("f1/test" + std::to_string(i), content));
+            }
+        });
+        ASSERT_TRUE(db->backup(backup_path, "other password", 1));
+    }
+
+    {
+        SQLiteFS copy(backup_path, "other password");
+        ASSERT_EQ(copy.read("f1/test.txt"), content);
+        ASSERT_EQ(copy.read("f1/big.bin"), big);
+        ASSERT_GE(copy.du("/")->files, 2);
+    }
+    std::filesystem::remove(backup_path);
+
+    auto image = db->snapshot();
+    ASSERT_FALSE(image.empty());
+    {
+        std::ofstream file(backup_path, std::ios::binary);
+        file.write(image.data(), static_cast<std::streamsize>(image.size()));
+    }
+    {
+        SQLiteFS copy(backup_path);
+        ASSERT_EQ(copy.read("f1/big.bin"), big);
+        ASSERT_EQ(copy.ls("f1").size(), db->ls("f1").size());
+    }
+    std::filesystem::remove(backup_path);
+}
+
+
+TEST_F(FSFixture, InMemory) {
+    std::string       data("random test data");
+    std::vector<char> content(data.begin(), data.end());
+
+    ASSERT_TRUE(db->write("test.txt", content));
+    db.reset();
+
+    db = std::make_unique<SQLiteFS>(db_path, "password", SQLiteFS::Options{.in_memory = true});
+    ASSERT_EQ(db->read("test.txt"), content);
+    ASSERT_TRUE(db->mkdir("f1"));
+    ASSERT_TRUE(db->write("f1/test.txt", content));
+
+    // nothing reaches the file before flush
+    ASSERT_FALSE(SQLiteFS(db_path, "password", {.read_only = true}).du("f1"));
+    ASSERT_TRUE(db->flush());
+    ASSERT_EQ(SQLiteFS(db_path, "password", {.read_only = true}).read("f1/test.txt"), content);
+
+    // and the rest is written on destruction
+    ASSERT_TRUE(db->rm("test.txt"));
+    db.reset();
+    db = std::make_unique<SQLiteFS>(db_path, "password");
+    ASSERT_EQ(db->ls().size(), 1);
+    ASSERT_EQ(db->du("/")->files, 1);
+    db.reset();
+
+    db = std::make_unique<SQLiteFS>(
+      db_path,
+      "password",
+      SQLiteFS::Options{.in_memory = true, .flush_interval = std::chrono::milliseconds(1)});
+    ASSERT_TRUE(db->write("test2.txt", content));
+
+    std::optional<SQLiteFSUsage> usage;
+    for (int i = 0; i < 1000 && usage != SQLiteFSUsage{2, 32, 32}; i++) { // NOLINT
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));      // NOLINT
+        usage = SQLiteFS(db_path, "password", {.read_only = true}).du("/");
+    }
+    ASSERT_EQ(usage, (SQLiteFSUsage{2, 32, 32}));
+    db.reset();
+
+    db = std::make_unique<SQLiteFS>(db_path, "password", SQLiteFS::Options{.read_only = true, .in_memory = true});
+    ASSERT_EQ(db->read("test2.txt"), content);
+    ASSERT_FALSE(db->write("test3.txt", content));
+    ASSERT_FALSE(db->flush());
+    db.reset();
+
+    // a new file
+    std::filesystem::remove(db_path);
+    db = std::make_unique<SQLiteFS>(db_path, "password", SQLiteFS::Options{.in_memory = true});
+    ASSERT_TRUE(db->write("test.txt", content));
+    db.reset();
+    db = std::make_unique<SQLiteFS>(db_path, "password");
+    ASSERT_EQ(db->read("test.txt"), content);
+}
+
+
+TEST_F(FSFixture, SidecarBlobs) {
+    std::string       plain_path = "plain.db";
+    auto              blobs      = std::filesystem::path(plain_path + ".blobs");
+    std::vector<char> small(100, 's');  // NOLINT
+    std::vector<char> big(10000, 'b'); // NOLINT
+
+    {
+        SQLiteFS fs(plain_path, "", {.sidecar_threshold = 1024});
+        ASSERT_TRUE(fs.write("small.bin", small));
+        ASSERT_TRUE(fs.write("big.bin", big));
+        ASSERT_FALSE(fs.write("big.bin", small));
+        ASSERT_EQ(std::distance(std::filesystem::directory_iterator(blobs), {}), 1);
+        ASSERT_EQ(fs.read("small.bin"), small);
+        ASSERT_EQ(fs.read("big.bin"), big);
+
+        ASSERT_TRUE(fs.mkdir("f1"));
+        ASSERT_TRUE(fs.cp("big.bin", "f1/"));
+        ASSERT_EQ(fs.read("f1/big.bin"), big);
+        ASSERT_EQ(std::distance(std::filesystem::directory_iterator(blobs), {}), 2);
+
+        ASSERT_TRUE(fs.rm("f1"));
+        ASSERT_EQ(std::distance(std::filesystem::directory_iterator(blobs), {}), 1);
+        ASSERT_EQ(fs.read("big.bin"), big);
+
+        // leftovers of an interrupted write are collected by vacuum
+        std::ofstream(blobs / "12345") << "orphan";
+        fs.vacuum();
+        ASSERT_EQ(std::distance(std::filesystem::directory_iterator(blobs), {}), 1);
+        ASSERT_EQ(fs.du("/"), (SQLiteFSUsage{2, 10100, 10100}));
+    }
+
+    auto stored = [](const std::filesystem::path& dir) {
+        std::vector<std::string> result;
+        for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+            std::ifstream file(entry.path(), std::ios::binary);
+            result.emplace_back(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        }
+        return result;
+    };
+    auto encrypted = [&](const std::filesystem::path& dir) {
+        return std::ranges::all_of(stored(dir), [&](const std::string& file) {
+            return file.size() == big.size() && file.find(std::string(64, 'b')) == std::string::npos; // NOLINT
+        });
+    };
+
+    // with a key sidecars are encrypted and decrypted on read
+    auto keyed_blobs = std::filesystem::path(db_path + ".blobs");
+    {
+        SQLiteFS fs(db_path, "password", {.sidecar_threshold = 1024, .checksums = true});
+        ASSERT_TRUE(fs.write("big.bin", big));
+        ASSERT_EQ(fs.errorCode(), SQLiteFSError::NONE);
+        ASSERT_TRUE(fs.cp("big.bin", "copy.bin"));
+        ASSERT_EQ(stored(keyed_blobs).size(), 2);
+        ASSERT_TRUE(encrypted(keyed_blobs));
+
+        ASSERT_EQ(fs.read("big.bin"), big);
+        ASSERT_EQ(fs.read("copy.bin"), big);
+        auto view = fs.readView("big.bin");
+        ASSERT_TRUE(view);
+        ASSERT_TRUE(std::ranges::equal(view.data(), big));
+        ASSERT_TRUE(fs.fsck().corrupted.empty());
+    }
+    std::filesystem::remove(db_path);
+    std::filesystem::remove_all(keyed_blobs);
+
+    // sidecars written without a key are encrypted once it's set
+    {
+        SQLiteFS fs(plain_path, "password", {.sidecar_threshold = 1024});
+        ASSERT_EQ(stored(blobs).size(), 1);
+        ASSERT_TRUE(encrypted(blobs));
+        ASSERT_EQ(fs.read("big.bin"), big);
+
+        // copies for a plain database or another key are re-encrypted
+        std::string copy_path = "copy.db";
+        for (std::string key : {"", "other password"}) {
+            ASSERT_TRUE(fs.backup(copy_path, key));
+            {
+                SQLiteFS copy(copy_path, key);
+                ASSERT_EQ(copy.read("big.bin"), big);
+            }
+            ASSERT_EQ(encrypted(copy_path + ".blobs"), !key.empty());
+            std::filesystem::remove(copy_path);
+            std::filesystem::remove_all(copy_path + ".blobs");
+        }
+
+        // the snapshot has sidecar data inside
+        auto image = fs.snapshot();
+        {
+            std::ofstream file(copy_path, std::ios::binary);
+            file.write(image.data(), static_cast<std::streamsize>(image.size()));
+        }
+        {
+            SQLiteFS copy(copy_path);
+            ASSERT_EQ(copy.read("big.bin"), big);
+            ASSERT_EQ(copy.read("small.bin"), small);
+        }
+        ASSERT_FALSE(std::filesystem::exists(copy_path + ".blobs"));
+        std::filesystem::remove(copy_path);
+    }
+
+    std::filesystem::remove(plain_path);
+    std::filesystem::remove_all(blobs);
+}
+
+
+TEST_F(FSFixture, ReadView) {
+    std::string       data("random test data");
+    std::vector<char> content(data.begin(), data.end());
+
+    auto reverse = [](SQLiteFS::DataInput in) { return SQLiteFS::DataOutput(in.rbegin(), in.rend()); };
+    db->registerSaveFunc("reverse", reverse);
+    db->registerLoadFunc("reverse", reverse);
+
+    ASSERT_TRUE(db->write("raw.txt", content));
+    ASSERT_TRUE(db->write("reversed.txt", content, "reverse"));
+    ASSERT_TRUE(db->mkdir("f1"));
+
+    {
+        auto view = db->readView("raw.txt");
+        ASSERT_TRUE(view);
+        ASSERT_TRUE(std::ranges::equal(view.data(), content));
+    }
+
+    auto decoded = db->readView("reversed.txt");
+    ASSERT_TRUE(decoded);
+    ASSERT_TRUE(std::ranges::equal(decoded.data(), content));
+    // decoded views don't keep the fs locked
+    ASSERT_EQ(db->read("raw.txt"), content);
+
+    ASSERT_FALSE(db->readView("f1"));
+    ASSERT_FALSE(db->readView("missing.txt"));
+}
+
+
+TEST_F(FSFixture, PmrReadWrite) {
+    std::string       data("random test data");
+    std::vector<char> content(data.begin(), data.end());
+
+    std::array<std::byte, 4096>         buffer{}; // NOLINT
+    std::pmr::monotonic_buffer_resource arena(buffer.data(), buffer.size(), std::pmr::null_memory_resource());
+
+    auto reverse = [](SQLiteFS::DataInput in) { return SQLiteFS::DataOutput(in.rbegin(), in.rend()); };
+    db->registerSaveFunc("reverse", reverse);
+    db->registerLoadFunc("reverse", reverse);
+
+    std::size_t pmr_calls = 0;
+    db->registerLoadFunc("reverse", [&](SQLiteFS::DataInput in, std::pmr::memory_resource* resource) {
+        ++pmr_calls;
+        return SQLiteFS::PmrDataOutput(in.rbegin(), in.rend(), resource);
+    });
+
+    ASSERT_TRUE(db->write("raw.txt", content, "raw", &arena));
+    ASSERT_TRUE(db->write("reversed.txt", content, "reverse", &arena));
+    ASSERT_EQ(db->read("raw.txt"), content);
+    ASSERT_EQ(db->read("reversed.txt"), content);
+
+    auto raw = db->read("raw.txt", &arena);
+    ASSERT_EQ(raw.get_allocator().resource(), &arena);
+    ASSERT_TRUE(std::ranges::equal(raw, content));
+
+    auto reversed = db->read("reversed.txt", &arena);
+    ASSERT_EQ(reversed.get_allocator().resource(), &arena);
+    ASSERT_TRUE(std::ranges::equal(reversed, content));
+    ASSERT_EQ(pmr_calls, 1);
+
+    ASSERT_TRUE(db->read("missing.txt", &arena).empty());
+}
+
+
+TEST_F(FSFixture, ErrorCodes) {
+    std::string       data("random test data");
+    std::vector<char> content(data.begin(), data.end());
+
+    ASSERT_EQ(db->errorCode(), SQLiteFSError::NONE);
+    ASSERT_TRUE(db->mkdir("f1"));
+    ASSERT_TRUE(db->write("test.txt", content));
+
+    ASSERT_FALSE(db->cd("missing"));
+    ASSERT_EQ(db->errorCode(), SQLiteFSError::NOT_FOUND);
+    ASSERT_EQ(db->error(), describe(SQLiteFSError::NOT_FOUND));
+    ASSERT_EQ(db->errorCode(), SQLiteFSError::NONE);
+    ASSERT_EQ(db->error(), "");
+
+    ASSERT_FALSE(db->mkdir("f1"));
+    ASSERT_EQ(db->errorCode(), SQLiteFSError::ALREADY_EXISTS);
+    ASSERT_FALSE(db->write("test.txt", content));
+    ASSERT_EQ(db->errorCode(), SQLiteFSError::ALREADY_EXISTS);
+    ASSERT_FALSE(db->mv("/", "f1"));
+    ASSERT_EQ(db->errorCode(), SQLiteFSError::INVALID_TARGET);
+
+    auto result = db->tryRead("test.txt");
+    ASSERT_TRUE(result);
+    ASSERT_EQ(*result, content);
+    ASSERT_EQ(db->tryRead("missing.txt").error(), SQLiteFSError::NOT_FOUND);
+    ASSERT_EQ(db->tryRead("f1").error(), SQLiteFSError::NOT_A_FILE);
+    ASSERT_EQ(db->tryRead("f1/missing.txt").value_or(content), content);
+}
+
+
+TEST_F(FSFixture, StatExists) {
+    std::string       data("random test data");
+    std::vector<char> content(data.begin(), data.end());
+
+    ASSERT_TRUE(db->mkdir("f1"));
+    ASSERT_TRUE(db->mkdir("f1/f2"));
+    ASSERT_TRUE(db->write("f1/test.txt", content));
+    ASSERT_TRUE(db->write("f1/f2/test.txt", content));
+
+    auto file = db->stat("/f1/test.txt");
+    ASSERT_TRUE(file);
+    ASSERT_EQ(file->size_raw, content.size());
+    ASSERT_EQ(file->attributes, SQLiteFSNode::Attributes::FILE);
+
+    ASSERT_TRUE(db->exists("f1"));
+    ASSERT_TRUE(db->exists("/"));
+    ASSERT_TRUE(db->exists("f1/f2/.."));
+    ASSERT_FALSE(db->exists("f1/missing.txt"));
+    ASSERT_EQ(db->stat("missing/test.txt").error(), SQLiteFSError::NOT_FOUND);
+
+    ASSERT_TRUE(db->cd("f1"));
+    std::vector<std::string> paths{"test.txt", "f2/test.txt", "/f1/test.txt", "missing/a", "missing/b", "f2", ".."};
+    auto                     stats = db->statMany(paths);
+    ASSERT_EQ(stats.size(), paths.size());
+    ASSERT_EQ(*stats[0], *file);
+    ASSERT_EQ(*stats[2], *file);
+    ASSERT_EQ(stats[1]->name, "test.txt");
+    ASSERT_FALSE(stats[3]);
+    ASSERT_FALSE(stats[4]);
+    ASSERT_EQ(stats[5]->name, "f2");
+    ASSERT_EQ(stats[6]->id, 0);
+}
+
+
+TEST_F(FSFixture, ChangeJournal) {
+    using Op = SQLiteFSChange::Op;
+
+    std::string       data("random test data");
+    std::vector<char> content(data.begin(), data.end());
+
+    ASSERT_TRUE(db->mkdir("f0"));
+    ASSERT_TRUE(db->changesSince(0).empty());
+    db.reset();
+
+    db = std::make_unique<SQLiteFS>(db_path, "password", SQLiteFS::Options{.change_journal = true});
+    ASSERT_TRUE(db->mkdir("f1"));
+    ASSERT_TRUE(db->write("f1/test.txt", content));
+    ASSERT_TRUE(db->cp("f1/test.txt", "copy.txt"));
+    ASSERT_TRUE(db->mv("copy.txt", "f0/moved.txt"));
+    ASSERT_TRUE(db->rm("f1"));
+    ASSERT_FALSE(db->mkdir("f0"));
+
+    auto changes = db->changesSince(0);
+    ASSERT_EQ(changes.size(), 5);
+    ASSERT_EQ(changes[0].op, Op::MKDIR);
+    ASSERT_EQ(changes[0].path, "/f1");
+    ASSERT_EQ(changes[1].op, Op::WRITE);
+    ASSERT_EQ(changes[1].path, "/f1/test.txt");
+    ASSERT_EQ(changes[1].size, content.size());
+    ASSERT_EQ(changes[2].op, Op::CP);
+    ASSERT_EQ(changes[2].path, "/copy.txt");
+    ASSERT_EQ(changes[3].op, Op::MV);
+    ASSERT_EQ(changes[3].path, "/f0/moved.txt");
+    ASSERT_EQ(changes[3].id, changes[2].id);
+    ASSERT_EQ(changes[4].op, Op::RM);
+    ASSERT_EQ(changes[4].path, "/f1");
+    ASSERT_EQ(changes[4].size, content.size());
+
+    ASSERT_EQ(db->changesSince(changes[2].seq, 1), std::vector{changes[3]});
+    ASSERT_EQ(db->pruneChanges(changes[2].seq), 3);
+    ASSERT_EQ(db->changesSince(0).size(), 2);
+    db.reset();
+
+    // the journal stays enabled and can be limited
+    db = std::make_unique<SQLiteFS>(db_path, "password", SQLiteFS::Options{.journal_keep = 2});
+    ASSERT_TRUE(db->mkdir("f2"));
+    ASSERT_TRUE(db->mkdir("f3"));
+    ASSERT_TRUE(db->mkdir("f4"));
+    changes = db->changesSince(0);
+    ASSERT_EQ(changes.size(), 2);
+    ASSERT_EQ(changes[1].path, "/f4");
+
+    // paths follow the tree, not the order the folders were made in
+    ASSERT_TRUE(db->mkdir("a"));
+    ASSERT_TRUE(db->mkdir("b"));
+    ASSERT_TRUE(db->mkdir("c"));
+    ASSERT_TRUE(db->mv("b", "a/b"));
+    ASSERT_TRUE(db->mv("a", "c/a"));
+    ASSERT_TRUE(db->write("c/a/b/f.txt", content));
+    ASSERT_EQ(db->changesSince(0).back().path, "/c/a/b/f.txt");
+    ASSERT_TRUE(db->cd("c/a/b"));
+    ASSERT_EQ(db->pwd(), "/c/a/b");
+}
+
+
+TEST_F(FSFixture, Replica) {
+    std::string       data("random test data");
+    std::vector<char> content(data.begin(), data.end());
+    std::string       replica_path = "replica.db";
+
+    db.reset();
+    db = std::make_unique<SQLiteFS>(db_path, "password", SQLiteFS::Options{.change_journal = true});
+
+    auto changes = [&] {
+        int count = 0;
+        RawFS(replica_path, "", {.read_only = true}).rawCall([&](SQLite::Database* raw) {
+            count = raw->execAndGet("SELECT count(*) FROM changes").getInt();
+        });
+        return count;
+    };
+
+    ASSERT_TRUE(db->mkdir("f1"));
+    ASSERT_TRUE(db->write("f1/test.txt", content));
+    ASSERT_TRUE(db->replicate(replica_path));
+    ASSERT_EQ(SQLiteFS(replica_path, "", {.read_only = true}).read("f1/test.txt"), content);
+    ASSERT_EQ(changes(), 2);
+
+    // only the new entries are applied
+    ASSERT_TRUE(db->mkdir("f2"));
+    ASSERT_TRUE(db->mv("f1", "f2/"));
+    ASSERT_TRUE(db->cp("f2/f1/test.txt", "copy.txt"));
+    ASSERT_TRUE(db->rm("f2/f1/test.txt"));
+    ASSERT_TRUE(db->write("f2/f1/test.txt", content));
+    db->error();
+    ASSERT_TRUE(db->replicate(replica_path));
+    ASSERT_EQ(db->errorCode(), SQLiteFSError::NONE);
+    ASSERT_EQ(changes(), 7);
+    {
+        SQLiteFS replica(replica_path, "", {.read_only = true});
+        ASSERT_EQ(replica.read("f2/f1/test.txt"), content);
+        ASSERT_EQ(replica.read("copy.txt"), content);
+        ASSERT_FALSE(replica.exists("f1"));
+        ASSERT_EQ(replica.du("/"), db->du("/"));
+        ASSERT_EQ(replica.du("f2"), db->du("f2"));
+        ASSERT_EQ(replica.ls("f2"), db->ls("f2"));
+    }
+
+    // a pruned journal falls back to a full copy
+    ASSERT_TRUE(db->rm("copy.txt"));
+    ASSERT_TRUE(db->mkdir("f3"));
+    ASSERT_EQ(db->pruneChanges(db->changesSince(0).back().seq), 9);
+    ASSERT_TRUE(db->mkdir("f4"));
+    ASSERT_TRUE(db->replicate(replica_path));
+    {
+        SQLiteFS replica(replica_path, "", {.read_only = true});
+        ASSERT_EQ(replica.ls("/"), db->ls("/"));
+        ASSERT_EQ(replica.du("/"), db->du("/"));
+    }
+
+    // the same when the journal was pruned to the last entry
+    ASSERT_TRUE(db->write("new.txt", content));
+    ASSERT_EQ(db->pruneChanges(db->changesSince(0).back().seq), 2);
+    ASSERT_TRUE(db->changesSince(0).empty());
+    ASSERT_TRUE(db->replicate(replica_path));
+    ASSERT_EQ(SQLiteFS(replica_path, "", {.read_only = true}).read("new.txt"), content);
+
+    std::filesystem::remove(replica_path);
+}
+
+
+TEST_F(FSFixture, Checksums) {
+    std::string       data("123456789");
+    std::vector<char> content(data.begin(), data.end());
+    std::string       plain_path = "plain.db";
+    using Verify                 = SQLiteFS::Options::Verify;
+
+    // files written before the checksums are hashed when they are created
+    SQLiteFS(plain_path).write("old.txt", content);
+    ASSERT_EQ(SQLiteFS(plain_path).fsck().unchecked, 1);
+    ASSERT_EQ(SQLiteFS(plain_path, "", {.checksums = true}).fsck().files, 1);
+    ASSERT_EQ(SQLiteFS(plain_path).fsck().unchecked, 0);
+    std::filesystem::remove(plain_path);
+
+    db.reset();
+    {
+        RawFS fs(db_path, "password", {.checksums = true, .verify = Verify::ALWAYS});
+        ASSERT_TRUE(fs.write("test.txt", content));
+        ASSERT_TRUE(fs.cp("test.txt", "copy.txt"));
+
+        std::uint32_t id = fs.stat("test.txt")->id;
+        fs.rawCall([&](SQLite::Database* raw) {
+            // CRC-32C check value
+            ASSERT_EQ(raw->execAndGet("SELECT crc FROM checksum WHERE id = " + std::to_string(id)).getInt64(),
+                      0xE3069283);
+            raw->exec("UPDATE data SET data = CAST('123456780' AS BLOB) WHERE id = " + std::to_string(id));
+        });
+
+        ASSERT_EQ(fs.read("copy.txt"), content);
+        ASSERT_TRUE(fs.read("test.txt").empty());
+        ASSERT_EQ(fs.errorCode(), SQLiteFSError::CORRUPTED);
+        ASSERT_EQ(fs.tryRead("test.txt").error(), SQLiteFSError::CORRUPTED);
+        fs.error();
+
+        for (unsigned threads : {1U, 4U}) {
+            auto check = fs.fsck(threads);
+            ASSERT_EQ(fs.errorCode(), SQLiteFSError::NONE);
+            ASSERT_EQ(check.files, 2);
+            ASSERT_EQ(check.unchecked, 0);
+            ASSERT_EQ(check.corrupted, std::vector<std::string>{"/test.txt"});
+        }
+    }
+
+    // every second read is checked
+    {
+        SQLiteFS fs(db_path, "password", {.verify = Verify::SAMPLED, .verify_sample = 2});
+        ASSERT_FALSE(fs.tryRead("test.txt"));
+        ASSERT_TRUE(fs.tryRead("test.txt"));
+
+        // the checksums stay once created
+        ASSERT_TRUE(fs.write("new.txt", content));
+        ASSERT_EQ(fs.fsck().files, 3);
+    }
+
+    // the worker connections are opened the same way as the main one
+    {
+        SQLiteFS fs(db_path, "password", {.immutable = true});
+        auto     check = fs.fsck(4);
+        ASSERT_EQ(fs.errorCode(), SQLiteFSError::NONE);
+        ASSERT_EQ(check.files, 3);
+        ASSERT_EQ(check.corrupted, std::vector<std::string>{"/test.txt"});
+    }
+}
+
+
+TEST_F(FSFixture, Update) {
+    using Op     = SQLiteFSChange::Op;
+    using Verify = SQLiteFS::Options::Verify;
+
+    std::vector<char> content(256 * 1024); // NOLINT
+    std::uint64_t     seed = 42;           // NOLINT
+    for (auto& c : content) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL; // NOLINT
+        c    = static_cast<char>(seed >> 56);                          // NOLINT
+    }
+    std::string       data("random test data");
+    std::vector<char> small(data.begin(), data.end());
+
+    db.reset();
+    RawFS fs(db_path,
+             "password",
+             {.change_journal = true, .checksums = true, .verify = Verify::ALWAYS, .update_chunk_size = 4096});
+
+    auto chunks = [&] {
+        int count = 0;
+        fs.rawCall([&](SQLite::Database* raw) { count = raw->execAndGet("SELECT count(*) FROM chunk").getInt(); });
+        return count;
+    };
+
+    ASSERT_TRUE(fs.update("big.bin", content));
+    ASSERT_EQ(fs.read("big.bin"), content);
+    int stored = chunks();
+    ASSERT_GT(stored, 16);
+
+    // an insertion in the middle rewrites only the chunks around it
+    auto edited = content;
+    edited.insert(edited.begin() + 100000, small.begin(), small.end()); // NOLINT
+    ASSERT_TRUE(fs.update("big.bin", edited));
+    ASSERT_EQ(fs.read("big.bin"), edited);
+    ASSERT_LE(chunks(), stored + 3);
+    ASSERT_EQ(fs.stat("big.bin")->size_raw, edited.size());
+    ASSERT_EQ(fs.du("/")->size_raw, edited.size());
+
+    ASSERT_TRUE(fs.update("big.bin", content));
+    ASSERT_EQ(chunks(), stored);
+
+    // a matching hash alone does not make a chunk reusable
+    auto forged = [&] {
+        int count = 0;
+        fs.rawCall([&](SQLite::Database* raw) {
+            count = raw->execAndGet("SELECT count(*) FROM chunk WHERE digest = zeroblob(32)").getInt();
+        });
+        return count;
+    };
+    fs.rawCall([](SQLite::Database* raw) { raw->exec("UPDATE chunk SET digest = zeroblob(32)"); });
+    ASSERT_EQ(forged(), stored);
+    ASSERT_TRUE(fs.update("big.bin", edited));
+    ASSERT_EQ(fs.read("big.bin"), edited);
+    ASSERT_EQ(forged(), 0);
+    ASSERT_TRUE(fs.update("big.bin", content));
+    ASSERT_EQ(chunks(), stored);
+
+    {
+        auto view = fs.readView("big.bin");
+        ASSERT_TRUE(view);
+        ASSERT_TRUE(std::ranges::equal(view.data(), content));
+    }
+    std::pmr::monotonic_buffer_resource arena;
+    ASSERT_TRUE(std::ranges::equal(fs.read("big.bin", &arena), content));
+
+    // copies get their own chunks, a plain file turns into chunks on its first update
+    ASSERT_TRUE(fs.cp("big.bin", "copy.bin"));
+    ASSERT_EQ(chunks(), stored * 2);
+    ASSERT_TRUE(fs.write("small.txt", small));
+    ASSERT_FALSE(fs.write("small.txt", small));
+    ASSERT_TRUE(fs.update("small.txt", content));
+    ASSERT_EQ(fs.read("small.txt"), content);
+    ASSERT_EQ(fs.du("/")->files, 3);
+    ASSERT_EQ(fs.du("/")->size_raw, content.size() * 3);
+
+    auto check = fs.fsck();
+    ASSERT_EQ(check.files, 3);
+    ASSERT_TRUE(check.corrupted.empty());
+
+    auto reverse = [](SQLiteFS::DataInput in) { return SQLiteFS::DataOutput(in.rbegin(), in.rend()); };
+    fs.registerSaveFunc("reverse", reverse);
+    fs.registerLoadFunc("reverse", reverse);
+    ASSERT_TRUE(fs.update("copy.bin", edited, "reverse"));
+    ASSERT_EQ(fs.read("copy.bin"), edited);
+    ASSERT_EQ(fs.stat("copy.bin")->compression, "reverse");
+
+    // replicas get only the chunks they miss
+    std::string replica_path = "replica.db";
+    ASSERT_TRUE(fs.replicate(replica_path));
+    ASSERT_TRUE(fs.update("big.bin", edited));
+    ASSERT_TRUE(fs.update("small.txt", small));
+    ASSERT_TRUE(fs.replicate(replica_path));
+    {
+        SQLiteFS replica(replica_path, "", {.read_only = true, .verify = Verify::ALWAYS});
+        replica.registerLoadFunc("reverse", reverse);
+        ASSERT_EQ(replica.read("big.bin"), edited);
+        ASSERT_EQ(replica.read("copy.bin"), edited);
+        ASSERT_EQ(replica.read("small.txt"), small);
+        ASSERT_EQ(replica.du("/"), fs.du("/"));
+        ASSERT_TRUE(replica.fsck().corrupted.empty());
+    }
+    std::filesystem::remove(replica_path);
+
+    auto changes = fs.changesSince(0);
+    ASSERT_EQ(changes[0].op, Op::WRITE);
+    ASSERT_EQ(changes[1].op, Op::UPDATE);
+    ASSERT_EQ(changes[1].size, edited.size());
+
+    ASSERT_TRUE(fs.rm("big.bin"));
+    ASSERT_TRUE(fs.rm("copy.bin"));
+    ASSERT_TRUE(fs.rm("small.txt"));
+    ASSERT_EQ(chunks(), 0);
+    ASSERT_FALSE(fs.update("missing/test.txt", small));
+    ASSERT_EQ(fs.errorCode(), SQLiteFSError::NOT_FOUND);
+}
+
+
+TEST_F(FSFixture, Versions) {
+    std::vector<char> content(64 * 1024); // NOLINT
+    std::uint64_t     seed = 7;           // NOLINT
+    for (auto& c : content) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL; // NOLINT
+        c    = static_cast<char>(seed >> 56);                          // NOLINT
+    }
+    std::string       data("random test data");
+    std::vector<char> small(data.begin(), data.end());
+
+    std::vector<std::vector<char>> edits{content, content, content, content};
+    for (std::size_t i = 1; i < edits.size(); ++i) {
+        edits[i].insert(edits[i].begin() + static_cast<std::ptrdiff_t>(i * 10000), small.begin(), small.end());
+    }
+
+    auto reverse = [](SQLiteFS::DataInput in) { return SQLiteFS::DataOutput(in.rbegin(), in.rend()); };
+
+    db.reset();
+    RawFS fs(db_path, "password", {.change_journal = true, .update_chunk_size = 4096, .keep_versions = 2});
+    fs.registerSaveFunc("reverse", reverse);
+    fs.registerLoadFunc("reverse", reverse);
+
+    auto count = [&](const std::string& table) {
+        int result = 0;
+        fs.rawCall([&](SQLite::Database* raw) { result = raw->execAndGet("SELECT count(*) FROM " + table).getInt(); });
+        return result;
+    };
+
+    // the written blob becomes the first version
+    ASSERT_TRUE(fs.write("test.bin", edits[0]));
+    ASSERT_TRUE(fs.versions("test.bin").empty());
+    ASSERT_TRUE(fs.update("test.bin", edits[1]));
+    int chunks = count("chunk");
+    ASSERT_TRUE(fs.update("test.bin", edits[2]));
+    ASSERT_LE(count("chunk"), chunks + 3);
+    ASSERT_TRUE(fs.update("test.bin", edits[3], "reverse"));
+
+    auto versions = fs.versions("test.bin");
+    ASSERT_EQ(versions.size(), 2);
+    ASSERT_EQ(versions[0].version, 2);
+    ASSERT_EQ(versions[1].version, 3);
+    ASSERT_EQ(versions[1].size_raw, edits[2].size());
+    ASSERT_EQ(versions[1].compression, "raw");
+    ASSERT_GT(versions[1].time, 0);
+
+    ASSERT_EQ(fs.read("test.bin"), edits[3]);
+    ASSERT_EQ(*fs.readVersion("test.bin", 2), edits[1]);
+    ASSERT_EQ(*fs.readVersion("test.bin", 3), edits[2]);
+    ASSERT_EQ(fs.readVersion("test.bin", 1).error(), SQLiteFSError::NOT_FOUND);
+    ASSERT_EQ(fs.readVersion("missing.bin", 2).error(), SQLiteFSError::NOT_FOUND);
+    fs.error();
+
+    // replicas get the history, copies don't
+    std::string replica_path = "replica.db";
+    ASSERT_TRUE(fs.replicate(replica_path));
+    ASSERT_TRUE(fs.update("test.bin", edits[0]));
+    ASSERT_TRUE(fs.replicate(replica_path));
+    {
+        SQLiteFS replica(replica_path, "", {.read_only = true});
+        replica.registerLoadFunc("reverse", reverse);
+        ASSERT_EQ(replica.versions("test.bin"), fs.versions("test.bin"));
+        ASSERT_EQ(*replica.readVersion("test.bin", 4), edits[3]);
+        ASSERT_EQ(replica.read("test.bin"), edits[0]);
+    }
+    std::filesystem::remove(replica_path);
+
+    ASSERT_TRUE(fs.cp("test.bin", "copy.bin"));
+    ASSERT_TRUE(fs.versions("copy.bin").empty());
+    ASSERT_EQ(fs.read("copy.bin"), edits[0]);
+
+    // a kept blob is hashed like any chunk, so going back to it reuses it
+    ASSERT_TRUE(fs.write("small.txt", small));
+    ASSERT_TRUE(fs.update("small.txt", std::vector<char>(small.rbegin(), small.rend())));
+    chunks = count("chunk");
+    ASSERT_TRUE(fs.update("small.txt", small));
+    ASSERT_EQ(count("chunk"), chunks);
+    ASSERT_EQ(fs.read("small.txt"), small);
+    ASSERT_TRUE(fs.rm("small.txt"));
+
+    ASSERT_TRUE(fs.rm("test.bin"));
+    ASSERT_TRUE(fs.rm("copy.bin"));
+    ASSERT_EQ(count("chunk"), 0);
+    ASSERT_EQ(count("version"), 0);
+    ASSERT_EQ(count("version_list"), 0);
+}
+
+
+TEST_F(FSFixture, Recompress) {
+    std::string       data("random test data");
+    std::vector<char> content(data.begin(), data.end());
+    std::vector<char> big(4096, 'x'); // NOLINT
+    std::string       plain_path = "plain.db";
+    std::string       blobs      = plain_path + ".blobs";
+
+    // pad keeps the data as is and adds 4 bytes
+    auto pad = [](SQLiteFS::DataInput in) {
+        SQLiteFS::DataOutput out(in.begin(), in.end());
+        out.insert(out.end(), 4, '\0');
+        return out;
+    };
+    auto unpad = [](SQLiteFS::DataInput in) { return SQLiteFS::DataOutput(in.begin(), in.end() - 4); };
+
+    {
+        SQLiteFS fs(plain_path, "", {.change_journal = true, .sidecar_threshold = 1024, .checksums = true});
+        fs.registerSaveFunc("pad", pad);
+        fs.registerLoadFunc("pad", unpad);
+        auto codecs = fs.codecs();
+        ASSERT_TRUE(std::ranges::find(codecs, "pad") != codecs.end());
+        ASSERT_TRUE(std::ranges::find(codecs, "raw") != codecs.end());
+
+        ASSERT_TRUE(fs.mkdir("f1"));
+        ASSERT_TRUE(fs.mkdir("f2"));
+        ASSERT_TRUE(fs.write("f1/a.txt", content));
+        ASSERT_TRUE(fs.write("f1/big.bin", big));
+        ASSERT_TRUE(fs.write("f2/c.txt", content));
+        ASSERT_TRUE(fs.update("f1/u.bin", content));
+        auto id = fs.stat("f1/big.bin")->id;
+        ASSERT_TRUE(std::filesystem::exists(blobs + "/" + std::to_string(id)));
+
+        // at least one file is done whatever the budget
+        ASSERT_EQ(fs.recompress("f1", "pad", 1), 1);
+        ASSERT_EQ(fs.recompress("f1", "pad"), 1);
+        ASSERT_EQ(fs.recompress("f1", "pad"), 0);
+        ASSERT_EQ(fs.stat("f1/a.txt")->compression, "pad");
+        ASSERT_EQ(fs.stat("f1/a.txt")->size, content.size() + 4);
+        ASSERT_EQ(fs.stat("f1/big.bin")->compression, "pad");
+        ASSERT_EQ(fs.stat("f1/u.bin")->compression, "raw");
+        ASSERT_EQ(fs.stat("f2/c.txt")->compression, "raw");
+
+        ASSERT_EQ(fs.read("f1/a.txt"), content);
+        ASSERT_EQ(fs.read("f1/big.bin"), big);
+        ASSERT_FALSE(std::filesystem::exists(blobs + "/" + std::to_string(id)));
+        ASSERT_TRUE(std::filesystem::exists(blobs + "/" + std::to_string(id) + "-pad"));
+        ASSERT_EQ(fs.du("f1")->size, content.size() * 2 + big.size() + 8);
+        ASSERT_EQ(fs.du("/")->size, content.size() * 3 + big.size() + 8);
+        ASSERT_TRUE(fs.fsck().corrupted.empty());
+        ASSERT_EQ(fs.changesSince(0).back().op, SQLiteFSChange::Op::UPDATE);
+
+        ASSERT_EQ(fs.recompress("/", "missing"), 0);
+        ASSERT_EQ(fs.errorCode(), SQLiteFSError::NOT_FOUND);
+        fs.error();
+    }
+
+    // the background worker takes the rest while the fs is idle
+    {
+        SQLiteFS fs(plain_path,
+                    "",
+                    {.recompress_alg      = "pad",
+                     .recompress_interval = std::chrono::milliseconds(1),
+                     .recompress_bytes    = 1,
+                     .recompress_idle     = std::chrono::milliseconds(5)});
+        fs.registerSaveFunc("pad", pad);
+        fs.registerLoadFunc("pad", unpad);
+        for (int i = 0; i < 100 && fs.stat("f2/c.txt")->compression != "pad"; ++i) { // NOLINT
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));              // NOLINT
+        }
+        ASSERT_EQ(fs.stat("f2/c.txt")->compression, "pad");
+        ASSERT_EQ(fs.read("f2/c.txt"), content);
+        ASSERT_EQ(fs.workerErrors(), 0);
+    }
+
+    // a busy fs isn't recompressed, failures of the worker don't change error()
+    {
+        std::mutex                                         mutex;
+        std::vector<std::pair<SQLiteFSError, std::string>> failures;
+
+        SQLiteFS fs(plain_path,
+                    "",
+                    {.recompress_alg      = "unpad",
+                     .recompress_interval = std::chrono::milliseconds(1),
+                     .recompress_idle     = std::chrono::milliseconds(50)});
+        fs.setWorkerErrorCallback([&](SQLiteFSError code, const std::string& message) {
+            std::lock_guard lock(mutex);
+            failures.emplace_back(code, message);
+        });
+        fs.registerSaveFunc("unpad", unpad);
+        for (int i = 0; i < 50; ++i) { // NOLINT
+            ASSERT_TRUE(fs.exists("f2/c.txt"));
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+        ASSERT_EQ(fs.workerErrors(), 0);
+
+        // pad has no load func here
+        for (int i = 0; i < 100 && fs.workerErrors() == 0; ++i) { // NOLINT
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        ASSERT_GT(fs.workerErrors(), 0);
+        ASSERT_EQ(fs.errorCode(), SQLiteFSError::NONE);
+        ASSERT_EQ(fs.stat("f2/c.txt")->compression, "pad");
+        std::lock_guard lock(mutex);
+        ASSERT_EQ(failures.front().first, SQLiteFSError::NOT_FOUND);
+        ASSERT_EQ(failures.front().second, "Unknown codec pad");
+    }
+
+    // a broken file first in line takes no budget and doesn't stop the rest
+    {
+        RawFS fs(plain_path, "");
+        fs.registerSaveFunc("pad", pad);
+        fs.registerLoadFunc("pad", unpad);
+        ASSERT_TRUE(fs.mkdir("f3"));
+        ASSERT_TRUE(fs.write("f3/0-broken.txt", content));
+        ASSERT_TRUE(fs.write("f3/a.txt", content));
+        ASSERT_TRUE(fs.write("f3/b.txt", content));
+        auto id = fs.stat("f3/0-broken.txt")->id;
+        fs.rawCall([&](SQLite::Database* raw) {
+            raw->exec("UPDATE data SET data = CAST('broken' AS BLOB) WHERE id = " + std::to_string(id));
+        });
+
+        ASSERT_EQ(fs.recompress("f3", "pad", 1), 1);
+        ASSERT_EQ(fs.stat("f3/a.txt")->compression, "pad");
+        ASSERT_EQ(fs.recompress("f3", "pad", 1), 1);
+        ASSERT_EQ(fs.stat("f3/b.txt")->compression, "pad");
+        ASSERT_EQ(fs.recompress("f3", "pad", 1), 0);
+        ASSERT_EQ(fs.stat("f3/0-broken.txt")->compression, "raw");
+        fs.error();
+    }
+
+    std::filesystem::remove(plain_path);
+    std::filesystem::remove_all(blobs);
+}
+
+
+TEST_F(FSFixture, QueryStats) {
+    std::string       data("random test data");
+    std::vector<char> content(data.begin(), data.end());
+    std::string       stats_path = "stats.db";
+
+    {
+        SQLiteFS fs(stats_path, "", {.query_stats = true, .slow_query_threshold = std::chrono::microseconds(1)});
+
+        // the stats can be read from the callback
+        std::vector<SQLiteFSQueryStats> slow;
+        std::size_t                     seen = 0;
+        fs.setSlowQueryCallback([&](const SQLiteFSQueryStats& run) {
+            slow.push_back(run);
+            seen = fs.queryStats().size();
+        });
+
+        ASSERT_TRUE(fs.mkdir("f1"));
+        for (int i = 0; i < 10; ++i) { // NOLINT
+            ASSERT_TRUE(fs.write("f1/" + std::to_string(i), content));
+        }
+        ASSERT_EQ(fs.ls("f1").size(), 10);
+
+        auto stats = fs.queryStats();
+        ASSERT_FALSE(stats.empty());
+        ASSERT_TRUE(std::ranges::is_sorted(stats, std::greater{}, &SQLiteFSQueryStats::time));
+        ASSERT_TRUE(std::ranges::all_of(stats, [](const auto& query) {
+            return !query.sql.empty() && query.calls > 0 && query.max_time <= query.time;
+        }));
+        // every write runs the same statements, so some of them are counted 10 times
+        ASSERT_TRUE(std::ranges::any_of(stats, [](const auto& query) { return query.calls >= 10; }));
+        ASSERT_TRUE(std::ranges::any_of(stats, [](const auto& query) { return query.vm_steps > 0; }));
+
+        ASSERT_FALSE(slow.empty());
+        ASSERT_TRUE(std::ranges::all_of(slow, [](const auto& run) {
+            return run.calls == 1 && run.time >= std::chrono::microseconds(1);
+        }));
+        ASSERT_GT(seen, 0);
+
+        fs.resetQueryStats();
+        ASSERT_TRUE(fs.queryStats().empty());
+    }
+
+    // off by default
+    {
+        SQLiteFS fs(stats_path);
+        ASSERT_TRUE(fs.exists("f1/0"));
+        ASSERT_TRUE(fs.queryStats().empty());
+    }
+
+    std::filesystem::remove(stats_path);
+}
+
+TEST_F(FSFixture, LockStats) {
+    std::string       data("random test data");
+    std::vector<char> content(data.begin(), data.end());
+    std::string       locks_path = "locks.db";
+
+    {
+        SQLiteFS fs(locks_path, "", {.lock_stats = true});
+        ASSERT_TRUE(fs.mkdir("f1"));
+        for (int i = 0; i < 10; ++i) { // NOLINT
+            ASSERT_TRUE(fs.write("f1/" + std::to_string(i), content));
+        }
+
+        ASSERT_TRUE(fs.mkdir("f2"));
+
+        // readers share the lock while a writer keeps adding files next to them
+        std::atomic<int>          mismatches = 0;
+        std::vector<std::jthread> threads;
+        for (int t = 0; t < 4; ++t) { // NOLINT
+            threads.emplace_back([&] {
+                for (int i = 0; i < 200; ++i) { // NOLINT
+                    if (fs.read("f1/" + std::to_string(i % 10)) != content || fs.ls("f1").size() != 10) {
+                        ++mismatches;
+                    }
+                }
+            });
+        }
+        threads.emplace_back([&] {
+            for (int i = 0; i < 50; ++i) { // NOLINT
+                if (!fs.write("f2/" + std::to_string(i), content)) {
+                    ++mismatches;
+                }
+            }
+        });
+        threads.clear();
+        ASSERT_EQ(mismatches, 0);
+
+        auto stats = fs.lockStats();
+        ASSERT_TRUE(std::ranges::is_sorted(stats, std::greater{}, &SQLiteFSLockStats::wait));
+        auto op = [&](const std::string& name) {
+            auto it = std::ranges::find(stats, name, &SQLiteFSLockStats::op);
+            return it == stats.end() ? SQLiteFSLockStats{} : *it;
+        };
+        ASSERT_GE(op("read").acquisitions, 800); // the lock is let go while the data is decoded
+        ASSERT_EQ(op("ls").acquisitions, 800);
+        ASSERT_EQ(op("write").acquisitions, 60);
+        ASSERT_EQ(op("mkdir").acquisitions, 2);
+        ASSERT_LE(op("write").contended, op("write").acquisitions);
+        ASSERT_LE(op("read").max_hold, op("read").hold);
+        ASSERT_GT(op("write").hold.count(), 0);
+
+        fs.resetLockStats();
+        ASSERT_TRUE(fs.lockStats().empty());
+    }
+
+    // off by default
+    {
+        SQLiteFS fs(locks_path);
+        ASSERT_EQ(fs.read("f1/0"), content);
+        ASSERT_TRUE(fs.lockStats().empty());
+    }
+
+    std::filesystem::remove(locks_path);
+}
+
+TEST(Sharded, Sharded) {
+    std::string                    data("random test data");
+    std::vector<char>              content(data.begin(), data.end());
+    const std::vector<std::string> paths{"shard0.db", "shard1.db", "shard2.db", "shard3.db"};
+
+    {
+        ShardedSQLiteFS fs(paths);
+        ASSERT_EQ(fs.shards(), paths.size());
+
+        std::vector<std::string> folders;
+        std::vector<std::size_t> used(paths.size());
+        for (char name = 'a'; name <= 'p'; ++name) {
+            folders.emplace_back(1, name);
+            ASSERT_TRUE(fs.mkdir(folders.back()));
+            ASSERT_TRUE(fs.shard(fs.shardOf(folders.back())).exists(folders.back()));
+            ++used[fs.shardOf(folders.back())];
+        }
+        ASSERT_TRUE(std::ranges::count(used, 0) < 2);
+
+        // shards are written in parallel
+        std::vector<std::thread> writers;
+        for (const auto& folder : folders) {
+            writers.emplace_back([&, folder] { ASSERT_TRUE(fs.write(folder + "/test.txt", content)); });
+        }
+        for (auto& writer : writers) {
+            writer.join();
+        }
+
+        auto root = fs.ls("/");
+        ASSERT_EQ(root.size(), folders.size());
+        ASSERT_TRUE(std::ranges::is_sorted(root, {}, &SQLiteFSNode::name));
+        ASSERT_EQ(fs.du("/")->files, std::int64_t(folders.size()));
+
+        ASSERT_TRUE(fs.cd("a"));
+        ASSERT_EQ(fs.pwd(), "/a");
+        ASSERT_EQ(fs.read("test.txt"), content);
+        ASSERT_EQ(fs.read("../b/test.txt"), content);
+
+        // the first folder on another shard
+        auto other = *std::ranges::find_if(folders,
+                                           [&](const auto& f) { return fs.shardOf("/" + f) != fs.shardOf("/a"); });
+        ASSERT_TRUE(fs.mkdir("inner"));
+        ASSERT_TRUE(fs.write("inner/test.txt", content));
+        ASSERT_TRUE(fs.cd("inner"));
+        ASSERT_TRUE(fs.cp("test.txt", "/" + other + "/copy.txt"));
+        ASSERT_EQ(fs.read("/" + other + "/copy.txt"), content);
+        ASSERT_FALSE(fs.cp("test.txt", "/" + other + "/copy.txt"));
+
+        // folders are copied the same way on one shard and across shards
+        ASSERT_TRUE(fs.cp("/a/inner", "/a/copy"));
+        ASSERT_TRUE(fs.cp("/a/inner", "/" + other + "/copy"));
+        ASSERT_EQ(fs.read("/a/copy/test.txt"), content);
+        ASSERT_EQ(fs.read("/" + other + "/copy/test.txt"), content);
+        ASSERT_FALSE(fs.cp("/a/inner", "/a/copy"));
+        ASSERT_FALSE(fs.cp("/a/inner", "/" + other + "/copy"));
+        ASSERT_FALSE(fs.cp("/a/inner", "/a/inner/deeper"));
+        ASSERT_TRUE(fs.rm("/a/copy"));
+        ASSERT_TRUE(fs.rm("/" + other + "/copy"));
+
+        ASSERT_TRUE(fs.mv("/a/inner", "/" + other + "/"));
+        ASSERT_EQ(fs.pwd(), "/" + other + "/inner");
+        ASSERT_FALSE(fs.exists("/a/inner"));
+        ASSERT_EQ(fs.read("test.txt"), content);
+        ASSERT_EQ(fs.du("/")->files, std::int64_t(folders.size() + 2));
+
+        ASSERT_TRUE(fs.rm("/" + other));
+        ASSERT_EQ(fs.pwd(), "/");
+        ASSERT_FALSE(fs.rm("/"));
+        ASSERT_EQ(fs.ls().size(), folders.size() - 1);
+    }
+
+    // the layout depends only on the order of files
+    {
+        ShardedSQLiteFS fs(paths);
+        ASSERT_EQ(fs.read("/a/test.txt"), content);
+        ASSERT_EQ(fs.du("/")->files, std::int64_t(fs.ls().size()));
+    }
+
+    for (const auto& path : paths) {
+        std::filesystem::remove(path);
+    }
+}
+
+
 TEST(Manual, manual) {
     std::string db_path = "./manual_test.db";
     std::filesystem::remove(db_path);
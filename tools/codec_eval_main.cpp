@@ -0,0 +1,477 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <sqlitefs/sqlitefs.h>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// samples files of an existing fs and runs every registered codec on them.
+// Prints ratio, save/load speed and peak memory per codec, file size bucket and top level folder.
+// Every codec and size bucket runs in its own child process, so the peak is its max RSS over the pages it
+// started with and includes malloc inside the codec libraries. There is no peak on Windows
+//
+// sqlitefs_codec_eval <db> [--key KEY] [--path PATH] [--samples N] [--threads N] [--codecs a,b] [--seed N]
+
+namespace {
+
+struct Args {
+    std::string              db;
+    std::string              key;
+    std::string              path    = "/";
+    std::size_t              samples = 200;  // NOLINT
+    unsigned                 threads = std::max(std::thread::hardware_concurrency(), 1U);
+    std::vector<std::string> codecs;
+    std::uint32_t            seed = 1;
+};
+
+struct Sample {
+    std::string          folder; // see topFolder
+    SQLiteFS::DataOutput data;
+};
+
+struct Totals {
+    std::int64_t files  = 0;
+    std::int64_t raw    = 0;
+    std::int64_t packed = 0;
+    double       save_s = 0;
+    double       load_s = 0;
+    std::int64_t errors = 0; // load didn't give the same data back
+
+    void add(const Totals& other) {
+        files  += other.files;
+        raw    += other.raw;
+        packed += other.packed;
+        save_s += other.save_s;
+        load_s += other.load_s;
+        errors += other.errors;
+    }
+};
+
+// by group order and name. All files come first, size buckets go from the smallest
+using Group  = std::pair<int, std::string>;
+using Report = std::map<Group, Totals>;
+
+void usage() {
+    std::fprintf(stderr,
+                 "usage: sqlitefs_codec_eval <db> [--key KEY] [--path PATH] [--samples N] [--threads N] "
+                 "[--codecs a,b] [--seed N]\n");
+}
+
+bool parse(int argc, char** argv, Args& args) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (!arg.starts_with("--")) {
+            args.db = arg;
+            continue;
+        }
+        if (i + 1 == argc) {
+            return false;
+        }
+
+        std::string value = argv[++i];
+        if (arg == "--key") {
+            args.key = value;
+        } else if (arg == "--path") {
+            args.path = value;
+        } else if (arg == "--samples") {
+            args.samples = std::stoul(value);
+        } else if (arg == "--threads") {
+            args.threads = std::max(static_cast<unsigned>(std::stoul(value)), 1U);
+        } else if (arg == "--codecs") {
+            for (std::size_t start = 0; start <= value.size();) {
+                auto end = std::min(value.find(',', start), value.size());
+                if (end > start) {
+                    args.codecs.push_back(value.substr(start, end - start));
+                }
+                start = end + 1;
+            }
+        } else if (arg == "--seed") {
+            args.seed = static_cast<std::uint32_t>(std::stoul(value));
+        } else {
+            return false;
+        }
+    }
+    return !args.db.empty();
+}
+
+Group bucket(std::size_t size) {
+    constexpr std::size_t KiB = 1024;
+
+    if (size < 4 * KiB) {
+        return {0, "<4K"};
+    }
+    if (size < 64 * KiB) {
+        return {1, "4K-64K"};
+    }
+    if (size < KiB * KiB) {
+        return {2, "64K-1M"};
+    }
+    if (size < 16 * KiB * KiB) {
+        return {3, "1M-16M"};
+    }
+    return {4, ">=16M"}; // NOLINT
+}
+
+// reservoir sample of the files under path, every file has the same chance
+std::vector<std::string> sampleFiles(const SQLiteFS& fs, const Args& args) {
+    std::vector<std::string> picked;
+    std::mt19937             random(args.seed);
+    std::size_t              seen = 0;
+
+    std::vector<std::string> folders{args.path};
+    while (!folders.empty()) {
+        auto folder = std::move(folders.back());
+        folders.pop_back();
+
+        auto prefix = folder.ends_with('/') ? folder : folder + "/";
+        for (const auto& node : fs.ls(folder)) {
+            auto path = prefix + node.name;
+            if (!(node.attributes & SQLiteFSNode::Attributes::FILE)) {
+                folders.push_back(std::move(path));
+                continue;
+            }
+
+            if (picked.size() < args.samples) {
+                picked.push_back(std::move(path));
+            } else if (auto slot = std::uniform_int_distribution<std::size_t>(0, seen)(random); slot < args.samples) {
+                picked[slot] = std::move(path);
+            }
+            ++seen;
+        }
+    }
+    return picked;
+}
+
+// "/name" of the folder under root the file is in, "/" for files right in root
+std::string topFolder(const std::string& root, const std::string& path) {
+    auto rest = std::string_view(path).substr(root.ends_with('/') ? root.size() : root.size() + 1);
+    auto end  = rest.find('/');
+    return end == std::string_view::npos ? "/" : "/" + std::string(rest.substr(0, end));
+}
+
+// every thread takes the next sample, results are merged at the end
+void run(SQLiteFS&                  fs,
+         const std::string&         codec,
+         const std::vector<Sample>& samples,
+         unsigned                   threads,
+         Report&                    by_size,
+         Report&                    by_folder) {
+    using Clock = std::chrono::steady_clock;
+
+    std::atomic<std::size_t> next = 0;
+    std::mutex               merge_mutex;
+
+    auto worker = [&] {
+        Report local_size;
+        Report local_folder;
+        for (auto i = next++; i < samples.size(); i = next++) {
+            const auto& sample = samples[i];
+
+            auto start  = Clock::now();
+            auto packed = fs.callSaveFunc(codec, sample.data);
+            auto saved  = Clock::now();
+            auto loaded = fs.callLoadFunc(codec, packed);
+            auto end    = Clock::now();
+
+            Totals totals{
+              .files  = 1,
+              .raw    = std::ssize(sample.data),
+              .packed = std::ssize(packed),
+              .save_s = std::chrono::duration<double>(saved - start).count(),
+              .load_s = std::chrono::duration<double>(end - saved).count(),
+              .errors = loaded == sample.data ? 0 : 1,
+            };
+            local_size[{-1, "all"}].add(totals);
+            local_size[bucket(sample.data.size())].add(totals);
+            local_folder[{0, sample.folder}].add(totals);
+        }
+
+        std::lock_guard lock(merge_mutex);
+        for (const auto& [name, totals] : local_size) {
+            by_size[name].add(totals);
+        }
+        for (const auto& [name, totals] : local_folder) {
+            by_folder[name].add(totals);
+        }
+    };
+
+    std::vector<std::jthread> pool;
+    for (unsigned i = 0; i < threads; ++i) {
+        pool.emplace_back(worker);
+    }
+}
+
+// results of one child, see measure
+struct Pass {
+    Report                      by_size;
+    Report                      by_folder;
+    std::optional<std::int64_t> peak; // bytes
+};
+
+#ifndef _WIN32
+void put(std::string& out, const void* data, std::size_t size) {
+    out.append(static_cast<const char*>(data), size);
+}
+
+bool get(std::string_view& in, void* data, std::size_t size) {
+    if (in.size() < size) {
+        return false;
+    }
+    std::memcpy(data, in.data(), size);
+    in.remove_prefix(size);
+    return true;
+}
+
+// reports go through a pipe as plain bytes, both ends are the same binary
+std::string serialize(const Report& report) {
+    std::string out;
+    auto        count = report.size();
+    put(out, &count, sizeof(count));
+    for (const auto& [group, totals] : report) {
+        auto size = group.second.size();
+        put(out, &group.first, sizeof(group.first));
+        put(out, &size, sizeof(size));
+        put(out, group.second.data(), size);
+        put(out, &totals, sizeof(totals));
+    }
+    return out;
+}
+
+bool deserialize(std::string_view& in, Report& report) {
+    std::size_t count = 0;
+    if (!get(in, &count, sizeof(count))) {
+        return false;
+    }
+    for (std::size_t i = 0; i < count; ++i) {
+        Group       group;
+        std::size_t size = 0;
+        Totals      totals;
+        if (!get(in, &group.first, sizeof(group.first)) || !get(in, &size, sizeof(size)) || in.size() < size) {
+            return false;
+        }
+        group.second = std::string(in.substr(0, size));
+        in.remove_prefix(size);
+        if (!get(in, &totals, sizeof(totals))) {
+            return false;
+        }
+        report[group].add(totals);
+    }
+    return true;
+}
+
+// runs task in a child process, returns what it wrote and its max RSS in bytes
+std::optional<std::pair<std::string, std::int64_t>> forked(const std::function<std::string()>& task) {
+    std::array<int, 2> fds{};
+    if (pipe(fds.data()) != 0) {
+        return std::nullopt;
+    }
+
+    auto pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return std::nullopt;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        auto        out  = task();
+        const char* data = out.data();
+        for (auto left = out.size(); left > 0;) {
+            auto written = write(fds[1], data, left);
+            if (written <= 0) {
+                std::_Exit(EXIT_FAILURE);
+            }
+            data += written;
+            left -= static_cast<std::size_t>(written);
+        }
+        std::_Exit(EXIT_SUCCESS);
+    }
+
+    // read before waiting, the child blocks on a full pipe
+    close(fds[1]);
+    std::string            out;
+    std::array<char, 4096> buffer{}; // NOLINT
+    for (ssize_t got = 0; (got = read(fds[0], buffer.data(), buffer.size())) > 0;) {
+        out.append(buffer.data(), static_cast<std::size_t>(got));
+    }
+    close(fds[0]);
+
+    int    status = 0;
+    rusage usage{};
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        return std::nullopt;
+    }
+#ifdef __APPLE__
+    const std::int64_t unit = 1; // bytes
+#else
+    const std::int64_t unit = 1024; // KiB
+#endif
+    return std::pair{std::move(out), static_cast<std::int64_t>(usage.ru_maxrss) * unit};
+}
+#endif
+
+// the pass of a codec over samples. A child starts with the pages of the parent, baseline is the max RSS of
+// a child that does nothing
+Pass measure(SQLiteFS&                     fs,
+             const std::string&            codec,
+             const std::vector<Sample>&    samples,
+             unsigned                      threads,
+             [[maybe_unused]] std::int64_t baseline) {
+    Pass pass;
+#ifndef _WIN32
+    auto result = forked([&] {
+        Pass local;
+        run(fs, codec, samples, threads, local.by_size, local.by_folder);
+        return serialize(local.by_size) + serialize(local.by_folder);
+    });
+    std::string_view in = result ? std::string_view{result->first} : std::string_view{};
+    if (result && deserialize(in, pass.by_size) && deserialize(in, pass.by_folder)) {
+        pass.peak = std::max<std::int64_t>(result->second - baseline, 0);
+        return pass;
+    }
+    pass = {};
+#endif
+    // without fork the pass runs here and has no peak
+    run(fs, codec, samples, threads, pass.by_size, pass.by_folder);
+    return pass;
+}
+
+std::int64_t baselinePeak() {
+#ifndef _WIN32
+    if (auto result = forked([] { return std::string{}; }); result) {
+        return result->second;
+    }
+#endif
+    return 0;
+}
+
+void print(const std::string& codec, const Report& report, const std::map<Group, std::int64_t>& peaks) {
+    constexpr double MiB = 1024.0 * 1024.0;
+
+    for (const auto& [group, totals] : report) {
+        // measured per size bucket only, a folder mixes them
+        std::array<char, 32> peak{"-"}; // NOLINT
+        if (auto it = peaks.find(group); it != peaks.end()) {
+            std::snprintf(peak.data(), peak.size(), "%.2f", static_cast<double>(it->second) / MiB);
+        }
+
+        // speed is per thread: bytes over the time spent in the funcs
+        std::printf("%-8s %-16s %6lld %10.2f %7.3f %10.1f %10.1f %10s %6lld\n",
+                    codec.c_str(),
+                    group.second.c_str(),
+                    static_cast<long long>(totals.files),
+                    static_cast<double>(totals.raw) / MiB,
+                    totals.packed > 0 ? static_cast<double>(totals.raw) / static_cast<double>(totals.packed) : 0.0,
+                    totals.save_s > 0 ? static_cast<double>(totals.raw) / MiB / totals.save_s : 0.0,
+                    totals.load_s > 0 ? static_cast<double>(totals.raw) / MiB / totals.load_s : 0.0,
+                    peak.data(),
+                    static_cast<long long>(totals.errors));
+    }
+}
+
+} // namespace
+
+
+int main(int argc, char** argv) {
+    Args args;
+    try {
+        if (!parse(argc, argv, args)) {
+            usage();
+            return EXIT_FAILURE;
+        }
+    } catch (std::exception&) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    SQLiteFS fs(args.db, args.key, {.read_only = true});
+    auto     known = fs.codecs();
+    if (args.codecs.empty()) {
+        args.codecs = known;
+    }
+    for (const auto& codec : args.codecs) {
+        if (std::ranges::find(known, codec) == known.end()) {
+            std::fprintf(stderr, "unknown codec %s\n", codec.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<Sample> samples;
+    std::size_t         unreadable = 0;
+    for (const auto& path : sampleFiles(fs, args)) {
+        // a file stored with a codec that isn't built in can't be read
+        auto data = fs.tryRead(path);
+        if (!data) {
+            ++unreadable;
+            continue;
+        }
+        samples.push_back({.folder = topFolder(args.path, path), .data = std::move(data).value()});
+    }
+    fs.error();
+
+    std::printf("%zu files sampled from %s, %zu unreadable, %u threads\n",
+                samples.size(),
+                args.path.c_str(),
+                unreadable,
+                args.threads);
+    if (samples.empty()) {
+        return EXIT_FAILURE;
+    }
+
+    std::printf("%-8s %-16s %6s %10s %7s %10s %10s %10s %6s\n",
+                "codec",
+                "group",
+                "files",
+                "raw MiB",
+                "ratio",
+                "save MiB/s",
+                "load MiB/s",
+                "peak MiB",
+                "errors");
+    // every size bucket is a pass of its own, so it gets its own peak
+    std::map<Group, std::vector<Sample>> buckets;
+    for (auto& sample : samples) {
+        auto group = bucket(sample.data.size());
+        buckets[group].push_back(std::move(sample));
+    }
+    const auto baseline = baselinePeak();
+
+    for (const auto& codec : args.codecs) {
+        Report                        by_size;
+        Report                        by_folder;
+        std::map<Group, std::int64_t> peaks;
+        for (const auto& [group, part] : buckets) {
+            auto pass = measure(fs, codec, part, args.threads, baseline);
+            for (const auto& [name, totals] : pass.by_size) {
+                by_size[name].add(totals);
+            }
+            for (const auto& [name, totals] : pass.by_folder) {
+                by_folder[name].add(totals);
+            }
+            if (pass.peak) {
+                peaks[group]       = *pass.peak;
+                peaks[{-1, "all"}] = std::max(peaks[{-1, "all"}], *pass.peak);
+            }
+        }
+        print(codec, by_size, peaks);
+        print(codec, by_folder, peaks);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,521 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <sqlitefs/sqlitefs.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// runs a mix of operations against a fs from several threads and prints throughput and latency
+// percentiles per operation every interval and for the whole run as CSV, so runs of different releases
+// can be compared line by line
+//
+// sqlitefs_loadgen <db> [--key KEY] [--threads N] [--seconds N] [--interval MS] [--mix read=60,write=20,...]
+//                  [--sizes 4K=70,64K=25,1M=5] [--fanout N] [--depth N] [--files N] [--alg NAME]
+//                  [--journal default|delete|truncate|persist|memory|wal|off] [--seed N]
+
+namespace {
+
+enum class Op : std::uint8_t { READ, WRITE, LS, MV, RM, COUNT };
+
+constexpr std::array<const char*, static_cast<std::size_t>(Op::COUNT)> OP_NAMES{"read", "write", "ls", "mv", "rm"};
+
+struct SizeWeight {
+    std::size_t size   = 0;
+    unsigned    weight = 0;
+};
+
+struct Args {
+    std::string   db;
+    std::string   key;
+    unsigned      threads     = std::max(std::thread::hardware_concurrency(), 1U);
+    unsigned      seconds     = 10;   // NOLINT
+    unsigned      interval_ms = 1000; // NOLINT
+    unsigned      fanout      = 8;    // NOLINT
+    unsigned      depth       = 2;
+    std::size_t   files       = 1000; // NOLINT
+    std::string   alg         = "raw";
+    std::uint32_t seed        = 1;
+
+    std::array<unsigned, OP_NAMES.size()> mix{60, 20, 10, 5, 5}; // NOLINT
+    std::vector<SizeWeight>               sizes{{4096, 70}, {65536, 25}, {1048576, 5}}; // NOLINT
+
+    SQLiteFS::Options options;
+};
+
+// log-linear latency histogram in nanoseconds, under 1% error. Only the owning thread adds,
+// the reporter reads the counters while it runs
+class Histogram {
+public:
+    static constexpr unsigned    SUB_BITS = 7;
+    static constexpr std::size_t LINEAR   = std::size_t{1} << SUB_BITS;
+    static constexpr std::size_t HALF     = LINEAR / 2;
+    static constexpr std::size_t BUCKETS  = LINEAR + (64 - SUB_BITS) * HALF;
+
+    static std::size_t index(std::uint64_t value) noexcept {
+        if (value < LINEAR) {
+            return value;
+        }
+        auto shift = static_cast<unsigned>(std::bit_width(value)) - SUB_BITS;
+        return LINEAR + (shift - 1) * HALF + ((value >> shift) - HALF);
+    }
+
+    // the highest value counted in the bucket
+    static std::uint64_t value(std::size_t index) noexcept {
+        if (index < LINEAR) {
+            return index;
+        }
+        auto shift = static_cast<unsigned>((index - LINEAR) / HALF) + 1;
+        auto base  = (index - LINEAR) % HALF + HALF;
+        return ((base + 1) << shift) - 1;
+    }
+
+    void add(std::uint64_t value) noexcept {
+        m_counts[index(value)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::uint64_t count(std::size_t index) const noexcept {
+        return m_counts[index].load(std::memory_order_relaxed);
+    }
+
+private:
+    std::array<std::atomic<std::uint64_t>, BUCKETS> m_counts{};
+};
+
+struct Counters {
+    std::array<Histogram, OP_NAMES.size()>                  latency;
+    std::array<std::atomic<std::uint64_t>, OP_NAMES.size()> errors{};
+};
+
+// merged counts of all threads, interval values are the difference of two snapshots
+struct Snapshot {
+    std::vector<std::uint64_t>                 counts = std::vector<std::uint64_t>(OP_NAMES.size() * Histogram::BUCKETS);
+    std::array<std::uint64_t, OP_NAMES.size()> errors{};
+
+    void take(const std::vector<std::unique_ptr<Counters>>& all) {
+        std::ranges::fill(counts, 0);
+        errors.fill(0);
+        for (const auto& counters : all) {
+            for (std::size_t op = 0; op < OP_NAMES.size(); ++op) {
+                for (std::size_t i = 0; i < Histogram::BUCKETS; ++i) {
+                    counts[op * Histogram::BUCKETS + i] += counters->latency[op].count(i);
+                }
+                errors[op] += counters->errors[op].load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+void usage() {
+    std::fprintf(stderr,
+                 "usage: sqlitefs_loadgen <db> [--key KEY] [--threads N] [--seconds N] [--interval MS] "
+                 "[--mix read=60,write=20,ls=10,mv=5,rm=5] [--sizes 4K=70,64K=25,1M=5] [--fanout N] [--depth N] "
+                 "[--files N] [--alg NAME] [--journal MODE] [--seed N]\n");
+}
+
+// "a=1,b=2" into pairs
+std::vector<std::pair<std::string, unsigned>> pairs(const std::string& value) {
+    std::vector<std::pair<std::string, unsigned>> result;
+    for (std::size_t start = 0; start <= value.size();) {
+        auto end  = std::min(value.find(',', start), value.size());
+        auto item = value.substr(start, end - start);
+        if (!item.empty()) {
+            auto eq = item.find('=');
+            if (eq == std::string::npos) {
+                throw std::invalid_argument(item);
+            }
+            result.emplace_back(item.substr(0, eq), static_cast<unsigned>(std::stoul(item.substr(eq + 1))));
+        }
+        start = end + 1;
+    }
+    return result;
+}
+
+// 512, 4K, 1M, 1G
+std::size_t parseSize(const std::string& value) {
+    std::size_t used = 0;
+    auto        size = static_cast<std::size_t>(std::stoull(value, &used));
+    auto        unit = value.substr(used);
+    if (unit == "K") {
+        return size << 10; // NOLINT
+    }
+    if (unit == "M") {
+        return size << 20; // NOLINT
+    }
+    if (unit == "G") {
+        return size << 30; // NOLINT
+    }
+    if (!unit.empty()) {
+        throw std::invalid_argument(value);
+    }
+    return size;
+}
+
+SQLiteFS::Options::JournalMode parseJournal(const std::string& value) {
+    using Mode = SQLiteFS::Options::JournalMode;
+
+    constexpr std::array<std::pair<const char*, Mode>, 7> modes{{{"default", Mode::DEFAULT},
+                                                                 {"delete", Mode::DELETE},
+                                                                 {"truncate", Mode::TRUNCATE},
+                                                                 {"persist", Mode::PERSIST},
+                                                                 {"memory", Mode::MEMORY},
+                                                                 {"wal", Mode::WAL},
+                                                                 {"off", Mode::OFF}}};
+    for (const auto& [name, mode] : modes) {
+        if (value == name) {
+            return mode;
+        }
+    }
+    throw std::invalid_argument(value);
+}
+
+bool parse(int argc, char** argv, Args& args) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (!arg.starts_with("--")) {
+            args.db = arg;
+            continue;
+        }
+        if (i + 1 == argc) {
+            return false;
+        }
+
+        std::string value = argv[++i];
+        if (arg == "--key") {
+            args.key = value;
+        } else if (arg == "--threads") {
+            args.threads = std::max(static_cast<unsigned>(std::stoul(value)), 1U);
+        } else if (arg == "--seconds") {
+            args.seconds = static_cast<unsigned>(std::stoul(value));
+        } else if (arg == "--interval") {
+            args.interval_ms = std::max(static_cast<unsigned>(std::stoul(value)), 1U);
+        } else if (arg == "--mix") {
+            args.mix.fill(0);
+            for (const auto& [name, weight] : pairs(value)) {
+                auto it = std::ranges::find_if(OP_NAMES, [&](const char* op) { return name == op; });
+                if (it == OP_NAMES.end()) {
+                    return false;
+                }
+                args.mix[static_cast<std::size_t>(it - OP_NAMES.begin())] = weight;
+            }
+        } else if (arg == "--sizes") {
+            args.sizes.clear();
+            for (const auto& [size, weight] : pairs(value)) {
+                args.sizes.push_back({.size = std::max(parseSize(size), std::size_t{1}), .weight = weight});
+            }
+        } else if (arg == "--fanout") {
+            args.fanout = std::max(static_cast<unsigned>(std::stoul(value)), 1U);
+        } else if (arg == "--depth") {
+            args.depth = static_cast<unsigned>(std::stoul(value));
+        } else if (arg == "--files") {
+            args.files = std::stoul(value);
+        } else if (arg == "--alg") {
+            args.alg = value;
+        } else if (arg == "--journal") {
+            args.options.journal_mode = parseJournal(value);
+        } else if (arg == "--seed") {
+            args.seed = static_cast<std::uint32_t>(std::stoul(value));
+        } else {
+            return false;
+        }
+    }
+
+    auto size_weights = std::accumulate(
+      args.sizes.begin(), args.sizes.end(), 0U, [](unsigned total, const SizeWeight& item) { return total + item.weight; });
+    return !args.db.empty() && size_weights > 0 && std::accumulate(args.mix.begin(), args.mix.end(), 0U) > 0;
+}
+
+// fanout^depth leaf folders, created level by level
+std::vector<std::string> makeTree(SQLiteFS& fs, const Args& args) {
+    // the root is "" so children are "/name"
+    std::vector<std::string> level{""};
+    for (unsigned d = 0; d < args.depth; ++d) {
+        std::vector<std::string> next;
+        for (const auto& parent : level) {
+            for (unsigned i = 0; i < args.fanout; ++i) {
+                auto path = parent + "/d" + std::to_string(i);
+                if (!fs.exists(path) && !fs.mkdir(path)) {
+                    return {};
+                }
+                next.push_back(std::move(path));
+            }
+        }
+        level = std::move(next);
+    }
+    if (level.size() == 1 && level.front().empty()) {
+        level.front() = "/";
+    }
+    return level;
+}
+
+// every thread works with its own files spread over the shared folders, so a failed operation
+// is a real error and not a race with another thread. Names carry the run, so a run can follow
+// another one on the same database
+class Worker {
+public:
+    Worker(SQLiteFS&                       fs,
+           const Args&                     args,
+           const std::vector<std::string>& folders,
+           const SQLiteFS::DataOutput&     data,
+           const std::string&              run,
+           unsigned                        id,
+           Counters&                       counters)
+      : m_fs(fs)
+      , m_args(args)
+      , m_folders(folders)
+      , m_data(data)
+      , m_prefix("r" + run + "-t" + std::to_string(id) + "-")
+      , m_counters(counters)
+      , m_random(args.seed + id)
+      , m_op(args.mix.begin(), args.mix.end())
+      , m_folder(0, folders.size() - 1) {
+        std::vector<unsigned> weights;
+        for (const auto& size : args.sizes) {
+            weights.push_back(size.weight);
+        }
+        m_size = std::discrete_distribution<std::size_t>(weights.begin(), weights.end());
+    }
+
+    // the share of the initial files of this thread, not timed
+    bool fill(std::size_t count) {
+        for (std::size_t i = 0; i < count; ++i) {
+            if (!write()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void run(const std::atomic<bool>& stop) {
+        using Clock = std::chrono::steady_clock;
+
+        while (!stop.load(std::memory_order_relaxed)) {
+            auto op = static_cast<Op>(m_op(m_random));
+            // nothing to read, move or remove yet
+            if (m_files.empty() && op != Op::LS) {
+                op = Op::WRITE;
+            }
+
+            auto start   = Clock::now();
+            bool success = call(op);
+            auto end     = Clock::now();
+
+            auto index = static_cast<std::size_t>(op);
+            m_counters.latency[index].add(
+              static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()));
+            if (!success) {
+                m_counters.errors[index].fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    bool call(Op op) {
+        switch (op) {
+        case Op::READ:
+            return !m_fs.read(m_files[pick()]).empty();
+        case Op::WRITE:
+            return write();
+        case Op::LS:
+            // an empty folder is a valid result, failures can't be told apart from it
+            m_fs.ls(m_folders[m_folder(m_random)]);
+            return true;
+        case Op::MV: {
+            auto index = pick();
+            auto path  = newPath();
+            if (!m_fs.mv(m_files[index], path)) {
+                return false;
+            }
+            m_files[index] = std::move(path);
+            return true;
+        }
+        case Op::RM: {
+            auto index = pick();
+            std::swap(m_files[index], m_files.back());
+            auto path = std::move(m_files.back());
+            m_files.pop_back();
+            return m_fs.rm(path);
+        }
+        case Op::COUNT:
+            break;
+        }
+        return false;
+    }
+
+    bool write() {
+        const auto& bound = m_args.sizes[m_size(m_random)];
+        auto        size  = std::uniform_int_distribution<std::size_t>(bound.size / 2 + 1, bound.size)(m_random);
+        auto        from  = std::uniform_int_distribution<std::size_t>(0, m_data.size() - size)(m_random);
+
+        auto path = newPath();
+        if (!m_fs.write(path, SQLiteFS::DataInput(m_data).subspan(from, size), m_args.alg)) {
+            return false;
+        }
+        m_files.push_back(std::move(path));
+        return true;
+    }
+
+    std::size_t pick() {
+        return std::uniform_int_distribution<std::size_t>(0, m_files.size() - 1)(m_random);
+    }
+
+    std::string newPath() {
+        const auto& folder = m_folders[m_folder(m_random)];
+        return (folder.ends_with('/') ? folder : folder + "/") + m_prefix + std::to_string(m_next++);
+    }
+
+private:
+    SQLiteFS&                       m_fs;
+    const Args&                     m_args;
+    const std::vector<std::string>& m_folders;
+    const SQLiteFS::DataOutput&     m_data;
+    std::string                     m_prefix; // "r<run>-t<thread>-"
+    Counters&                       m_counters;
+
+    std::mt19937_64                            m_random;
+    std::discrete_distribution<std::size_t>    m_op;
+    std::discrete_distribution<std::size_t>    m_size;
+    std::uniform_int_distribution<std::size_t> m_folder;
+
+    std::vector<std::string> m_files;
+    std::uint64_t            m_next = 0;
+};
+
+// one line per operation with any calls between the two snapshots
+void print(const std::string& time, const Snapshot& from, const Snapshot& to, double seconds) {
+    for (std::size_t op = 0; op < OP_NAMES.size(); ++op) {
+        std::vector<std::uint64_t> counts(Histogram::BUCKETS);
+        std::uint64_t              total = 0;
+        for (std::size_t i = 0; i < Histogram::BUCKETS; ++i) {
+            counts[i]  = to.counts[op * Histogram::BUCKETS + i] - from.counts[op * Histogram::BUCKETS + i];
+            total     += counts[i];
+        }
+        if (total == 0) {
+            continue;
+        }
+
+        // value of the bucket the rank falls into, in microseconds
+        auto percentile = [&](double share) {
+            auto          rank = static_cast<std::uint64_t>(share * static_cast<double>(total - 1)) + 1;
+            std::uint64_t seen = 0;
+            for (std::size_t i = 0; i < Histogram::BUCKETS; ++i) {
+                seen += counts[i];
+                if (seen >= rank) {
+                    return static_cast<double>(Histogram::value(i)) / 1000.0; // NOLINT
+                }
+            }
+            return 0.0;
+        };
+
+        std::printf("%s,%s,%llu,%.1f,%.1f,%.1f,%.1f,%.1f,%llu\n",
+                    time.c_str(),
+                    OP_NAMES[op],
+                    static_cast<unsigned long long>(total),
+                    static_cast<double>(total) / seconds,
+                    percentile(0.5),   // NOLINT
+                    percentile(0.99),  // NOLINT
+                    percentile(0.999), // NOLINT
+                    percentile(1.0),
+                    static_cast<unsigned long long>(to.errors[op] - from.errors[op]));
+    }
+    std::fflush(stdout);
+}
+
+} // namespace
+
+
+int main(int argc, char** argv) {
+    using Clock = std::chrono::steady_clock;
+
+    Args args;
+    try {
+        if (!parse(argc, argv, args)) {
+            usage();
+            return EXIT_FAILURE;
+        }
+    } catch (std::exception&) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    SQLiteFS fs(args.db, args.key, args.options);
+    auto     folders = makeTree(fs, args);
+    if (folders.empty()) {
+        std::fprintf(stderr, "can't create the tree: %s\n", fs.error().c_str());
+        return EXIT_FAILURE;
+    }
+
+    // random, so codecs don't get it for free. Files are slices of it
+    SQLiteFS::DataOutput data(std::ranges::max(args.sizes, {}, &SizeWeight::size).size);
+    std::mt19937         random(args.seed);
+    std::ranges::generate(data, [&] { return static_cast<SQLiteFS::Data>(random()); });
+
+    // files of earlier runs stay in the tree, new names must not collide with them
+    const auto run = std::to_string(
+      std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch())
+        .count());
+
+    std::vector<std::unique_ptr<Counters>> counters;
+    std::vector<std::unique_ptr<Worker>>   workers;
+    for (unsigned i = 0; i < args.threads; ++i) {
+        counters.push_back(std::make_unique<Counters>());
+        workers.push_back(std::make_unique<Worker>(fs, args, folders, data, run, i, *counters.back()));
+        if (!workers.back()->fill(args.files / args.threads + (i < args.files % args.threads ? 1 : 0))) {
+            std::fprintf(stderr, "can't write the initial files: %s\n", fs.error().c_str());
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::fprintf(stderr,
+                 "run %s, %u threads, %zu folders, %zu initial files, %u s\n",
+                 run.c_str(),
+                 args.threads,
+                 folders.size(),
+                 args.files,
+                 args.seconds);
+    std::printf("time_s,op,ops,ops_per_s,p50_us,p99_us,p999_us,max_us,errors\n");
+
+    std::atomic<bool>         stop = false;
+    std::vector<std::jthread> pool;
+    for (auto& worker : workers) {
+        pool.emplace_back([&stop, &worker] { worker->run(stop); });
+    }
+
+    Snapshot first;
+    Snapshot previous;
+    Snapshot current;
+    auto     start = Clock::now();
+    auto     last  = start;
+    auto     until = start + std::chrono::seconds(args.seconds);
+    for (auto next = start + std::chrono::milliseconds(args.interval_ms); last < until;
+         next += std::chrono::milliseconds(args.interval_ms)) {
+        std::this_thread::sleep_until(std::min(next, until));
+
+        auto now = Clock::now();
+        current.take(counters);
+        print(std::to_string(std::chrono::duration<double>(now - start).count()),
+              previous,
+              current,
+              std::chrono::duration<double>(now - last).count());
+        std::swap(previous, current);
+        last = now;
+    }
+
+    stop = true;
+    pool.clear();
+
+    // whatever finished after the last interval is in the total too
+    current.take(counters);
+    print("total", first, current, std::chrono::duration<double>(Clock::now() - start).count());
+
+    fs.error();
+    return EXIT_SUCCESS;
+}